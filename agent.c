@@ -0,0 +1,532 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+//
+//	This program is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU General Public License
+//	as published by the Free Software Foundation; either version 2
+//	of the License, or (at your option) any later version.
+//
+//	This program is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with this program; if not, write to the Free Software
+//	Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+//
+//-----------------------------------------------------------------------------
+
+// agent.c
+// The frames exchanged with a picp agent (see agent.h): the client side,
+// which is the agent:host:port transport plus AgentCall() for whole
+// operations, and the socket handling for the agent itself. What the
+// agent does with each request is in main.c.
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+
+#ifdef WIN32
+#include	<windows.h>
+#define	false	FALSE
+#define	true	TRUE
+#else
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<netinet/in.h>
+#include	<netinet/tcp.h>
+#include	<netdb.h>
+#include	<poll.h>
+#include	<errno.h>
+#include	<unistd.h>
+#endif
+
+#include	"agent.h"
+
+#define AGENT_IN_SIZE		4096			// the agent never sends a frame bigger than this
+
+//-----------------------------------------------------------------------------
+// lengths and addresses go most significant byte first
+
+void AgentPutLong(unsigned char *theBytes, unsigned int value)
+{
+	theBytes[0] = (value >> 24) & 0xff;
+	theBytes[1] = (value >> 16) & 0xff;
+	theBytes[2] = (value >> 8) & 0xff;
+	theBytes[3] = value & 0xff;
+}
+
+unsigned int AgentGetLong(const unsigned char *theBytes)
+{
+	return (theBytes[0] << 24) | (theBytes[1] << 16) | (theBytes[2] << 8) | theBytes[3];
+}
+
+#ifndef WIN32
+
+//-----------------------------------------------------------------------------
+// write all of theBytes, waiting for room if the socket is non-blocking
+
+static bool SendAll(int theSocket, const unsigned char *theBytes, unsigned int numBytes)
+{
+	struct pollfd	pollSocket;
+	int				numSent;
+
+	while (numBytes)
+	{
+		if ((numSent = send(theSocket, theBytes, numBytes, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN)
+				return false;
+
+			pollSocket.fd = theSocket;
+			pollSocket.events = POLLOUT;
+			pollSocket.revents = 0;
+			poll(&pollSocket, 1, -1);
+			continue;
+		}
+
+		theBytes += numSent;
+		numBytes -= numSent;
+	}
+
+	return true;
+}
+
+// read exactly numBytes from a blocking socket
+static bool ReceiveAll(int theSocket, unsigned char *theBytes, unsigned int numBytes)
+{
+	int	numRead;
+
+	while (numBytes)
+	{
+		if ((numRead = recv(theSocket, theBytes, numBytes, 0)) <= 0)
+		{
+			if (numRead < 0 && errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		theBytes += numRead;
+		numBytes -= numRead;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// send one frame
+
+bool AgentSend(int theSocket, unsigned char type, const unsigned char *payload, unsigned int length)
+{
+	unsigned char	header[AGENT_FRAME_HEADER];
+
+	header[0] = type;
+	AgentPutLong(&header[1], length);
+	return SendAll(theSocket, header, sizeof(header)) && SendAll(theSocket, payload, length);
+}
+
+//-----------------------------------------------------------------------------
+// receive one frame (blocking), return false if the connection is closed
+// or the frame is too big for payload
+
+bool AgentReceive(int theSocket, unsigned char *type, unsigned char *payload, unsigned int maxLength, unsigned int *length)
+{
+	unsigned char	header[AGENT_FRAME_HEADER];
+
+	if (!ReceiveAll(theSocket, header, sizeof(header)))
+		return false;
+
+	*type = header[0];
+	*length = AgentGetLong(&header[1]);
+
+	if (*length > maxLength)
+	{
+		fprintf(stderr, "agent frame of %u bytes is too big\n", *length);
+		return false;
+	}
+
+	return ReceiveAll(theSocket, payload, *length);
+}
+
+//-----------------------------------------------------------------------------
+// listen for clients on [host:]port, return the socket or -1
+// The agent has no authentication, so without a host it only listens on
+// 127.0.0.1; a host of * listens on every interface.
+
+int AgentListen(const char *address)
+{
+	struct addrinfo	hints, *addrs, *addr;
+	char					host[256];
+	const char			*port;
+	int					listener, on;
+
+	host[0] = '\0';
+
+	if ((port = strrchr(address, ':')))
+	{
+		if ((size_t) (port - address) >= sizeof(host))
+			return -1;
+
+		memcpy(host, address, port - address);
+		host[port - address] = '\0';
+		port++;
+	}
+	else
+		port = address;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if (!host[0])
+		strcpy(host, "127.0.0.1");
+
+	if (getaddrinfo(strcmp(host, "*") ? host : NULL, port, &hints, &addrs) != 0)
+	{
+		fprintf(stderr, "can't listen on %s\n", address);
+		return -1;
+	}
+
+	listener = -1;
+
+	for (addr = addrs; addr; addr = addr->ai_next)
+	{
+		if ((listener = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) == -1)
+			continue;
+
+		on = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(listener, addr->ai_addr, addr->ai_addrlen) == 0 && listen(listener, 1) == 0)
+			break;
+
+		close(listener);
+		listener = -1;
+	}
+
+	freeaddrinfo(addrs);
+	return listener;
+}
+
+//-----------------------------------------------------------------------------
+// wait for the next client, return its socket or -1
+
+int AgentAccept(int listener)
+{
+	int	theSocket, on;
+
+	while ((theSocket = accept(listener, NULL, NULL)) == -1 && errno == EINTR)
+		;
+
+	if (theSocket != -1)
+	{
+		on = 1;
+		setsockopt(theSocket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+
+	return theSocket;
+}
+
+//-----------------------------------------------------------------------------
+// The client side: agent:host:port
+// Frames from the agent are collected in 'in' as they arrive. Programmer
+// bytes move on to 'data' until picp reads them; the answer to an operation
+// waits in 'result' for AgentCall.
+
+typedef struct
+{
+	unsigned char	in[AGENT_IN_SIZE];
+	unsigned int	inCount;
+	unsigned char	*data;					// programmer bytes not yet read
+	unsigned int	dataStart, dataCount, dataSize;
+	unsigned char	result[64];
+	unsigned int	resultLength;
+	bool				resultReady;
+	unsigned int	progress;				// last AGENT_PROGRESS value
+	bool				progressReady;
+	bool				closed;					// the agent has gone away
+} AGENT_STATE;
+
+static bool AgentKeepData(AGENT_STATE *agent, const unsigned char *theBytes, unsigned int numBytes)
+{
+	unsigned char	*more;
+
+	if (agent->dataStart)						// move what's left to the front
+	{
+		memmove(agent->data, &agent->data[agent->dataStart], agent->dataCount);
+		agent->dataStart = 0;
+	}
+
+	if (agent->dataCount + numBytes > agent->dataSize)
+	{
+		if (!(more = (unsigned char *) realloc(agent->data, agent->dataCount + numBytes + AGENT_IN_SIZE)))
+			return false;
+
+		agent->data = more;
+		agent->dataSize = agent->dataCount + numBytes + AGENT_IN_SIZE;
+	}
+
+	memcpy(&agent->data[agent->dataCount], theBytes, numBytes);
+	agent->dataCount += numBytes;
+	return true;
+}
+
+// take in whatever the agent has sent, and sort out the complete frames
+static void AgentPump(LINK *link)
+{
+	AGENT_STATE		*agent = (AGENT_STATE *) link->state;
+	unsigned int	used, length;
+	unsigned char	*frame;
+	int				numRead;
+
+	while (!agent->closed && agent->inCount < sizeof(agent->in))
+	{
+		numRead = recv(link->theDevice, &agent->in[agent->inCount], sizeof(agent->in) - agent->inCount, MSG_DONTWAIT);
+
+		if (numRead > 0)
+			agent->inCount += numRead;
+		else if (numRead == 0 || (errno != EAGAIN && errno != EINTR))
+			agent->closed = true;
+		else
+			break;
+	}
+
+	used = 0;
+
+	while (agent->inCount - used >= AGENT_FRAME_HEADER)
+	{
+		frame = &agent->in[used];
+		length = AgentGetLong(&frame[1]);
+
+		if (length > sizeof(agent->in) - AGENT_FRAME_HEADER)
+		{
+			fprintf(stderr, "agent sent a frame of %u bytes\n", length);
+			agent->closed = true;
+			break;
+		}
+
+		if (agent->inCount - used < AGENT_FRAME_HEADER + length)
+			break;										// the rest hasn't arrived yet
+
+		frame += AGENT_FRAME_HEADER;
+
+		switch (frame[-AGENT_FRAME_HEADER])
+		{
+			case AGENT_DATA:
+				if (!AgentKeepData(agent, frame, length))
+					agent->closed = true;
+				break;
+
+			case AGENT_PROGRESS:
+				if (length >= 4)
+				{
+					agent->progress = AgentGetLong(frame);
+					agent->progressReady = true;
+				}
+				break;
+
+			case AGENT_RESULT:
+				agent->resultLength = (length < sizeof(agent->result)) ? length : sizeof(agent->result);
+				memcpy(agent->result, frame, agent->resultLength);
+				agent->resultReady = true;
+				break;
+		}
+
+		used += AGENT_FRAME_HEADER + length;
+	}
+
+	if (used)
+	{
+		memmove(agent->in, &agent->in[used], agent->inCount - used);
+		agent->inCount -= used;
+	}
+}
+
+static void AgentClose(LINK *link)
+{
+	AGENT_STATE	*agent = (AGENT_STATE *) link->state;
+
+	if (agent)
+	{
+		free(agent->data);
+		free(agent);
+	}
+
+	close(link->theDevice);
+}
+
+static bool AgentOpen(LINK *link, const char *name)
+{
+	if (!(link->state = calloc(1, sizeof(AGENT_STATE))))
+		return false;
+
+	if (!tcpTransport.open(link, name))
+	{
+		free(link->state);
+		return false;
+	}
+
+	return true;
+}
+
+static int AgentRead(LINK *link, struct iovec *iov, int count)
+{
+	AGENT_STATE		*agent = (AGENT_STATE *) link->state;
+	int				i, numRead;
+	unsigned int	n;
+
+	AgentPump(link);
+	numRead = 0;
+
+	for (i=0; i<count && agent->dataCount; i++)
+	{
+		n = (iov[i].iov_len < agent->dataCount) ? iov[i].iov_len : agent->dataCount;
+		memcpy(iov[i].iov_base, &agent->data[agent->dataStart], n);
+		agent->dataStart += n;
+		agent->dataCount -= n;
+		numRead += n;
+	}
+
+	if (!numRead && agent->closed)
+	{
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	return numRead;
+}
+
+static bool AgentWait(LINK *link, unsigned int timeOut)
+{
+	AGENT_STATE	*agent = (AGENT_STATE *) link->state;
+
+	AgentPump(link);
+
+	while (!agent->dataCount && !agent->closed)	// a wakeup may only bring part of a frame
+	{
+		if (!FdWait(link, timeOut))
+			return false;
+
+		AgentPump(link);
+	}
+
+	return true;
+}
+
+static int AgentWrite(LINK *link, const unsigned char *theBytes, unsigned int numBytes)
+{
+	return AgentSend(link->theDevice, AGENT_DATA, theBytes, numBytes) ? numBytes : -1;
+}
+
+static void AgentFlush(LINK *link)
+{
+	AGENT_STATE	*agent = (AGENT_STATE *) link->state;
+
+	AgentSend(link->theDevice, AGENT_FLUSH, NULL, 0);
+	AgentPump(link);
+	agent->dataStart = agent->dataCount = 0;
+}
+
+static void AgentSetDTR(LINK *link, bool DTR)
+{
+	unsigned char	value = DTR ? 1 : 0;
+
+	AgentSend(link->theDevice, AGENT_DTR, &value, 1);
+}
+
+// The agent resets the programmer and watches CTS itself (AGENT_RESET), so
+// the lines are never looked at from here.
+
+const TRANSPORT agentTransport =
+{
+	"agent:", false, AgentOpen, AgentRead, AgentWait, AgentWrite, AgentFlush, NULL, AgentSetDTR, AgentClose
+};
+
+//-----------------------------------------------------------------------------
+// send a request to the agent and wait for its result, calling progress
+// with each AGENT_PROGRESS that comes in meanwhile. The reply is padded
+// with zeros if the agent sent less than replyBytes.
+// Return false if the agent doesn't answer
+
+bool AgentCall(LINK *link, unsigned char type, const unsigned char *request, unsigned int requestBytes,
+	unsigned char *reply, unsigned int replyBytes, void (*progress)(unsigned int))
+{
+	AGENT_STATE	*agent = (AGENT_STATE *) link->state;
+
+	agent->resultReady = false;
+	agent->progressReady = false;
+
+	if (!AgentSend(link->theDevice, type, request, requestBytes))
+		return false;
+
+	while (!agent->resultReady)
+	{
+		if (agent->closed)
+		{
+			fprintf(stderr, "lost connection to the agent\n");
+			return false;
+		}
+
+		if (!FdWait(link, AGENT_TIMEOUT))
+		{
+			fprintf(stderr, "no answer from the agent\n");
+			return false;
+		}
+
+		AgentPump(link);
+
+		if (agent->progressReady && progress)
+			progress(agent->progress);
+
+		agent->progressReady = false;
+	}
+
+	memset(reply, 0, replyBytes);
+	memcpy(reply, agent->result, (agent->resultLength < replyBytes) ? agent->resultLength : replyBytes);
+	return true;
+}
+
+#else		// WIN32
+
+// The agent and agent:host:port are only available on Linux/Unix.
+
+bool AgentSend(int theSocket, unsigned char type, const unsigned char *payload, unsigned int length)
+{
+	return false;
+}
+
+bool AgentReceive(int theSocket, unsigned char *type, unsigned char *payload, unsigned int maxLength, unsigned int *length)
+{
+	return false;
+}
+
+int AgentListen(const char *address)
+{
+	return -1;
+}
+
+int AgentAccept(int listener)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,70 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+
+#ifndef __AGENT_H_
+#define __AGENT_H_
+
+#ifdef WIN32
+#define	bool	int
+#endif
+
+// A picp agent (picp --agent) sits next to the programmer and is reached
+// with the device name agent:host:port. Everything between them travels in
+// frames: a type byte, a four byte length (most significant byte first),
+// then that many bytes. AGENT_DATA frames carry the ordinary byte stream to
+// and from the programmer. The other requests have the agent run a whole
+// echo-checked operation itself and answer with one AGENT_RESULT frame, so
+// a network round trip is paid once per operation instead of once per word.
+
+#define AGENT_DATA			0x01		// bytes to or from the programmer
+#define AGENT_DTR				0x02		// set DTR (1 byte, 0 = low)
+#define AGENT_FLUSH			0x03		// discard anything received from the programmer
+#define AGENT_RESET			0x04		// reset the programmer (4 byte pulse), result: ok
+#define AGENT_SET_RANGE		0x05		// header, start, length, result: ok
+#define AGENT_WRITE_PGM		0x06		// header, start, size, stop, words, result: ok, mismatch, confirmed
+#define AGENT_WRITE_DATA	0x07		// header, size, bytes, result: ok, mismatch
+#define AGENT_PROGRESS		0x08		// from the agent while writing: bytes echoed so far
+#define AGENT_RESULT			0x09		// from the agent: the answer to a request
+
+#define AGENT_FRAME_HEADER	5			// type and length
+#define AGENT_MAX_FRAME		0x20100	// largest payload (a full program space write)
+#define AGENT_TIMEOUT		30000000	// give up on the agent if it's silent this long (in microseconds)
+
+// Every operation request starts with what the agent needs to know about
+// the client's device and programmer
+
+#define AGENT_NAME_SIZE		32			// device name, nul terminated
+#define AGENT_OP_HEADER		(AGENT_NAME_SIZE + 4)	// name, programmer, flags, pipeline window
+
+#define AGENT_FLAG_ISP		0x01		// ISPflag
+#define AGENT_FLAG_OLD_FW	0x02		// oldFirmware
+#define AGENT_FLAG_NOWRITE	0x04		// suppressWrite
+
+void				AgentPutLong(unsigned char *theBytes, unsigned int value);
+unsigned int	AgentGetLong(const unsigned char *theBytes);
+bool				AgentSend(int theSocket, unsigned char type, const unsigned char *payload, unsigned int length);
+bool				AgentReceive(int theSocket, unsigned char *type, unsigned char *payload, unsigned int maxLength, unsigned int *length);
+int				AgentListen(const char *address);
+int				AgentAccept(int listener);
+
+#ifndef WIN32
+#include "transport.h"
+
+bool	AgentCall(LINK *link, unsigned char type, const unsigned char *request, unsigned int requestBytes,
+			unsigned char *reply, unsigned int replyBytes, void (*progress)(unsigned int));
+#endif
+
+#endif // defined __AGENT_H_
@@ -0,0 +1,293 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+//
+//	This program is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU General Public License
+//	as published by the Free Software Foundation; either version 2
+//	of the License, or (at your option) any later version.
+//
+//	This program is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with this program; if not, write to the Free Software
+//	Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+//
+//-----------------------------------------------------------------------------
+
+// image.c
+// A hex file held in memory by device region, and the planner that turns
+// it into the writes that program it. See image.h.
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+
+#ifdef WIN32
+#define	false	FALSE
+#define	true	TRUE
+#endif
+
+#include	"parse.h"
+#include	"image.h"
+
+//-----------------------------------------------------------------------------
+// start with no regions
+
+void ImageInit(IMAGE *image)
+{
+	memset(image, 0, sizeof(IMAGE));
+}
+
+//-----------------------------------------------------------------------------
+// give the image a region of size bytes starting at hex file address base,
+// all blank. A size of 0 leaves the region out.
+// Return false if there isn't enough memory
+
+bool ImageSetRegion(IMAGE *image, int region, unsigned int base, unsigned int size, unsigned short blank)
+{
+	IMAGE_REGION	*theRegion = &image->region[region];
+	unsigned int	i;
+
+	free(theRegion->data);
+	free(theRegion->present);
+	memset(theRegion, 0, sizeof(IMAGE_REGION));
+	theRegion->base = base;
+	theRegion->blank = blank;
+
+	if (!size)
+		return true;
+
+	theRegion->data = (unsigned char *) malloc(size);
+	theRegion->present = (unsigned char *) calloc(size, 1);
+
+	if (!theRegion->data || !theRegion->present)
+	{
+		fprintf(stderr, "failed to malloc %u bytes\n", size);
+		return false;
+	}
+
+	for (i=0; i<size; i++)
+		theRegion->data[i] = (i & 1) ? (blank >> 8) : (blank & 0xff);
+
+	theRegion->size = size;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// put a byte into a region as if the file had it
+
+void ImageSetByte(IMAGE *image, int region, unsigned int offset, unsigned char data)
+{
+	IMAGE_REGION	*theRegion = &image->region[region];
+
+	theRegion->data[offset] = data;
+	theRegion->present[offset] = 1;
+
+	if (theRegion->low == theRegion->high)
+	{
+		theRegion->low = offset;
+		theRegion->high = offset + 1;
+	}
+	else if (offset < theRegion->low)
+		theRegion->low = offset;
+	else if (offset >= theRegion->high)
+		theRegion->high = offset + 1;
+}
+
+//-----------------------------------------------------------------------------
+// read a whole hex file into the image. Where regions overlap, the one
+// listed last in image.h gets the byte (osc cal sits inside program memory).
+// Return false if the file has a byte that no region holds
+
+bool ImageLoad(IMAGE *image, FILE *theFile)
+{
+	IMAGE_REGION	*theRegion;
+	unsigned int	address, offset;
+	unsigned char	data;
+	int				region;
+
+	InitParse();
+
+	while (GetNextByte(theFile, &address, &data))
+	{
+		for (region = IMAGE_REGIONS - 1; region >= 0; region--)
+		{
+			theRegion = &image->region[region];
+			offset = address - theRegion->base;
+
+			if (address >= theRegion->base && offset < theRegion->size)
+				break;
+		}
+
+		if (region < 0)
+		{
+			fprintf(stderr, "Invalid address in hex file: 0x%x is outside the device\n", address);
+			return false;
+		}
+
+		ImageSetByte(image, region, offset, data);
+		image->bytes++;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// return true if the file has any bytes in a range of a region
+
+bool ImagePresent(const IMAGE *image, int region, unsigned int start, unsigned int size)
+{
+	const IMAGE_REGION	*theRegion = &image->region[region];
+	unsigned int			i;
+
+	for (i=start; i < start + size && i < theRegion->size; i++)
+	{
+		if (theRegion->present[i])
+			return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// forget the file's bytes in a range of a region, so the plan leaves the
+// range alone. The values are kept: a write that has to span the range
+// still sends them.
+
+void ImageForget(IMAGE *image, int region, unsigned int start, unsigned int size)
+{
+	IMAGE_REGION	*theRegion = &image->region[region];
+
+	if (start < theRegion->size)
+		memset(&theRegion->present[start], 0, (size < theRegion->size - start) ? size : theRegion->size - start);
+}
+
+void ImageFree(IMAGE *image)
+{
+	int	i;
+
+	for (i=0; i<IMAGE_REGIONS; i++)
+	{
+		free(image->region[i].data);
+		free(image->region[i].present);
+	}
+
+	ImageInit(image);
+}
+
+//-----------------------------------------------------------------------------
+// add a write to the plan, or stretch the last one if it is for the same
+// region and no more than mergeGap bytes away
+
+static bool PlanAdd(PLAN *plan, int region, unsigned int start, unsigned int end, unsigned int mergeGap)
+{
+	PLAN_STEP	*last, *newStep;
+
+	last = plan->count ? &plan->step[plan->count - 1] : NULL;
+
+	if (last && last->region == region && start <= last->start + last->size + mergeGap)
+	{
+		if (end > last->start + last->size)
+			last->size = end - last->start;
+
+		return true;
+	}
+
+	if (plan->count == plan->room)
+	{
+		plan->room = plan->room ? plan->room * 2 : 16;
+
+		if (!(newStep = (PLAN_STEP *) realloc(plan->step, plan->room * sizeof(PLAN_STEP))))
+		{
+			fprintf(stderr, "failed to malloc %u bytes\n", (unsigned int) (plan->room * sizeof(PLAN_STEP)));
+			return false;
+		}
+
+		plan->step = newStep;
+	}
+
+	plan->step[plan->count].region = region;
+	plan->step[plan->count].start = start;
+	plan->step[plan->count].size = end - start;
+	plan->count++;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// add the writes that program one region of the image to the plan. Every
+// write starts and ends on a multiple of align bytes. Runs of the file's
+// bytes separated by mergeGap bytes or less go in one write, the gap
+// filled with blank (when a new write costs more than the padding does,
+// and only where writing blank changes nothing, so 0 otherwise).
+// With fromZero the region is written in one piece from its first byte,
+// for programmers and regions that can't start anywhere else.
+// A region the file doesn't touch adds nothing.
+// Return false if there isn't enough memory
+
+bool ImagePlan(const IMAGE *image, int region, unsigned int align, unsigned int mergeGap, bool fromZero, PLAN *plan)
+{
+	const IMAGE_REGION	*theRegion = &image->region[region];
+	unsigned int			start, end, padded, low, high;
+
+	low = theRegion->low;
+	high = theRegion->high;
+
+	while (low < high && !theRegion->present[low])		// some bytes may have been forgotten
+		low++;
+
+	while (high > low && !theRegion->present[high - 1])
+		high--;
+
+	if (low == high)
+		return true;
+
+	if (!align)
+		align = 1;
+
+	if (fromZero)
+	{
+		padded = (high + align - 1) / align * align;
+		return PlanAdd(plan, region, 0, (padded < theRegion->size) ? padded : theRegion->size, 0);
+	}
+
+	for (start = low; start < high; start = end)
+	{
+		while (start < high && !theRegion->present[start])
+			start++;
+
+		if (start >= high)
+			break;
+
+		for (end = start; end < high && theRegion->present[end]; end++)
+			;
+
+		padded = (end + align - 1) / align * align;
+
+		if (!PlanAdd(plan, region, start / align * align, (padded < theRegion->size) ? padded : theRegion->size, mergeGap))
+			return false;
+	}
+
+	return true;
+}
+
+void PlanFree(PLAN *plan)
+{
+	free(plan->step);
+	memset(plan, 0, sizeof(PLAN));
+}
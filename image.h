@@ -0,0 +1,83 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+
+#ifndef __IMAGE_H_
+#define __IMAGE_H_
+
+#include <stdio.h>
+
+#ifdef WIN32
+#define	bool	int
+#endif
+
+// A hex file loaded into memory, split into the regions of the device it
+// is meant for. Each region keeps the file's bytes at their offset from
+// the region's base address, the unprogrammed value everywhere else, and
+// a map of which bytes the file actually supplied, so nothing depends on
+// the order or the size of the records in the file.
+//
+// The regions are listed in the order they are written: configuration
+// goes last since it may protect the rest.
+
+#define IMAGE_PGM			0			// program memory
+#define IMAGE_OSCCAL		1			// oscillator calibration (the end of program memory on most parts)
+#define IMAGE_ID			2			// ID locations
+#define IMAGE_DATA		3			// data EEPROM
+#define IMAGE_CFG			4			// configuration bits
+#define IMAGE_REGIONS	5
+
+typedef struct
+{
+	unsigned int	base;					// hex file (byte) address of the first byte
+	unsigned int	size;					// in bytes, 0 if the device doesn't have this region
+	unsigned char	*data;				// blank where the file has nothing
+	unsigned char	*present;			// non-zero where the file has a byte
+	unsigned int	low, high;			// no byte present before low or from high on (equal if none)
+	unsigned short	blank;				// unprogrammed value, a little endian word
+} IMAGE_REGION;
+
+typedef struct
+{
+	IMAGE_REGION	region[IMAGE_REGIONS];
+	unsigned int	bytes;				// bytes loaded from the file
+} IMAGE;
+
+// One write: a run of bytes within a region, padded with the region's
+// blank value wherever the file has nothing
+
+typedef struct
+{
+	unsigned char	region;				// IMAGE_xxx
+	unsigned int	start, size;		// offset into the region, and length (in bytes)
+} PLAN_STEP;
+
+typedef struct
+{
+	PLAN_STEP		*step;
+	unsigned int	count, room;
+} PLAN;
+
+void	ImageInit(IMAGE *image);
+bool	ImageSetRegion(IMAGE *image, int region, unsigned int base, unsigned int size, unsigned short blank);
+void	ImageSetByte(IMAGE *image, int region, unsigned int offset, unsigned char data);
+bool	ImageLoad(IMAGE *image, FILE *theFile);
+bool	ImagePresent(const IMAGE *image, int region, unsigned int start, unsigned int size);
+void	ImageForget(IMAGE *image, int region, unsigned int start, unsigned int size);
+void	ImageFree(IMAGE *image);
+bool	ImagePlan(const IMAGE *image, int region, unsigned int align, unsigned int mergeGap, bool fromZero, PLAN *plan);
+void	PlanFree(PLAN *plan);
+
+#endif // defined __IMAGE_H_
@@ -0,0 +1,375 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+//
+//	This program is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU General Public License
+//	as published by the Free Software Foundation; either version 2
+//	of the License, or (at your option) any later version.
+//
+//	This program is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with this program; if not, write to the Free Software
+//	Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+//
+//-----------------------------------------------------------------------------
+
+// ioloop.c
+// Event driven I/O for any number of open programmer ports.
+// Each port registers a handler (its protocol state machine), which is
+// called from IoLoopRun whenever the port becomes readable or writable,
+// or its timeout expires. Everything runs in one thread.
+//
+// Call IoLoopCreate() once, IoLoopAdd() for each port, then IoLoopRun().
+// IoLoopRun() returns when every port has been removed (normally by its
+// own handler when it is finished).
+//
+// epoll only sees the device, not the bytes serial.c has already taken
+// off it into the port's receive ring, so a port whose ring still holds
+// data is handed IO_READABLE again without waiting for epoll.
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+
+#ifdef WIN32
+#include	<windows.h>
+#define	false	FALSE
+#define	true	TRUE
+#endif
+
+#ifdef __linux__
+#include	<sys/epoll.h>
+#include	<time.h>
+#include	<errno.h>
+#include	<unistd.h>
+#endif
+
+#include	"ioloop.h"
+#include	"serial.h"
+
+#define MAX_EVENTS		64			// events collected per epoll_wait call
+
+struct io_loop
+{
+	int				epollDevice;	// the epoll instance
+	IO_PORT			**ports;			// registered ports (NULL = removed slot)
+	unsigned int	numPorts;		// slots in use in ports[]
+	unsigned int	maxPorts;		// slots allocated in ports[]
+	unsigned int	active;			// ports still registered
+};
+
+#ifdef __linux__
+
+//-----------------------------------------------------------------------------
+// return the current time in microseconds
+
+static unsigned long long GetTime()
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//-----------------------------------------------------------------------------
+// convert IO_xxx events to epoll events
+
+static unsigned int EpollEvents(unsigned int events)
+{
+	unsigned int	epollEvents = 0;
+
+	if (events & IO_READABLE)
+		epollEvents |= EPOLLIN;
+
+	if (events & IO_WRITABLE)
+		epollEvents |= EPOLLOUT;
+
+	return epollEvents;
+}
+
+//-----------------------------------------------------------------------------
+// create an event loop, return NULL if it can't be done
+
+IO_LOOP *IoLoopCreate()
+{
+	IO_LOOP	*loop;
+
+	if (!(loop = (IO_LOOP *) malloc(sizeof(IO_LOOP))))
+		return NULL;
+
+	memset(loop, 0, sizeof(IO_LOOP));
+
+	if ((loop->epollDevice = epoll_create1(0)) == -1)
+	{
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+//-----------------------------------------------------------------------------
+// dispose of an event loop (the ports themselves are left open)
+
+void IoLoopDestroy(IO_LOOP *loop)
+{
+	close(loop->epollDevice);
+	free(loop->ports);
+	free(loop);
+}
+
+//-----------------------------------------------------------------------------
+// register port with loop, waiting for the given events
+// return false if there is a problem
+
+bool IoLoopAdd(IO_LOOP *loop, IO_PORT *port, unsigned int events)
+{
+	struct epoll_event	ev;
+	IO_PORT					**ports;
+
+	if (loop->numPorts == loop->maxPorts)
+	{
+		ports = (IO_PORT **) realloc(loop->ports, (loop->maxPorts + 16) * sizeof(IO_PORT *));
+
+		if (!ports)
+			return false;
+
+		loop->ports = ports;
+		loop->maxPorts += 16;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EpollEvents(events);
+	ev.data.ptr = port;
+
+	if (epoll_ctl(loop->epollDevice, EPOLL_CTL_ADD, port->theDevice, &ev) == -1)
+		return false;
+
+	port->events = events;
+	port->deadline = 0;
+	port->loop = loop;
+	loop->ports[loop->numPorts++] = port;
+	loop->active++;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// change the events a registered port is waiting for
+
+bool IoLoopModify(IO_PORT *port, unsigned int events)
+{
+	struct epoll_event	ev;
+
+	if (!port->loop)
+		return false;
+
+	if (events == port->events)
+		return true;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EpollEvents(events);
+	ev.data.ptr = port;
+
+	if (epoll_ctl(port->loop->epollDevice, EPOLL_CTL_MOD, port->theDevice, &ev) == -1)
+		return false;
+
+	port->events = events;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// stop delivering events to port (safe to call from any handler)
+
+void IoLoopRemove(IO_PORT *port)
+{
+	unsigned int	i;
+	IO_LOOP			*loop;
+
+	if (!(loop = port->loop))
+		return;
+
+	epoll_ctl(loop->epollDevice, EPOLL_CTL_DEL, port->theDevice, NULL);
+
+	for (i=0; i<loop->numPorts; i++)
+	{
+		if (loop->ports[i] == port)
+		{
+			loop->ports[i] = NULL;			// slot is reclaimed by IoLoopRun
+			break;
+		}
+	}
+
+	port->loop = NULL;
+	port->deadline = 0;
+	loop->active--;
+}
+
+//-----------------------------------------------------------------------------
+// deliver IO_TIMEOUT to port if nothing else happens within timeOut
+// microseconds (0 cancels the timeout)
+
+void IoSetTimeout(IO_PORT *port, unsigned int timeOut)
+{
+	port->deadline = timeOut ? GetTime() + timeOut : 0;
+}
+
+//-----------------------------------------------------------------------------
+// return true if port wants IO_READABLE and its receive ring already
+// holds bytes, which epoll can't know about
+
+static bool Buffered(IO_LOOP *loop, IO_PORT *port)
+{
+	return port && port->loop == loop && (port->events & IO_READABLE) && BytesBuffered(port->theDevice) > 0;
+}
+
+//-----------------------------------------------------------------------------
+// deliver events until no ports are left
+// return false if the wait itself failed
+
+bool IoLoopRun(IO_LOOP *loop)
+{
+	struct epoll_event	evs[MAX_EVENTS];
+	unsigned long long	now, next;
+	unsigned int			i, j, events;
+	int						numEvents, wait;
+	IO_PORT					*port;
+
+	while (loop->active)
+	{
+		for (i=j=0; i<loop->numPorts; i++)		// squeeze out removed ports
+		{
+			if (loop->ports[i])
+				loop->ports[j++] = loop->ports[i];
+		}
+
+		loop->numPorts = j;
+		now = GetTime();
+		next = 0;
+
+		for (i=0; i<loop->numPorts; i++)			// find the next timeout due
+		{
+			if (loop->ports[i]->deadline && (!next || loop->ports[i]->deadline < next))
+				next = loop->ports[i]->deadline;
+		}
+
+		if (!next)
+			wait = -1;									// nothing timed, wait for events
+		else if (next <= now)
+			wait = 0;
+		else
+			wait = (int) ((next - now + 999) / 1000);
+
+		for (i=0; i<loop->numPorts && wait; i++)	// data already in a ring, don't sleep
+		{
+			if (Buffered(loop, loop->ports[i]))
+				wait = 0;
+		}
+
+		numEvents = epoll_wait(loop->epollDevice, evs, MAX_EVENTS, wait);
+
+		if (numEvents < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		for (i=0; i<(unsigned int) numEvents; i++)
+		{
+			port = (IO_PORT *) evs[i].data.ptr;
+
+			if (port->loop != loop)					// removed by an earlier handler
+				continue;
+
+			events = 0;
+
+			if (evs[i].events & EPOLLIN)
+				events |= IO_READABLE;
+
+			if (evs[i].events & EPOLLOUT)
+				events |= IO_WRITABLE;
+
+			if (evs[i].events & (EPOLLERR | EPOLLHUP))
+				events |= IO_ERROR;
+
+			port->handler(port, events);
+		}
+
+		for (i=0; i<loop->numPorts; i++)			// then what the rings still hold
+		{
+			if (Buffered(loop, loop->ports[i]))
+				loop->ports[i]->handler(loop->ports[i], IO_READABLE);
+		}
+
+		now = GetTime();
+
+		for (i=0; i<loop->numPorts; i++)			// then anything whose time is up
+		{
+			port = loop->ports[i];
+
+			if (port && port->loop == loop && port->deadline && port->deadline <= now)
+			{
+				port->deadline = 0;
+				port->handler(port, IO_TIMEOUT);
+			}
+		}
+	}
+
+	return true;
+}
+
+#else		// not linux
+
+// Only available on Linux (epoll), callers fall back to one port at a time.
+
+IO_LOOP *IoLoopCreate()
+{
+	return NULL;
+}
+
+void IoLoopDestroy(IO_LOOP *loop)
+{
+}
+
+bool IoLoopAdd(IO_LOOP *loop, IO_PORT *port, unsigned int events)
+{
+	return false;
+}
+
+bool IoLoopModify(IO_PORT *port, unsigned int events)
+{
+	return false;
+}
+
+void IoLoopRemove(IO_PORT *port)
+{
+}
+
+void IoSetTimeout(IO_PORT *port, unsigned int timeOut)
+{
+}
+
+bool IoLoopRun(IO_LOOP *loop)
+{
+	return false;
+}
+
+#endif
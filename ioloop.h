@@ -0,0 +1,57 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+
+#ifndef __IOLOOP_H_
+#define __IOLOOP_H_
+
+#ifdef WIN32
+#define	bool	int
+#endif
+
+// events delivered to a port's handler
+
+#define IO_READABLE		0x01		// data is waiting at the device
+#define IO_WRITABLE		0x02		// device will accept more data
+#define IO_TIMEOUT		0x04		// the port's timeout expired
+#define IO_ERROR			0x08		// error or hangup on the device
+
+typedef struct io_port IO_PORT;
+typedef struct io_loop IO_LOOP;
+
+typedef void IO_HANDLER(IO_PORT *port, unsigned int events);
+
+// One open programmer port. The caller owns this structure and must keep
+// it valid until IoLoopRun returns.
+
+struct io_port
+{
+	int						theDevice;		// device handle from OpenDevice
+	IO_HANDLER				*handler;		// protocol state machine for this port
+	void						*state;			// handler's private state
+	unsigned int			events;			// IO_READABLE and/or IO_WRITABLE wanted
+	unsigned long long	deadline;		// when the timeout expires, in microseconds (0 = none)
+	IO_LOOP					*loop;			// loop this port is registered with (NULL = none)
+};
+
+IO_LOOP	*IoLoopCreate();
+void		IoLoopDestroy(IO_LOOP *loop);
+bool		IoLoopAdd(IO_LOOP *loop, IO_PORT *port, unsigned int events);
+bool		IoLoopModify(IO_PORT *port, unsigned int events);
+void		IoLoopRemove(IO_PORT *port);
+void		IoSetTimeout(IO_PORT *port, unsigned int timeOut);
+bool		IoLoopRun(IO_LOOP *loop);
+
+#endif // defined __IOLOOP_H_
@@ -66,6 +66,7 @@
 #include <string.h>
 #include <errno.h>
 #include	<time.h>
+#include	<sys/time.h>
 
 #ifdef WIN32
 #include	<windows.h>
@@ -73,6 +74,9 @@
 #define	usleep(x)	Sleep((x) / 1000)
 #define	false	FALSE
 #define	true	TRUE
+#else
+#include	<fcntl.h>
+#include	<sys/file.h>
 #endif
 
 #include "atoi_base.h"
@@ -80,12 +84,21 @@
 #include "serial.h"
 #include "picdev.h"
 #include "record.h"
+#include "ioloop.h"
+#include "agent.h"
+#include "trace.h"
+#include "image.h"
 
 #define TIMEOUT_1_SECOND	1000000			// 1 second time to wait for a character before giving up (in microseconds)
 #define TIMEOUT_2_SECOND	2000000			// 2 second timeout for erasing flash
 #define TIMEOUT_5_SECOND	5000000			// 5 second timeout for 18Fxx devices
 
-#define BUFFERSIZE		0x20000			// buffer bigger than anyone should need
+#define TIMING_SAMPLES		64					// response times remembered for each command
+#define TIMING_MIN_SAMPLES	16					// samples needed before a command's timeout adapts
+#define TIMING_UPDATE		8					// recompute the timeout after this many new samples
+#define TIMING_MULTIPLE		4					// timeout is this multiple of the observed p99
+#define TIMING_FLOOR			20000				// but never less than 20 ms (in microseconds)
+
 #define MAXNAMESLEN		80					// max number of characters on a line when reporting device names
 
 #define	OLD_PICDEV_DEFXSIZE	16
@@ -128,10 +141,75 @@
 
 #define HASH_WIDTH_DEFAULT		40			// default width of the status bar
 
+#define PIPE_WINDOW_DEFAULT	8			// default number of program words kept in flight while writing
+#define PIPE_WINDOW_MAX			256		// don't let more than this many words go unanswered
+#define RESYNC_RETRIES			3			// times to resynchronize and resume a failed program write
+#define RESYNC_QUIET				50000		// line must be quiet this long after a reset (in microseconds)
+#define LATENCY_PINGS			4			// pings used to measure the round trip time
+#define PROBE_COUNT_DEFAULT	100		// --probe-link round trips of each kind
+#define PROBE_MAX_ERRORS		0			// a healthy link loses no echoes
+#define PROBE_MAX_P99			20000		// or takes longer than this to answer a ping (in microseconds, 99th percentile)
+#define PROBE_MIN_THROUGHPUT	40			// or echoes set range commands at less than this percentage of the line rate
+
+#define BAUD_DEFAULT				19200		// PICSTART Plus speed
+#define BAUD_PROBE_PINGS		3			// model and version requests that must all succeed at a probed speed
+#define BAUD_PROBE_TIMEOUT		100000	// how long to wait for an answer while probing (in microseconds)
+#define RESET_PULSE_MAX			250000	// reset pulse known to work with every programmer (in microseconds)
+#define CTS_TIMEOUT				100000	// allow 100 ms for CTS to show up after a reset (in microseconds)
+
+#define PORT_FILE					".picpports"	// speeds and reset pulses learned for each port, kept in the home directory
+#define FIRMWARE_FILE			".picpfirmware"	// set range write test results for each programmer firmware, kept there too
+#define FRAME_MAX					16			// frames up to this size are sent in one piece
+#define AGENT_PROGRESS_STEP	64			// echoed bytes between progress reports to an agent's client
+#define PLAN_MERGE_WORDS		8			// program words in a gap that cost less than starting a new write
+													// (set range, write command and trailing zero), so the gap is
+													// filled with blank words instead (on a blank device only)
+#define READ_CHUNK_WORDS		32			// program words handled at a time as a read arrives
+#define SETRANGE_TEST_WORDS	16			// program words TestSetRangeReads looks at for two that differ
+#define ERASE_FLASH_ESTIMATE	100000	// bulk erase time assumed until one has been timed (in microseconds)
+#define EEPROM_BYTE_ESTIMATE	5000		// time to write back one EEPROM byte after a bulk erase (in microseconds)
+#define BLANK_CHECK_ESTIMATE	250000	// blank check time assumed until one has been timed (in microseconds)
+#define BLANK_CHECK_WAIT		30000000	// longest wait for a blank check still answering 0xef (in microseconds)
+#define ERASE_INVALID			(~0ULL)	// cost of an erase method the device can't use
+
+// Ways to erase program memory (see DoEraseAuto)
+
+#define ERASE_BULK				0			// CMD_ERASE_FLASH, with the regions to keep read first and written back
+#define ERASE_STREAM				1			// write a blank word to every address
+#define ERASE_METHODS			2
+
+// What set range was found to do on a programmer listed with QUIRK_SETRANGE_PC (see SetRangeAtZero)
+
+#define SETRANGE_UNTESTED		0			// not looked at yet
+#define SETRANGE_UNKNOWN		1			// looked at, but couldn't tell
+#define SETRANGE_WORKS			2			// goes where it is asked
+#define SETRANGE_AT_ZERO		3			// starts at zero
+
+// Programmer quirks (see quirkList)
+
+#define QUIRK_LOCKSTEP			0x01		// each byte must echo back before the next one is sent
+#define QUIRK_SETRANGE_PC		0x02		// set range resets the programmer's address to zero
+
+#define MODE_ISP					0x01		// programming through the ISP connector
+#define MODE_18F					0x02		// programming an 18xxx device
+
 // Prototypes
 
 static bool DoInitPIC(const PIC_DEFINITION *picDevice);
-static bool DoErasePgm(const PIC_DEFINITION *picDevice, bool flag);
+static bool PingProgrammer();
+static bool ResetProgrammer();
+static bool LearnResetPulse(unsigned int pulse);
+static bool Resync(const PIC_DEFINITION *picDevice);
+static bool ResyncProgrammer(const PIC_DEFINITION *picDevice);
+static void LoadPortInfo(const char *name, unsigned int *rate, unsigned int *pulse);
+static void SavePortInfo(const char *name, unsigned int rate, unsigned int pulse);
+static bool LoadLearned(const char *file, const char *key, char *line, int size);
+static int LockLearned(const char *file);
+static void UnlockLearned(int lock);
+static void SaveLearned(const char *file, const char *key, const char *line);
+static bool SetRangeAtZero(const PIC_DEFINITION *picDevice, bool writing);
+static bool IsFlashDevice(const PIC_DEFINITION *picDevice);
+static bool DoErasePgm(const PIC_DEFINITION *picDevice, bool flag, bool keepOscCal);
 static bool DoEraseData(const PIC_DEFINITION *picDevice, bool flag);
 static bool DoEraseConfigBits(const PIC_DEFINITION *picDevice);
 static bool DoEraseIDLocs(const PIC_DEFINITION *picDevice);
@@ -139,6 +217,9 @@ static unsigned short int	GetPgmSize(const PIC_DEFINITION *picDevice);
 static unsigned short int	GetDataSize(const PIC_DEFINITION *picDevice);
 static unsigned int			GetIDSize(const PIC_DEFINITION *picDevice);
 static unsigned int			GetConfigSize(const PIC_DEFINITION *picDevice);
+static void ShowHashMark(unsigned short int curOps);
+static bool WriteEepromImage(const PIC_DEFINITION *picDevice, unsigned int datasize);
+static void AgentShowProgress(unsigned int curOps);
 
 // Struct definitions
 
@@ -151,6 +232,13 @@ typedef struct
 
 typedef unsigned short int SIZEFNCT(const PIC_DEFINITION *);
 
+typedef struct
+{
+	unsigned short	programmer;		// programmer(s) this applies to (P_PICSTART, etc)
+	unsigned char	mode;				// MODE_xxx conditions that must all be present
+	unsigned char	quirks;			// QUIRK_xxx behaviour needed under those conditions
+} PGM_QUIRK;
+
 typedef struct
 {
 	unsigned char	mask;
@@ -174,15 +262,75 @@ static const BLANK_MSG blankList[] =
 	{0,0,""},
 };
 
+// Known protocol quirks of the supported programmers. Anything not listed
+// here is assumed to handle whole command frames and pipelined data.
+// Whether a Warp-13's firmware really has QUIRK_SETRANGE_PC is found out
+// when it matters, and remembered per firmware version (see SetRangeAtZero).
+
+static const PGM_QUIRK quirkList[] =
+{
+	{P_WARP13,	MODE_ISP,	QUIRK_LOCKSTEP},
+	{P_WARP13,	MODE_18F,	QUIRK_LOCKSTEP | QUIRK_SETRANGE_PC},
+	{0,0,0},
+};
+
+// Response time history for the commands whose timing matters. While a
+// command is selected (see SelectTiming) every wait for the programmer is
+// limited to a small multiple of the slowest responses seen so far, so a
+// dead link is noticed in milliseconds, but never longer than maxTimeout.
+
+typedef struct
+{
+	unsigned char	cmd;								// command code (0 = anything not listed, never adapted)
+	unsigned int	maxTimeout;						// fixed timeout until adapted, and upper bound (0 = CharTimeout)
+	unsigned int	count;							// samples taken so far
+	unsigned int	samples[TIMING_SAMPLES];	// most recent response times (microseconds)
+	unsigned int	p99;								// 99th percentile of samples[]
+	unsigned int	timeOut;							// adapted timeout (0 = not adapted yet)
+} CMD_TIMING;
+
+static CMD_TIMING cmdTiming[] =
+{
+	{0,						0},
+	{CMD_WRITE_PGM,		0},
+	{CMD_SET_ADDR,			0},
+	{CMD_BLANK_CHECK,		TIMEOUT_5_SECOND},
+	{CMD_ERASE_FLASH,		TIMEOUT_5_SECOND},
+};
+
+#define NUM_TIMINGS	(sizeof(cmdTiming) / sizeof(cmdTiming[0]))
+
+static CMD_TIMING	*curTiming = &cmdTiming[0];
+
+// Shorter reset pulse to try for each programmer. These are starting points,
+// not measured values: a pulse is only remembered for a port after a reset
+// with it has been seen to happen (CTS dropped while DTR was held low) and
+// the programmer answered afterwards. A port whose programmer doesn't answer
+// after its remembered pulse is reset again with the full RESET_PULSE_MAX,
+// and double the pulse is tried the same way.
+
+typedef struct
+{
+	unsigned short	programmer;			// P_xxx
+	unsigned int	pulse;				// microseconds
+} RESET_PULSE;
+
+static const RESET_PULSE resetPulseList[] =
+{
+	{P_PICSTART,	50000},
+	{P_WARP13,		20000},
+	{P_JUPIC,		20000},
+	{P_OLIMEX,		50000},
+	{0,				RESET_PULSE_MAX},
+};
+
 static char	*programName, *deviceName, *picName;
 
 static VERSION		PICversion;
 unsigned int		picFWVersion = 0;
 
 FILE	*comm_debug;
-int	comm_debug_count = 0;
 bool	writingProgram = false;
-bool	sendCommand = false;
 bool	is18device = false;
 
 unsigned short	programmerSupport = P_PICSTART;	// supported programmer
@@ -199,11 +347,31 @@ static int			serialDevice;
 static unsigned int			CharTimeout = TIMEOUT_1_SECOND;	// default 1 second timeout
 static unsigned short int	readConfigBits[16];	// config bits read back from device
 static unsigned int			hashWidth;				// width of status bar (0 = none)
+static unsigned int			pipeWindow = PIPE_WINDOW_DEFAULT;	// program words in flight while writing (1 = lockstep)
+static unsigned int			resyncRetries = RESYNC_RETRIES;	// resynchronize and resume this many times per write
+static unsigned int			baudRate = BAUD_DEFAULT;		// serial speed in use
+static bool						baudAuto = false;					// find the speed (--baud auto)
+
+static unsigned int			resetPulse = RESET_PULSE_MAX;	// how long DTR is held low to reset the programmer
+static bool						pulseLearned = false;			// resetPulse came from the port file
+static bool						resetSeen = false;				// CTS was down at the end of the last reset pulse
+static bool						linkDegraded = false;			// --probe-link found the link below par
+static bool						pgmBlank = false;					// program memory is known to be blank (erased or blank checked)
+
+static int						agentClient = -1;					// client being served by picp --agent (-1 = none)
+static unsigned int			agentProgress;						// progress last reported to it
+static unsigned char			*agentFrame;						// the request it is making
+static bool						agentDeviceLost;					// the agent's programmer port has failed
+
+static const unsigned int	baudList[] = {115200, 57600, 38400, 19200, 9600, 0};	// speeds to probe, fastest first
 static int			oldFirmware = false;
 static unsigned int	w13version = 0;
+static int				setRangeReads = SETRANGE_UNTESTED;	// what TestSetRangeReads found
+static int				setRangeWrites = SETRANGE_UNTESTED;	// what --test-setrange found (or saved in FIRMWARE_FILE)
 
 static unsigned char	oscCalData[MAX_OSC_CAL_SIZE];
 static unsigned char eepromData[MAX_EEPROM_DATA_SIZE + 2];
+static unsigned char eepromEcho[MAX_EEPROM_DATA_SIZE + 2];
 
 //  status bar handling
 static unsigned short int	hashMod, hashNum;
@@ -213,11 +381,40 @@ static unsigned short int	hashMod, hashNum;
 
 static void ResetPICSTART()
 {
+	bool	CTS, DCD;
+
 	SetDTR(serialDevice, false);			// lower DTR to reset PICSTART Plus
-	usleep(1000000/4);						// sleep for a quarter second (to let PS+ reset)
+	usleep(resetPulse);						// long enough for this programmer to reset
+	GetDeviceStatus(serialDevice, &CTS, &DCD);
+	resetSeen = !CTS;							// the programmer really is in reset
 	SetDTR(serialDevice, true);			// raise DTR
 }
 
+//-----------------------------------------------------------------------------
+// add the serial receive statistics and adapted timeouts to the comm debug log
+
+static void LogSerialStats()
+{
+	SERIAL_STATS	stats;
+	unsigned int	i;
+
+	if (comm_debug && GetSerialStats(serialDevice, &stats))
+	{
+		TracePrintf("\nSerial receive: %lu reads, %lu system calls, %lu avoided, %lu bytes\n",
+			stats.readCalls, stats.readSyscalls, stats.syscallsAvoided, stats.bytesRead);
+	}
+
+	if (comm_debug)
+	{
+		for (i=0; i<NUM_TIMINGS; i++)
+		{
+			if (cmdTiming[i].timeOut)
+				TracePrintf("Command 0x%02x: %u samples, p99 %u us, timeout %u us\n",
+					cmdTiming[i].cmd, cmdTiming[i].count, cmdTiming[i].p99, cmdTiming[i].timeOut);
+		}
+	}
+}
+
 //-----------------------------------------------------------------------------
 // process signals (any signal will cause us to exit)
 
@@ -297,7 +494,7 @@ static unsigned short int GetDataSize(const PIC_DEFINITION *picDevice)
 //-----------------------------------------------------------------------------
 // return the start address of the data space of the specified device
 
-static unsigned short int GetDataStart(const PIC_DEFINITION *picDevice)
+static unsigned int GetDataStart(const PIC_DEFINITION *picDevice)
 {
 	return (picDevice->eeaddr) ? picDevice->eeaddr :
 		(unsigned) (picDevice->def[PD_DATA_ADDRH] * 256 +
@@ -374,6 +571,146 @@ static unsigned short int GetWordWidth(const PIC_DEFINITION *picDevice)
 	return (picDevice->def[PD_PGM_WIDTHH]) << 8 | picDevice->def[PD_PGM_WIDTHL];
 }
 
+//-----------------------------------------------------------------------------
+// return the current time in microseconds
+
+static unsigned long long GetMicroseconds()
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+//-----------------------------------------------------------------------------
+// select the response time history used for the following waits,
+// return the previous selection so it can be restored
+
+static unsigned char SelectTiming(unsigned char cmd)
+{
+	unsigned char	prev;
+	unsigned int	i;
+
+	prev = curTiming->cmd;
+	curTiming = &cmdTiming[0];
+
+	for (i=1; i<NUM_TIMINGS; i++)
+	{
+		if (cmdTiming[i].cmd == cmd)
+		{
+			curTiming = &cmdTiming[i];
+			break;
+		}
+	}
+
+	return prev;
+}
+
+//-----------------------------------------------------------------------------
+// return how long to wait for the programmer under the selected command
+
+static unsigned int CommandTimeout()
+{
+	unsigned int	maxTimeout;
+
+	maxTimeout = curTiming->maxTimeout ? curTiming->maxTimeout : CharTimeout;
+
+	if (curTiming->timeOut && curTiming->timeOut < maxTimeout)
+		return curTiming->timeOut;
+
+	return maxTimeout;
+}
+
+//-----------------------------------------------------------------------------
+// add a response time to the selected command's history, and every so
+// often work out a new timeout from its 99th percentile. Commands that
+// aren't listed don't adapt: they range from one byte pings to whole
+// region reads and writes, so no one timeout fits them all.
+
+static void RecordTiming(unsigned int usec)
+{
+	unsigned int	i, j, n, temp, sorted[TIMING_SAMPLES];
+	unsigned long long	timeOut;
+
+	if (!curTiming->cmd)
+		return;									// keep CharTimeout
+
+	curTiming->samples[curTiming->count++ % TIMING_SAMPLES] = usec;
+
+	if (curTiming->count < TIMING_MIN_SAMPLES || (curTiming->count % TIMING_UPDATE))
+		return;
+
+	n = (curTiming->count < TIMING_SAMPLES) ? curTiming->count : TIMING_SAMPLES;
+	memcpy(sorted, curTiming->samples, n * sizeof(unsigned int));
+
+	for (i=1; i<n; i++)							// small, so insertion sort
+	{
+		temp = sorted[i];
+
+		for (j=i; j>0 && sorted[j - 1] > temp; j--)
+			sorted[j] = sorted[j - 1];
+
+		sorted[j] = temp;
+	}
+
+	curTiming->p99 = sorted[(n * 99 + 99) / 100 - 1];
+	timeOut = (unsigned long long) curTiming->p99 * TIMING_MULTIPLE;
+
+	if (timeOut < TIMING_FLOOR)
+		timeOut = TIMING_FLOOR;
+
+	curTiming->timeOut = (timeOut > 0xffffffff) ? 0xffffffff : (unsigned int) timeOut;
+}
+
+//-----------------------------------------------------------------------------
+// return how long a command usually takes the programmer (the 99th
+// percentile, or the last response until there are enough), guess if it
+// hasn't been timed yet
+
+static unsigned int TimingEstimate(unsigned char cmd, unsigned int guess)
+{
+	unsigned int	i;
+
+	for (i=1; i<NUM_TIMINGS; i++)
+	{
+		if (cmdTiming[i].cmd == cmd && cmdTiming[i].count)
+		{
+			if (cmdTiming[i].p99)
+				return cmdTiming[i].p99;
+
+			return cmdTiming[i].samples[(cmdTiming[i].count - 1) % TIMING_SAMPLES];
+		}
+	}
+
+	return guess;
+}
+
+//-----------------------------------------------------------------------------
+// read from the programmer with the selected command's timeout.
+// Only waits that actually went to the device are recorded (bytes already
+// buffered say nothing about the programmer). A timeout is recorded as a
+// sample too, so a timeout that turns out to be too short grows again.
+
+static int TimedRead(unsigned char *rtnBuff, unsigned int rtnBytes)
+{
+	bool					buffered;
+	int					numRead;
+	unsigned int		timeOut;
+	unsigned long long	start;
+
+	buffered = (BytesBuffered(serialDevice) > 0);
+	timeOut = CommandTimeout();
+	start = GetMicroseconds();
+	numRead = ReadBytes(serialDevice, rtnBuff, rtnBytes, timeOut);
+
+	if (numRead == 0)
+		RecordTiming(timeOut);
+	else if (numRead > 0 && !buffered)
+		RecordTiming((unsigned int) (GetMicroseconds() - start));
+
+	return numRead;
+}
+
 //-----------------------------------------------------------------------------
 //	send a message to the programmer, wait for a specified number of bytes to be returned
 //  If false is returned, there was a timeout, or some other error
@@ -388,13 +725,12 @@ static bool SendMsg(const unsigned char *cmdBuff, unsigned int cmdBytes, unsigne
 
 	if (cmdBytes)
 	{
-		if (comm_debug)
+		if (comm_debug && !writingProgram)
 		{
-			if (!writingProgram)
-			{
-				fprintf(comm_debug, "\n");
-				comm_debug_count = 0;
-			}
+			TracePrintf("\n");
+
+			if (cmdBytes == 1)
+				TraceContext(cmdBuff[0]);		// a command byte, tag what follows with it
 		}
 
 		WriteBytes(serialDevice, (unsigned char *) &cmdBuff[0], cmdBytes);	// send out the command
@@ -406,7 +742,7 @@ static bool SendMsg(const unsigned char *cmdBuff, unsigned int cmdBytes, unsigne
 	{
 		while (bytesRemaining && !fail)
 		{
-			numRead = ReadBytes(serialDevice, &rtnBuff[rtnBytes - bytesRemaining], bytesRemaining, CharTimeout);
+			numRead = TimedRead(&rtnBuff[rtnBytes - bytesRemaining], bytesRemaining);
 
 			if (numRead < 0)
 			{
@@ -432,6 +768,7 @@ static bool SendMsg(const unsigned char *cmdBuff, unsigned int cmdBytes, unsigne
 
 //-----------------------------------------------------------------------------
 //	send a message to the programmer, wait for each byte to be returned
+//	(only used where the programmer needs it, see QUIRK_LOCKSTEP)
 //  If false is returned, there was a timeout, or some other error
 
 static bool SendMsgWait(const unsigned char *cmdBuff, unsigned int cmdBytes, unsigned char *rtnBuff, unsigned int rtnBytes)
@@ -445,10 +782,7 @@ static bool SendMsgWait(const unsigned char *cmdBuff, unsigned int cmdBytes, uns
 	bytesRemaining = rtnBytes;
 
 	if (comm_debug && !writingProgram)
-	{
-		comm_debug_count = 0;
-		fprintf(comm_debug, "\n");
-	}
+		TracePrintf("\n");
 
 	for (i=0; i<cmdBytes && bytesRemaining && !fail; i++)
 	{
@@ -456,7 +790,7 @@ static bool SendMsgWait(const unsigned char *cmdBuff, unsigned int cmdBytes, uns
 
 		if (!suppressWrite)
 		{
-			numRead = ReadBytes(serialDevice, &rtnBuff[i], 1, CharTimeout);
+			numRead = TimedRead(&rtnBuff[i], 1);
 
 			if (numRead < 0)
 			{
@@ -479,6 +813,273 @@ static bool SendMsgWait(const unsigned char *cmdBuff, unsigned int cmdBytes, uns
 	return(!fail);
 }
 
+//-----------------------------------------------------------------------------
+//	stream a block of bytes to the programmer, keeping up to 'window' bytes
+//	in flight, and compare each echoed byte with what was sent as it arrives.
+//	*mismatch is set to the offset of the first byte that didn't echo back
+//	correctly (it is left alone if everything matched). If stopOnMismatch is
+//	true nothing more is sent once that happens.
+//	If received is not NULL, it is set to the number of echoes collected.
+//	If showHash is true, the status bar follows the echoes.
+//  If false is returned, there was a timeout, or some other error
+
+static bool SendMsgStream(const unsigned char *cmdBuff, unsigned int cmdBytes, unsigned char *rtnBuff, unsigned int window, int *mismatch, bool stopOnMismatch, unsigned int *received, bool showHash)
+{
+	bool				fail;
+	int				numRead;
+	unsigned int	i, sent, rcvd, count;
+
+	fail = false;
+	sent = rcvd = 0;
+
+	if (!window)
+		window = 1;
+
+	while (rcvd < cmdBytes && !fail && !(stopOnMismatch && *mismatch >= 0))
+	{
+		if (sent < cmdBytes && (sent - rcvd) < window)	// room in the window, send some more
+		{
+			count = window - (sent - rcvd);
+
+			if (count > cmdBytes - sent)
+				count = cmdBytes - sent;
+
+			WriteBytes(serialDevice, (unsigned char *) &cmdBuff[sent], count);
+			sent += count;
+		}
+
+		if (!suppressWrite)
+		{
+			numRead = TimedRead(&rtnBuff[rcvd], sent - rcvd);
+
+			if (numRead < 0)
+			{
+				fprintf(stderr, "error %d, %s\n", errno, strerror(errno));
+				fail = true;
+			}
+			else if (numRead == 0)		// timed out
+				fail = true;
+		}
+		else
+		{
+			numRead = sent - rcvd;
+
+			for (i=rcvd; i<sent; i++)
+				rtnBuff[i] = cmdBuff[i];
+		}
+
+		if (!fail)
+		{
+			for (i=rcvd; i < rcvd + numRead; i++)		// check the echoes that just came in
+			{
+				if (rtnBuff[i] != cmdBuff[i] && *mismatch < 0)
+					*mismatch = i;
+			}
+
+			rcvd += numRead;
+
+			if (showHash)
+				ShowHashMark(rcvd);
+		}
+	}
+
+	if (received)
+		*received = rcvd;
+
+	return(!fail);
+}
+
+//-----------------------------------------------------------------------------
+//	return the quirks of the attached programmer in the current mode
+
+static unsigned char GetQuirks()
+{
+	int				idx;
+	unsigned char	mode, quirks;
+
+	mode = 0;
+	quirks = 0;
+
+	if (ISPflag)
+		mode |= MODE_ISP;
+
+	if (is18device)
+		mode |= MODE_18F;
+
+	for (idx=0; quirkList[idx].programmer; idx++)
+	{
+		if ((programmerSupport & quirkList[idx].programmer) && (mode & quirkList[idx].mode) == quirkList[idx].mode)
+			quirks |= quirkList[idx].quirks;
+	}
+
+	return quirks;
+}
+
+//-----------------------------------------------------------------------------
+//	send a complete frame to the programmer and collect its echo in rtnBuff.
+//	Short frames go out in one write, longer ones are streamed through the
+//	pipeline window. Programmers that need byte lockstep get it here.
+//	If mismatch is not NULL, *mismatch is set to the offset of the first byte
+//	that didn't echo back correctly, or -1 if the whole frame matched.
+//  If false is returned, there was a timeout, or some other error
+
+static bool SendFrame(const unsigned char *cmdBuff, unsigned int cmdBytes, unsigned char *rtnBuff, int *mismatch)
+{
+	bool				fail;
+	int				first;
+	unsigned int	i;
+
+	first = -1;
+
+	if (GetQuirks() & QUIRK_LOCKSTEP)
+	{
+		fail = !SendMsgWait(cmdBuff, cmdBytes, rtnBuff, cmdBytes);
+
+		for (i=0; !fail && i<cmdBytes; i++)
+		{
+			if (rtnBuff[i] != cmdBuff[i])
+			{
+				first = i;
+				break;
+			}
+		}
+	}
+	else
+		fail = !SendMsgStream(cmdBuff, cmdBytes, rtnBuff, (cmdBytes <= FRAME_MAX) ? cmdBytes : pipeWindow * 2, &first, false, NULL, false);
+
+	if (mismatch)
+		*mismatch = first;
+
+	return(!fail);
+}
+
+//-----------------------------------------------------------------------------
+//	Talking to a picp agent (agent:host:port, see agent.h). The agent runs
+//	the echo-checked operations next to the programmer, each request starts
+//	with what it needs to know about the device and the programmer.
+//	Returns the number of bytes used.
+
+static unsigned int PutAgentHeader(const PIC_DEFINITION *picDevice, unsigned char *request)
+{
+	memset(request, 0, AGENT_OP_HEADER);
+	strncpy((char *) request, picDevice->name, AGENT_NAME_SIZE - 1);
+	request[AGENT_NAME_SIZE] = programmerSupport;
+	request[AGENT_NAME_SIZE + 1] = (ISPflag ? AGENT_FLAG_ISP : 0) | (oldFirmware ? AGENT_FLAG_OLD_FW : 0) |
+		(suppressWrite ? AGENT_FLAG_NOWRITE : 0);
+	request[AGENT_NAME_SIZE + 2] = (pipeWindow >> 8) & 0xff;
+	request[AGENT_NAME_SIZE + 3] = pipeWindow & 0xff;
+	return AGENT_OP_HEADER;
+}
+
+// advance the status bar as the agent reports progress
+static void RemoteProgress(unsigned int curOps)
+{
+	ShowHashMark(curOps);
+}
+
+static bool RemoteReset()
+{
+	unsigned char	request[4], result[1];
+
+	if (comm_debug)
+		TracePrintf("\nReset (agent)");
+
+	AgentPutLong(request, resetPulse);
+
+	if (!RemoteCall(serialDevice, AGENT_RESET, request, sizeof(request), result, sizeof(result), NULL))
+		return false;
+
+	FlushBytes(serialDevice);
+
+	if (!result[0])
+		fprintf(stderr, "programmer not detected by the agent\n");
+
+	return result[0] != 0;
+}
+
+static bool RemoteSetRange(const PIC_DEFINITION *picDevice, unsigned int start, unsigned int length)
+{
+	unsigned char	request[AGENT_OP_HEADER + 8], result[1];
+	unsigned int	size;
+
+	if (comm_debug)
+		TracePrintf("\nSet Range (agent) 0x%x 0x%x", start, length);
+
+	size = PutAgentHeader(picDevice, request);
+	AgentPutLong(&request[size], start);
+	AgentPutLong(&request[size + 4], length);
+
+	if (!RemoteCall(serialDevice, AGENT_SET_RANGE, request, size + 8, result, sizeof(result), NULL))
+		return false;
+
+	if (!result[0])
+		fprintf(stderr, "failed to send set range command (agent)\n");
+
+	return result[0] != 0;
+}
+
+static bool RemoteWritePgmBlock(const PIC_DEFINITION *picDevice, unsigned short int startAddr_w, unsigned short int size_w,
+	unsigned char *buffer, int *mismatch, unsigned int *confirmed, bool stopOnMismatch)
+{
+	unsigned char	*request, result[9];
+	unsigned int	size;
+	bool				fail;
+
+	*mismatch = -1;
+	*confirmed = 0;
+
+	if (!(request = (unsigned char *) malloc(AGENT_OP_HEADER + 9 + size_w * 2)))
+	{
+		fprintf(stderr, "failed to malloc %d bytes\n", AGENT_OP_HEADER + 9 + size_w * 2);
+		return false;
+	}
+
+	if (comm_debug)
+		TracePrintf("\nWrite Program (agent) 0x%04x 0x%04x", startAddr_w, size_w);
+
+	size = PutAgentHeader(picDevice, request);
+	AgentPutLong(&request[size], startAddr_w);
+	AgentPutLong(&request[size + 4], size_w);
+	request[size + 8] = stopOnMismatch;
+	memcpy(&request[size + 9], buffer, size_w * 2);
+	fail = !RemoteCall(serialDevice, AGENT_WRITE_PGM, request, size + 9 + size_w * 2, result, sizeof(result), RemoteProgress);
+
+	if (!fail)
+	{
+		*mismatch = (int) AgentGetLong(&result[1]);
+		*confirmed = AgentGetLong(&result[5]);
+		fail = !result[0];
+	}
+
+	free(request);
+	return(!fail);
+}
+
+static bool RemoteSendEepromData(const PIC_DEFINITION *picDevice, unsigned int datasize, int *mismatch)
+{
+	unsigned char	request[AGENT_OP_HEADER + 4 + MAX_EEPROM_DATA_SIZE], result[5];
+	unsigned int	size;
+
+	*mismatch = -1;
+
+	if (comm_debug)
+		TracePrintf("\nWrite EEPROM Data (agent)");
+
+	size = PutAgentHeader(picDevice, request);
+	AgentPutLong(&request[size], datasize);
+	memcpy(&request[size + 4], &eepromData[1], datasize);
+
+	if (!RemoteCall(serialDevice, AGENT_WRITE_DATA, request, size + 4 + datasize, result, sizeof(result), NULL))
+		return false;
+
+	*mismatch = (int) AgentGetLong(&result[1]);
+
+	if (!result[0])
+		fprintf(stderr, "failed to send eeprom data (agent)\n");
+
+	return result[0] != 0;
+}
+
 // JuPic programmer responded, attempt to get serial number.
 
 static void check_jupic(void)
@@ -549,10 +1150,7 @@ static void check_programmer(void)
 	bfr[3] = 7;
 
 	if (comm_debug)
-	{
-		fprintf(comm_debug, "\nChecking for Warp-13 or JuPic programmer");
-		comm_debug_count = 0;
-	}
+		TracePrintf("\nChecking for Warp-13 or JuPic programmer");
 
 	for (i=4; i<16; i++)
 		bfr[i] = 0;
@@ -579,10 +1177,7 @@ static void check_programmer(void)
 	bfr[3] = 0x0e;
 
 	if (comm_debug)
-	{
-		fprintf(comm_debug, "\nGetting Warp-13 version info");
-		comm_debug_count = 0;
-	}
+		TracePrintf("\nGetting Warp-13 version info");
 
 	if (SendMsg(bfr, 4, bfr, 16))
 	{
@@ -605,12 +1200,84 @@ static void check_programmer(void)
 
 static bool DoGetProgrammerType()
 {
-	bool				succeed;
-	unsigned char	theBuffer[1], theRtnBuffer[1];
-	unsigned int	retryCount;
+	int				idx;
+	unsigned int	pulse;
 
 	check_programmer();						// test if alternate programmer is connected
 
+	if (!PingProgrammer())
+	{
+		if (resetPulse >= RESET_PULSE_MAX)
+			return false;
+
+		pulse = resetPulse;					// maybe the reset pulse was too short,
+		resetPulse = RESET_PULSE_MAX;		// so try again with the full one
+
+		if (!ResetProgrammer())
+			return false;
+
+		check_programmer();
+
+		if (!PingProgrammer())
+			return false;
+
+		pulse = (pulse * 2 < RESET_PULSE_MAX) ? pulse * 2 : RESET_PULSE_MAX;
+		return (pulse < RESET_PULSE_MAX && resetSeen) ? LearnResetPulse(pulse) : true;
+	}
+
+	if (!pulseLearned && resetSeen)		// first time on this port, try the programmer's own pulse
+	{
+		for (idx=0; resetPulseList[idx].programmer && !(resetPulseList[idx].programmer & programmerSupport); idx++)
+			;
+
+		if (resetPulseList[idx].pulse < resetPulse)
+			return LearnResetPulse(resetPulseList[idx].pulse);
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// reset with a shorter pulse, and remember it for this port only if the
+// programmer was seen to go into reset and answers afterwards (only tried
+// where the full pulse was seen to reset it, so never without modem
+// lines). Otherwise reset again with the full pulse, which replaces a
+// pulse remembered before.
+// Return false if the programmer doesn't answer
+
+static bool LearnResetPulse(unsigned int pulse)
+{
+	resetPulse = pulse;
+
+	if (ResetProgrammer() && resetSeen && PingProgrammer())
+	{
+		SavePortInfo(deviceName, 0, pulse);
+		return true;
+	}
+
+	if (comm_debug)
+		TracePrintf("\nReset pulse of %u us not confirmed, using %u us", pulse, RESET_PULSE_MAX);
+
+	resetPulse = RESET_PULSE_MAX;
+
+	if (!ResetProgrammer() || !PingProgrammer())
+		return false;
+
+	if (pulseLearned)
+		SavePortInfo(deviceName, 0, RESET_PULSE_MAX);
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//	make sure the programmer answers a model request
+
+static bool PingProgrammer()
+{
+	bool				succeed;
+	unsigned char	theBuffer[1], theRtnBuffer[1];
+	unsigned int	retryCount;
+
 	theBuffer[0] = CMD_REQUEST_MODEL;	// Ping the programmer
 	retryCount = 5;
 	succeed = false;
@@ -618,10 +1285,7 @@ static bool DoGetProgrammerType()
 	do
 	{
 		if (comm_debug)
-		{
-			fprintf(comm_debug, "\nGet programmer type");
-			comm_debug_count = 0;
-		}
+			TracePrintf("\nGet programmer type");
 
 		if (SendMsg(theBuffer, 1, theRtnBuffer, 1))
 		{
@@ -653,10 +1317,7 @@ static bool DoGetVersion()
 	do
 	{
 		if (comm_debug)
-		{
-			fprintf(comm_debug, "\nGet version");
-			comm_debug_count = 0;
-		}
+			TracePrintf("\nGet version");
 
 		if (SendMsg(theBuffer, 1, theRtnBuffer, 4))
 		{
@@ -681,6 +1342,65 @@ static bool DoGetVersion()
 	return(succeed);
 }
 
+//-----------------------------------------------------------------------------
+//	return the best of a few ping round trips (in microseconds), 0 if the
+//	programmer didn't answer
+
+static unsigned long long MeasureRoundTrip()
+{
+	int					i;
+	unsigned char		theBuffer[1];
+	unsigned long long	start, best, elapsed;
+
+	best = 0;
+
+	for (i=0; i<LATENCY_PINGS; i++)
+	{
+		theBuffer[0] = CMD_REQUEST_MODEL;
+		start = GetMicroseconds();
+
+		if (!SendMsg(theBuffer, 1, theBuffer, 1) || theBuffer[0] != PIC_ACK)
+			break;
+
+		elapsed = GetMicroseconds() - start;
+
+		if (!best || elapsed < best)
+			best = elapsed;
+	}
+
+	return best;
+}
+
+//-----------------------------------------------------------------------------
+//	show how quickly the programmer's answers get back to us: the serial
+//	driver's latency settings and the best of a few ping round trips
+
+static void ShowLinkLatency()
+{
+	bool					lowLatency;
+	int					latency;
+	unsigned long long	best;
+
+	latency = GetDeviceLatency(serialDevice, &lowLatency);
+	best = MeasureRoundTrip();
+
+	fprintf(stdout, "Serial link: %s", lowLatency ? "low latency" : "normal latency");
+
+	if (latency >= 0)
+		fprintf(stdout, ", latency timer %d ms", latency);
+
+	if (best)
+		fprintf(stdout, ", round trip %llu.%03llu ms", best / 1000, best % 1000);
+
+	fprintf(stdout, "\n");
+
+	if (comm_debug)
+	{
+		TracePrintf("\nSerial link: low latency %s, latency timer %d ms, round trip %llu us\n",
+			lowLatency ? "on" : "off", latency, best);
+	}
+}
+
 //-----------------------------------------------------------------------------
 //	get the version from the PICSTART and display it
 
@@ -688,18 +1408,16 @@ static void DoShowVersion()
 {
 	fprintf(stdout,"PICSTART Plus firmware version %d.%02d.%02d\n",
 		PICversion.major, PICversion.middle, PICversion.minor);
+
+	if (verboseOutput)
+		ShowLinkLatency();
 }
 
 //-----------------------------------------------------------------------------
-// send a "set range" command to the PS+
+// build a "set range" command in rangeBuffer (6 bytes), return its size
 
-static bool SetRange(const PIC_DEFINITION *picDevice, unsigned int start, unsigned int length)
+static int RangeFrame(const PIC_DEFINITION *picDevice, unsigned int start, unsigned int length, unsigned char *rangeBuffer)
 {
-	unsigned char	rangeBuffer[6], rtnBuffer[6];
-	int				i, size;
-	bool				error = false;
-	bool				nowrite = false;
-
 	if (GetWordWidth(picDevice) == 0xffff)
 		start *= 2;		// For these devices, addressing is done in octets.
 
@@ -707,36 +1425,48 @@ static bool SetRange(const PIC_DEFINITION *picDevice, unsigned int start, unsign
 
 	if (!oldFirmware)
 	{
-		size = 6;
 		rangeBuffer[1] = (start >> 16) &0xff;
 		rangeBuffer[2] = (start >> 8) & 0xff;
 		rangeBuffer[3] = (start >> 0) & 0xff;
 		rangeBuffer[4] = (length >> 8) & 0xff;
 		rangeBuffer[5] = (length >> 0) & 0xff;
+		return 6;
 	}
-	else
-	{
-		size = 5;
-		rangeBuffer[1] = (start >> 8) & 0xff;
-		rangeBuffer[2] = (start >> 0) & 0xff;
-		rangeBuffer[3] = (length >> 8) & 0xff;
-		rangeBuffer[4] = (length >> 0) & 0xff;
-	}
+
+	rangeBuffer[1] = (start >> 8) & 0xff;
+	rangeBuffer[2] = (start >> 0) & 0xff;
+	rangeBuffer[3] = (length >> 8) & 0xff;
+	rangeBuffer[4] = (length >> 0) & 0xff;
+	return 5;
+}
+
+//-----------------------------------------------------------------------------
+// send a "set range" command to the PS+
+
+static bool SetRange(const PIC_DEFINITION *picDevice, unsigned int start, unsigned int length)
+{
+	unsigned char	rangeBuffer[6], rtnBuffer[6], cmd;
+	int				i, size;
+	bool				error = false;
+	bool				nowrite = false;
+
+	if (IsRemote(serialDevice))
+		return RemoteSetRange(picDevice, start, length);
+
+	size = RangeFrame(picDevice, start, length, rangeBuffer);
 
 	if (comm_debug)
-	{
-		fprintf(comm_debug, "\nSet Range");
-		comm_debug_count = 0;
-		sendCommand = true;
-	}
+		TracePrintf("\nSet Range");
 
 	nowrite = suppressWrite;
 	suppressWrite = false;
+	cmd = SelectTiming(CMD_SET_ADDR);
 
- 	if (SendMsgWait(rangeBuffer, size, rtnBuffer, size))
+ 	if (SendFrame(rangeBuffer, size, rtnBuffer, NULL))
 	{
  		if (memcmp(rangeBuffer, rtnBuffer, size) == 0)	// read back result and see if it looks correct
 		{
+			SelectTiming(cmd);
 			suppressWrite = nowrite;
 			return(true);
 		}
@@ -758,52 +1488,270 @@ static bool SetRange(const PIC_DEFINITION *picDevice, unsigned int start, unsign
 	else
 		fprintf(stderr,"failed to send set range command\n");
 
+	SelectTiming(cmd);
 	suppressWrite = nowrite;
 	return (!error);
 }
 
 //-----------------------------------------------------------------------------
-// Check device for blank
+//	--probe-link: time round trips that every programmer simply answers
+//	(model requests, and set range commands that are only echoed), sorted
+//	into samples[]. Return the number of samples; *errors counts the round
+//	trips that timed out or came back wrong (the programmer is reset after
+//	each one, without counting toward a speed change), *echoBytes and
+//	*echoTime the set range traffic.
+//	Returns -1 if the programmer couldn't be resynchronized.
+
+static int CompareSamples(const void *a, const void *b)
+{
+	unsigned int	x = *(const unsigned int *) a, y = *(const unsigned int *) b;
 
-static bool DoBlankCheck(const PIC_DEFINITION *picDevice, unsigned char blankMode)
+	return (x > y) - (x < y);
+}
+
+static int ProbeRoundTrips(const PIC_DEFINITION *picDevice, unsigned char command, unsigned int count, unsigned int *samples,
+	unsigned int *errors, unsigned int *echoBytes, unsigned long long *echoTime)
+{
+	unsigned char			theBuffer[6], rtnBuffer[6], cmd;
+	unsigned int			i, size, numSamples;
+	int						mismatch;
+	bool						ok;
+	unsigned long long	start, elapsed;
+
+	numSamples = 0;
+
+	for (i=0; i<count; i++)
+	{
+		cmd = SelectTiming(command);
+		start = GetMicroseconds();
+
+		if (command == CMD_SET_ADDR)
+		{
+			size = RangeFrame(picDevice, 0, 1, theBuffer);
+			ok = SendFrame(theBuffer, size, rtnBuffer, &mismatch) && mismatch < 0;
+		}
+		else
+		{
+			theBuffer[0] = CMD_REQUEST_MODEL;
+			size = 0;
+			ok = SendMsg(theBuffer, 1, rtnBuffer, 1) && rtnBuffer[0] == PIC_ACK;
+		}
+
+		elapsed = GetMicroseconds() - start;
+		SelectTiming(cmd);
+
+		if (ok)
+		{
+			samples[numSamples++] = (elapsed > 0xffffffff) ? 0xffffffff : (unsigned int) elapsed;
+			*echoBytes += size;
+			*echoTime += elapsed;
+		}
+		else
+		{
+			(*errors)++;
+
+			if (comm_debug)
+				TracePrintf("\nResynchronizing");
+
+			if (!ResyncProgrammer(picDevice))		// the probe only observes the link
+				return -1;
+		}
+	}
+
+	qsort(samples, numSamples, sizeof(unsigned int), CompareSamples);
+	return numSamples;
+}
+
+// show the spread of sorted round trip times, return the 99th percentile
+
+static unsigned int ShowRoundTrips(const char *label, const unsigned int *samples, unsigned int numSamples)
+{
+	unsigned int	p99;
+
+	if (!numSamples)
+	{
+		fprintf(stdout, "  %s round trip: no answers\n", label);
+		return 0xffffffff;
+	}
+
+	p99 = samples[(numSamples * 99 + 99) / 100 - 1];
+	fprintf(stdout, "  %s round trip: min %u.%03u ms, median %u.%03u ms, p99 %u.%03u ms, max %u.%03u ms\n", label,
+		samples[0] / 1000, samples[0] % 1000,
+		samples[numSamples / 2] / 1000, samples[numSamples / 2] % 1000,
+		p99 / 1000, p99 % 1000,
+		samples[numSamples - 1] / 1000, samples[numSamples - 1] % 1000);
+
+	if (comm_debug)
+	{
+		TracePrintf("\n%s round trip: %u samples, min %u us, median %u us, p99 %u us, max %u us\n", label, numSamples,
+			samples[0], samples[numSamples / 2], p99, samples[numSamples - 1]);
+	}
+
+	return p99;
+}
+
+//-----------------------------------------------------------------------------
+//	--probe-link: check the health of the port, cable and adapter before a
+//	long job. Only traffic that every programmer just answers or echoes is
+//	sent, count round trips of each kind. The report gives the round trip
+//	times, the echo throughput and the error rate. A link that misses one
+//	of the PROBE_ thresholds sets linkDegraded (picp then exits with 2).
+//	Returns false if the programmer stopped answering altogether.
+
+static bool ProbeLink(const PIC_DEFINITION *picDevice, unsigned int count)
+{
+	unsigned int			*samples, errors, echoBytes, numPings, numRanges, pingP99, rate, lineSpeed, lineRate;
+	unsigned char			dataBits, stopBits, parity;
+	int						numSamples;
+	unsigned long long	echoTime;
+
+	if (!(samples = (unsigned int *) malloc(count * sizeof(unsigned int))))
+	{
+		fprintf(stderr, "out of memory\n");
+		return false;
+	}
+
+	if (comm_debug)
+		TracePrintf("\nProbe link, %u round trips of each kind\n", count);
+
+	errors = echoBytes = 0;
+	echoTime = 0;
+	GetDeviceConfiguration(serialDevice, &lineSpeed, &dataBits, &stopBits, &parity);	// the speed really in use
+
+	if (lineSpeed)
+		fprintf(stdout, "Link probe: %u model requests, %u set range echoes at %u baud\n", count, count, lineSpeed);
+	else
+		fprintf(stdout, "Link probe: %u model requests, %u set range echoes (not a serial line)\n", count, count);
+
+	if ((numSamples = ProbeRoundTrips(picDevice, CMD_REQUEST_MODEL, count, samples, &errors, &echoBytes, &echoTime)) < 0)
+	{
+		fprintf(stderr, "programmer stopped answering during the link probe\n");
+		free(samples);
+		return false;
+	}
+
+	numPings = numSamples;
+	pingP99 = ShowRoundTrips("model request", samples, numPings);
+	echoBytes = 0;
+	echoTime = 0;
+
+	if ((numSamples = ProbeRoundTrips(picDevice, CMD_SET_ADDR, count, samples, &errors, &echoBytes, &echoTime)) < 0)
+	{
+		fprintf(stderr, "programmer stopped answering during the link probe\n");
+		free(samples);
+		return false;
+	}
+
+	numRanges = numSamples;
+	ShowRoundTrips("set range", samples, numRanges);
+	free(samples);
+
+	rate = echoTime ? (unsigned int) ((unsigned long long) echoBytes * 1000000 / echoTime) : 0;
+	lineRate = lineSpeed / 10;			// start and stop bits
+
+	if (lineRate)
+		fprintf(stdout, "  echo throughput: %u bytes/s (%u%% of the line rate)\n", rate, rate * 100 / lineRate);
+	else
+		fprintf(stdout, "  echo throughput: %u bytes/s\n", rate);
+
+	fprintf(stdout, "  errors: %u of %u round trips (%u.%02u%%)\n", errors, count * 2,
+		errors * 10000 / (count * 2) / 100, errors * 10000 / (count * 2) % 100);
+
+	if (comm_debug)
+		TracePrintf("\nEcho throughput %u bytes/s, %u errors in %u round trips\n", rate, errors, count * 2);
+
+	linkDegraded = true;
+
+	if (errors > PROBE_MAX_ERRORS)
+		fprintf(stdout, "Link degraded: more than %d errors\n", PROBE_MAX_ERRORS);
+	else if (pingP99 > PROBE_MAX_P99)
+		fprintf(stdout, "Link degraded: round trip p99 above %d ms\n", PROBE_MAX_P99 / 1000);
+	else if (lineRate && rate * 100 < lineRate * PROBE_MIN_THROUGHPUT)
+		fprintf(stdout, "Link degraded: echo throughput below %d%% of the line rate\n", PROBE_MIN_THROUGHPUT);
+	else
+	{
+		fprintf(stdout, "Link healthy\n");
+		linkDegraded = false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Check device for blank: one full blank check, the programmer's BLANK_xxx
+// status bits (set = not blank) in *status. Newer PS+ firmware sends 0xef
+// until it is done; that is waited for, but no longer than BLANK_CHECK_WAIT
+
+static bool BlankStatus(unsigned char *status)
 {
 	bool				fail, newfw = false;
-	unsigned char	theBuffer[3];
-	int				idx;
-	unsigned int	to;
+	unsigned char	theBuffer[3], cmd;
+	unsigned long long	start;
 
-	to = CharTimeout;						// save normal character timeout
-	CharTimeout = TIMEOUT_5_SECOND;	// set long timeout for blank check
+	cmd = SelectTiming(CMD_BLANK_CHECK);	// blank check takes a while
 
 	if (picFWVersion >= NEW_PS_VERSION && !isJupic && !isWarp13 && !isOlimex)
 		newfw = true;
 
-	idx = 0;
 	fail = false;
 	theBuffer[0] = CMD_BLANK_CHECK;
 	theBuffer[1] = 0xef;
 
 	if (comm_debug)
-	{
-		fprintf(comm_debug, "\nBlank Check");
-		comm_debug_count = 0;
-	}
+		TracePrintf("\nBlank Check");
+
+	start = GetMicroseconds();
 
 	if (SendMsg(theBuffer, 1, theBuffer, 2))
 	{
 		if (theBuffer[1] == 0xef && newfw)		// wait for endless 0xef from broken PS+ firmware
 		{
-			while (SendMsg(NULL, 0, theBuffer, 1))
+			while (theBuffer[1] == 0xef && !fail)
 			{
-				if (theBuffer[0] != 0xef)
-					break;
+				if (GetMicroseconds() - start > BLANK_CHECK_WAIT)
+				{
+					fprintf(stderr, "blank check didn't finish\n");
+					fail = true;
+				}
+				else if (!SendMsg(NULL, 0, &theBuffer[1], 1))	// put result where it should be
+				{
+					fprintf(stderr, "failed to read blank check result\n");
+					fail = true;
+				}
 			}
-
-			theBuffer[1] = theBuffer[0];	// put result where it should be
 		}
 
+		*status = theBuffer[1];
+	}
+	else
+	{
+		fprintf(stderr, "failed to send blank check command\n");
+		fail = true;
+	}
+
+	SelectTiming(cmd);
+	return(!fail);
+}
+
+//--------------------------------------------------------------------
+// Blank check the regions in blankMode (BLANK_xxx) and report them
+
+static bool DoBlankCheck(const PIC_DEFINITION *picDevice, unsigned char blankMode)
+{
+	bool				fail;
+	unsigned char	theBuffer[3];
+	int				idx;
+
+	idx = 0;
+	fail = false;
+
+	if (BlankStatus(&theBuffer[1]))
+	{
 		theBuffer[1] &= blankMode;				// look only at what we were asked to look at
 
+		if ((blankMode & BLANK_PGM) && !(theBuffer[1] & BLANK_PGM))
+			pgmBlank = true;						// writes can skip blank words from now on
+
 		if (!verboseOutput)
 			fprintf(stdout, "0x%02x\n", theBuffer[1]);			// quiet mode will just show the return code
 		else
@@ -846,26 +1794,20 @@ static bool DoBlankCheck(const PIC_DEFINITION *picDevice, unsigned char blankMod
 		}
 	}
 	else
-	{
-		fprintf(stderr, "failed to send blank check command\n");
 		fail = true;
-	}
 
-	CharTimeout = to;		// restore character timeout
 	return(!fail);
 }
 
 //--------------------------------------------------------------------
-// Read eeprom data
+// Read the eeprom data into eepromData[1] on (one byte per location)
 
-static bool DoReadData(const PIC_DEFINITION *picDevice, FILE *theFile)
+static bool ReadEepromImage(const PIC_DEFINITION *picDevice)
 {
-	bool				fail;
-	unsigned char	theBuffer[1024];
-	unsigned short int	size, start;
+	unsigned char	theBuffer[1];
+	unsigned short int	size;
 
 	size = GetDataSize(picDevice);
-	start = GetDataStart(picDevice);
 
 	if (!size)
 	{
@@ -873,33 +1815,63 @@ static bool DoReadData(const PIC_DEFINITION *picDevice, FILE *theFile)
 		return false;
 	}
 
-	fail = false;
 	theBuffer[0] = CMD_READ_DATA;
 
 	if (comm_debug)
-	{
-		fprintf(comm_debug, "\nRead Data");
-		comm_debug_count = 0;
-		sendCommand = true;
-	}
+		TracePrintf("\nRead Data");
 
-	if (SendMsg(theBuffer, 1, eepromData, size + 2))
+	if (!SendMsg(theBuffer, 1, eepromData, size + 2))
 	{								// ask it to fill the buffer (plus the command plus a terminating zero)
-		WriteHexRecord(theFile, &eepromData[1], start, size, 0);	// write hex records to selected stream
+		fprintf(stderr, "failed to send read data command\n");
+		return false;
 	}
-	else
+
+	return true;
+}
+
+//--------------------------------------------------------------------
+// Read eeprom data, length bytes from start (0 = to the end). The
+// programmer always sends the whole data space; only the range is kept
+
+static bool DoReadData(const PIC_DEFINITION *picDevice, FILE *theFile, unsigned int start, unsigned int length)
+{
+	if (start < GetDataSize(picDevice) && !length)
+		length = GetDataSize(picDevice) - start;
+
+	if (start > GetDataSize(picDevice) || length > GetDataSize(picDevice) - start)
 	{
-		fprintf(stderr, "failed to send read data command\n");
-		fail = true;
+		fprintf(stderr, "Range 0x%x:0x%x is outside the eeprom data (0x%x bytes)\n", start, length, GetDataSize(picDevice));
+		return false;
 	}
 
-	return(!fail);
+	if (!ReadEepromImage(picDevice))
+		return false;
+
+	WriteHexRecord(theFile, &eepromData[start + 1], GetDataStart(picDevice) + start, length, 0);	// write hex records to selected stream
+	return true;
+}
+
+//--------------------------------------------------------------------
+// Report a data byte that didn't echo back as written
+// Return false if it should count as a failure
+
+static bool ReportDataVerify(int offset)
+{
+	if (!ignoreVerfErr)
+	{
+		fprintf(stderr, "failed to verify while writing to data space at byte 0x%04x\n", offset);
+		return false;
+	}
+
+	fprintf(stderr, "Warning: failed to verify while writing to data space at byte 0x%04x\n", offset);
+	return true;
 }
 
 //--------------------------------------------------------------------
-// Write eeprom data from file
+// Write eeprom data from file. With merge set, locations the file
+// doesn't set keep what the device holds, otherwise they are erased
 
-static bool DoWriteData(const PIC_DEFINITION *picDevice, FILE *theFile)
+static bool DoWriteData(const PIC_DEFINITION *picDevice, FILE *theFile, bool merge)
 {
 	int				i;
 	bool				fail, fileDone;
@@ -916,8 +1888,16 @@ static bool DoWriteData(const PIC_DEFINITION *picDevice, FILE *theFile)
 		return false;
 	}
 
-	for (i=0; i < size + 1; i++)
-		eepromData[i] = 0xff;
+	if (merge)
+	{
+		if (!ReadEepromImage(picDevice))
+			return false;
+	}
+	else
+	{
+		for (i=0; i < size + 1; i++)
+			eepromData[i] = 0xff;
+	}
 
 	fail = fileDone = false;
 
@@ -956,49 +1936,57 @@ static bool DoWriteData(const PIC_DEFINITION *picDevice, FILE *theFile)
 	}
 
 	if (!fail)
-	{
-		writingProgram = true;
-		eepromData[0] = CMD_WRITE_DATA;			// set command in eepromData buffer
+		fail = !WriteEepromImage(picDevice, size);
 
-		if (comm_debug)
-		{
-			if (suppressWrite)
-				fprintf(comm_debug, "\nWrite Data - write suppressed\n");
-			else
-				fprintf(comm_debug, "\nWrite Data\n");
+	return(!fail);
+}
 
-			comm_debug_count = 0;
-			sendCommand = true;
-		}
+//--------------------------------------------------------------------
+// Write eeprom data from buffer - return true if success
 
-		if (!SendMsgWait(eepromData, 1, eepromData, 1))
-		{
-			fprintf(stderr, "failed to send write eeprom data command\n");
-			fail = true;
-		}
+//--------------------------------------------------------------------
+// send the data memory image in eepromData (the command, then datasize
+// bytes) and check the echo. *mismatch is set to the offset of the first
+// byte that didn't echo back correctly, or -1
 
-		if (comm_debug)
-		{
-			fprintf(comm_debug, "\n");
-			comm_debug_count = 0;
-		}
+static bool SendEepromData(unsigned int datasize, int *mismatch)
+{
+	bool	fail = false;
 
-		if (!fail)
+	writingProgram = true;
+	eepromData[0] = CMD_WRITE_DATA;			// set command in eepromData buffer
+	*mismatch = -1;
+
+	if (comm_debug)
+	{
+		if (suppressWrite)
+			TracePrintf("\nWrite EEPROM Data - write suppressed\n");
+		else
+			TracePrintf("\nWrite EEPROM Data\n");
+	}
+
+	if (!SendFrame(eepromData, 1, eepromEcho, mismatch) || *mismatch >= 0)
+	{
+		fprintf(stderr, "failed to send write eeprom data command\n");
+		*mismatch = -1;
+		fail = true;
+	}
+
+	if (comm_debug)
+		TracePrintf("\n");
+
+	if (!fail)
+	{
+		if (!SendFrame(&eepromData[1], datasize, &eepromEcho[1], mismatch))
 		{
-			if (!SendMsgWait(&eepromData[1], size, &eepromData[1], size + 1))
-			{
-				fprintf(stderr, "failed to send write data command\n");
-				fail = true;
-			}
+			fprintf(stderr, "failed to send eeprom data\n");
+			*mismatch = -1;
+			fail = true;
 		}
-
-		if (!fail && !suppressWrite)
+		else if (!SendMsg(&eepromData[0], 0, &eepromData[0], 1))			// eat the trailing zero
 		{
-			if (!SendMsg(&eepromData[0], 0, &eepromData[0], 1))			// eat the trailing zero
-			{
-				fprintf(stderr, "failed to read trailing 0 after writing eeprom data\n");
-				fail = true;									// didn't echo everthing back like it should have
-			}
+			fprintf(stderr, "failed to read trailing 0 after writing eeprom data\n");
+			fail = true;									// didn't echo everthing back like it should have
 		}
 	}
 
@@ -1007,13 +1995,29 @@ static bool DoWriteData(const PIC_DEFINITION *picDevice, FILE *theFile)
 }
 
 //--------------------------------------------------------------------
-// Write eeprom data from buffer - return true if success
+// write the data memory image in eepromData, here or through an agent,
+// and report any verify error
+
+static bool WriteEepromImage(const PIC_DEFINITION *picDevice, unsigned int datasize)
+{
+	int	mismatch;
+	bool	fail;
+
+	if (IsRemote(serialDevice))
+		fail = !RemoteSendEepromData(picDevice, datasize, &mismatch);
+	else
+		fail = !SendEepromData(datasize, &mismatch);
+
+	if (mismatch >= 0 && !suppressWrite && !ReportDataVerify(mismatch))
+		fail = true;
+
+	return(!fail);
+}
 
 static bool DoWriteEepromData(const PIC_DEFINITION *picDevice, unsigned char *buffer, unsigned int start, int size)
 {
 	int						i;
 	unsigned short int	datasize;
-	bool						fail = false;
 
 	datasize = GetDataSize(picDevice) * 2;
 
@@ -1037,51 +2041,7 @@ static bool DoWriteEepromData(const PIC_DEFINITION *picDevice, unsigned char *bu
 	for (i=0; i<size; i++)						// transfer block of data to eeprom data
 		eepromData[start + i + 1] = buffer[i];
 
-	writingProgram = true;
-	eepromData[0] = CMD_WRITE_DATA;			// set command in eepromData buffer
-
-	if (comm_debug)
-	{
-		if (suppressWrite)
-			fprintf(comm_debug, "\nWrite EEPROM Data - write suppressed\n");
-		else
-			fprintf(comm_debug, "\nWrite EEPROM Data\n");
-
-		comm_debug_count = 0;
-		sendCommand = true;
-	}
-
-	if (!SendMsgWait(eepromData, 1, eepromData, 1))
-	{
-		fprintf(stderr, "failed to send write eeprom data command\n");
-		fail = true;
-	}
-
-	if (comm_debug)
-	{
-		fprintf(comm_debug, "\n");
-		comm_debug_count = 0;
-	}
-
-	if (!fail)
-	{
-		if (!SendMsgWait(&eepromData[1], datasize, &eepromData[1], datasize + 1))
-		{
-			fprintf(stderr, "failed to send eeprom data\n");
-			fail = true;
-		}
-		else
-		{
-			if (!SendMsg(&eepromData[0], 0, &eepromData[0], 1))			// eat the trailing zero
-			{
-				fprintf(stderr, "failed to read trailing 0 after writing eeprom data\n");
-				fail = true;									// didn't echo everthing back like it should have
-			}
-		}
-	}
-
-	writingProgram = false;
-	return(!fail);
+	return WriteEepromImage(picDevice, datasize);
 }
 
 //--------------------------------------------------------------------
@@ -1109,6 +2069,12 @@ static void InitHashMark(unsigned short int numOps, unsigned short int hashWidth
 
 static void ShowHashMark(unsigned short int curOps)
 {
+	if (agentClient != -1)					// serving a client, its status bar is drawn there
+	{
+		AgentShowProgress(curOps);
+		return;
+	}
+
 	if (verboseOutput && hashMod && (curOps / hashMod > hashNum) )
 	{
 		fprintf(stdout, "#");
@@ -1149,11 +2115,7 @@ static bool DoReadOscCal(const PIC_DEFINITION *picDevice, bool flag)
 				theBuffer[0] = CMD_READ_OSC;
 
 				if (comm_debug)
-				{
-					fprintf(comm_debug, "\nRead OSC Calibration");
-					comm_debug_count = 0;
-					sendCommand = true;
-				}
+					TracePrintf("\nRead OSC Calibration");
 
 					// ask it to fill the buffer (plus the command plus a terminating zero)
 				if (SendMsg(theBuffer, 1, theBuffer, size + 3))
@@ -1226,12 +2188,9 @@ static bool DoWriteOscCalBits(const PIC_DEFINITION *picDevice, unsigned short in
 		if (comm_debug)
 		{
 			if (suppressWrite)
-				fprintf(comm_debug, "\nWrite OSC Calibration - write suppressed");
+				TracePrintf("\nWrite OSC Calibration - write suppressed");
 			else
-				fprintf(comm_debug, "\nWrite OSC Calibration");
-
-			comm_debug_count = 0;
-			sendCommand = true;
+				TracePrintf("\nWrite OSC Calibration");
 		}
 
 		if (SendMsg(theBuffer, 1, rtnBuffer, 1))		// send command and wait for echo
@@ -1295,11 +2254,7 @@ static bool DoReadCfg(const PIC_DEFINITION *picDevice, bool verbose)
 	theBuffer[0] = CMD_READ_CFG;
 
 	if (comm_debug)
-	{
-		fprintf(comm_debug, "\nRead Configuration bits");
-		comm_debug_count = 0;
-		sendCommand = true;
-	}
+		TracePrintf("\nRead Configuration bits");
 
 	if (SendMsg(theBuffer, 1, theBuffer, cfgsize + 2))
 	{
@@ -1363,10 +2318,32 @@ void RestoreClockCal(const PIC_DEFINITION *picDevice)
 	DoWriteOscCalBits(picDevice, data);
 }
 
+// return the number of program words an erase from zero can cover
+// without wiping osc cal: all of program memory, or up to osc cal if that
+// is the last thing in it. Sets *oscCal if osc cal is among them anyway.
+// (On many parts osc cal sits just past the program memory size.)
+
+static unsigned int EraseWords(const PIC_DEFINITION *picDevice, bool *oscCal)
+{
+	unsigned int	words, size, adrs;
+
+	words = GetPgmSize(picDevice);
+	size = GetOscCalSize(picDevice);
+	adrs = GetOscCalStart(picDevice);
+
+	if (size && adrs && adrs < words && adrs + size >= words)
+		words = adrs;
+
+	*oscCal = (size && adrs && adrs < words);
+	return words;
+}
+
 //--------------------------------------------------------------------
 // erase the program space of a part that can be erased (PIC16Fxx, etc)
+// With keepOscCal the erase stops short of osc cal when that is at the
+// top, and osc cal is only saved and written back if it is overwritten.
 //
-static bool DoErasePgm(const PIC_DEFINITION *picDevice, bool flag)
+static bool DoErasePgm(const PIC_DEFINITION *picDevice, bool flag, bool keepOscCal)
 {
 	bool						fail, oscsaved;
 	unsigned char			theBuffer[4], rtnBuffer[2];
@@ -1380,9 +2357,20 @@ static bool DoErasePgm(const PIC_DEFINITION *picDevice, bool flag)
 			"If program space fails to erase, use the -ef (erase flash) command.\n\n");
 	}
 
-	oscsaved = SaveClockCal(picDevice);		// read and save osc cal data, if any
 	fail = false;
-	size = GetPgmSize(picDevice) * 2;		// get the size
+
+	if (keepOscCal)
+	{
+		size = EraseWords(picDevice, &oscsaved) * 2;	// everything below osc cal
+
+		if (oscsaved)
+			oscsaved = SaveClockCal(picDevice);			// in the middle, so it has to be saved
+	}
+	else
+	{
+		oscsaved = SaveClockCal(picDevice);		// read and save osc cal data, if any
+		size = GetPgmSize(picDevice) * 2;		// get the size
+	}
 	InitHashMark(size, hashWidth);
 
 	if (SetRange(picDevice, 0, size / 2))	// erase the whole program space
@@ -1395,18 +2383,15 @@ static bool DoErasePgm(const PIC_DEFINITION *picDevice, bool flag)
 		if (comm_debug)
 		{
 			if (suppressWrite)
-				fprintf(comm_debug, "\nErase Program (write pgm cmd) - write suppressed\n");
+				TracePrintf("\nErase Program (write pgm cmd) - write suppressed\n");
 			else
-				fprintf(comm_debug, "\nErase Program (write pgm cmd)\n");
+				TracePrintf("\nErase Program (write pgm cmd)\n");
 		}
 
 		if (SendMsg(theBuffer, 1, rtnBuffer, 1))	// send the command, watch for it to bounce back
 		{
 			if (comm_debug)
-			{
-				fprintf(comm_debug, "\n");
-				comm_debug_count = 0;
-			}
+				TracePrintf("\n");
 
 			if (*rtnBuffer == CMD_WRITE_PGM)
 			{
@@ -1418,7 +2403,7 @@ static bool DoErasePgm(const PIC_DEFINITION *picDevice, bool flag)
 				{
 					// write the bytes, ignore the return value (check results later)
 
-					if (ISPflag)
+					if (GetQuirks() & QUIRK_LOCKSTEP)
 						fail = !SendMsgWait(theBuffer, 2, rtnBuffer, 2);
 					else
 						fail = !SendMsg(theBuffer, 2, rtnBuffer, 2);
@@ -1510,11 +2495,9 @@ static bool DoEraseData(const PIC_DEFINITION *picDevice, bool flag)
 		if (comm_debug)
 		{
 			if (suppressWrite)
-				fprintf(comm_debug, "\nErase Data (write data cmd) - write suppressed");
+				TracePrintf("\nErase Data (write data cmd) - write suppressed");
 			else
-				fprintf(comm_debug, "\nErase Data (write data cmd)");
-
-			comm_debug_count = 0;
+				TracePrintf("\nErase Data (write data cmd)");
 		}
 
 		if (SendMsg(theBuffer, 1, rtnBuffer, 1))	// send the command, watch for it to bounce back
@@ -1523,24 +2506,18 @@ static bool DoEraseData(const PIC_DEFINITION *picDevice, bool flag)
 			{
 				if (comm_debug)
 				{
-					fprintf(comm_debug, "\n");
+					TracePrintf("\n");
 					writingProgram = true;
-					comm_debug_count = 0;
 				}
 
-				theBuffer[0] = 0xff;						// send as all 1's
-				byteCnt = 0;
+				for (byteCnt=0; byteCnt < size; byteCnt++)
+					eepromData[byteCnt] = 0xff;			// send as all 1's
 
-				while ((byteCnt < size) && !fail)
+					// write the bytes, ignore the echoes (blank check results later)
+				if (!SendFrame(eepromData, size, eepromEcho, NULL))
 				{
-						// write the bytes, ignore the return value (check results later)
-					if (SendMsgWait(theBuffer, 1, rtnBuffer, 1))
-						byteCnt++;
-					else
-					{
-						fprintf(stderr, "failed to send write data command\n");
-						fail = true;
-					}
+					fprintf(stderr, "failed to send write data command\n");
+					fail = true;
 				}
 
 				if (SendMsg(theBuffer, 0, rtnBuffer, 1))				// eat the trailing zero
@@ -1590,11 +2567,7 @@ static bool DoEraseData(const PIC_DEFINITION *picDevice, bool flag)
 static bool DoEraseFlash(const PIC_DEFINITION *picDevice)
 {
 	bool				fail, oscsaved;
-	unsigned int	to;
-	unsigned char	theBuffer[3];
-
-	to = CharTimeout;						// save normal character timeout
-	CharTimeout = TIMEOUT_5_SECOND;	// set long timeout for erase flash
+	unsigned char	theBuffer[3], cmd;
 
 	oscsaved = SaveClockCal(picDevice);		// read and save osc cal, if any
 	fail = false;
@@ -1602,10 +2575,9 @@ static bool DoEraseFlash(const PIC_DEFINITION *picDevice)
 	theBuffer[1] = 0;						// for PS+ firmware v 4.30.04 or higher
 
 	if (comm_debug)
-	{
-		fprintf(comm_debug, "\nErase Flash");
-		comm_debug_count = 0;
-	}
+		TracePrintf("\nErase Flash");
+
+	cmd = SelectTiming(CMD_ERASE_FLASH);		// erasing takes a while
 
 	if (SendMsg(theBuffer, 1, theBuffer, 2))
 	{
@@ -1614,6 +2586,8 @@ static bool DoEraseFlash(const PIC_DEFINITION *picDevice)
 			fprintf(stderr, "failed to erase flash device\n");
 			fail = true;
 		}
+		else
+			pgmBlank = true;
 	}
 	else
 	{
@@ -1621,21 +2595,29 @@ static bool DoEraseFlash(const PIC_DEFINITION *picDevice)
 		fail = true;
 	}
 
+	SelectTiming(cmd);
+
 	if (oscsaved && !fail)				// if there is saved osc cal data,
 		RestoreClockCal(picDevice);	// write it back to the device.
 
-	CharTimeout = to;
 	return(!fail);
 }
 
 //--------------------------------------------------------------------
 // Write device's configuration bits for 18xxx devices - return true if success
-//
+// Every word needs a set range of its own, so the set range, the write
+// command and the word go out as one frame and are checked as one echo.
+// Words the device already holds (readConfigBits, read by the caller)
+// are left alone. Config7 is written before config6, since config6 can
+// write protect the configuration registers.
+
 static bool DoWriteConfigBits18(const PIC_DEFINITION *picDevice, unsigned char *cfgbits, unsigned int cfgsize, unsigned int offset)
 {
 	bool				fail;
-	unsigned char	theBuffer[3], rtnBuffer[3], temp1, temp2;
-	unsigned int	i, devCfgAddr, addr;
+	unsigned char	frame[9], echo[9], status;
+	unsigned int	i, k, devCfgAddr, addr, size, written;
+	int				mismatch;
+	unsigned short int	mask, cfgword;
 
 	devCfgAddr = GetConfigStart(picDevice) * 2;	// address of device's config memory
 	devCfgAddr += offset;
@@ -1647,60 +2629,49 @@ static bool DoWriteConfigBits18(const PIC_DEFINITION *picDevice, unsigned char *
 	}
 
 	fail = false;
-	temp1 = cfgbits[10];		// for 18xxx devices, config7 MUST be written before config6,
-	temp2 = cfgbits[11];		// so swap the words in the buffer.
-	cfgbits[10] = cfgbits[12];
-	cfgbits[11] = cfgbits[13];
-	cfgbits[12] = temp1;
-	cfgbits[13] = temp2;
+	written = 0;
 
-	for (i=0; i < cfgsize && !fail; )
+	for (i=0; i < cfgsize / 2 && !fail; i++)
 	{
-		addr = devCfgAddr;
-
-		if (addr == 0x30000a)		// swap order of config6 and config7
-			addr = 0x30000c;			// to prevent write protecting config regs
-		else if (addr == 0x30000c)	// before config7 is written
-			addr = 0x30000a;
+		k = i;									// the word to write in this turn
 
-		if (!SetRange(picDevice, addr / 2, 1))
-		{
-			fail = true;
-			fprintf(stderr, "Error sending Set Range command\n");
-		}
-		else
-		{
-			theBuffer[0] = CMD_WRITE_CFG_WORD;
-
-			if (comm_debug)
-			{
-				if (suppressWrite)
-					fprintf(comm_debug, "\nWrite Configuration word - write suppressed");
-				else
-					fprintf(comm_debug, "\nWrite Configuration word");
+		if (devCfgAddr + 2 * k == 0x30000a && 2 * (k + 1) < cfgsize)
+			k++;									// config7 first
+		else if (devCfgAddr + 2 * k == 0x30000c && k)
+			k--;									// then config6
 
-				comm_debug_count = 0;
-			}
+		addr = devCfgAddr + 2 * k;
+		cfgword = (cfgbits[2 * k] << 8) | cfgbits[2 * k + 1];
+		mask = (picDevice->defx[offset + 2 * k] << 8) | picDevice->defx[offset + 2 * k + 1];
 
-			if (!SendMsg(theBuffer, 1, rtnBuffer, 1) || rtnBuffer[0] != theBuffer[0])
-			{
-				fprintf(stderr, "Error sending Write Configuration bits command\n");
-				fail = true;
-			}
+		if (!suppressWrite && offset / 2 + k < 8 && !((cfgword ^ readConfigBits[offset / 2 + k]) & mask))
+			continue;							// already there
 
-			theBuffer[0] = cfgbits[i++];
-			theBuffer[1] = cfgbits[i++];
+		size = RangeFrame(picDevice, addr / 2, 1, frame);
+		frame[size++] = CMD_WRITE_CFG_WORD;
+		frame[size++] = cfgbits[2 * k];
+		frame[size++] = cfgbits[2 * k + 1];
 
-			devCfgAddr += 2;
+		if (comm_debug)
+		{
+			if (suppressWrite)
+				TracePrintf("\nWrite Configuration word 0x%06x - write suppressed", addr);
+			else
+				TracePrintf("\nWrite Configuration word 0x%06x", addr);
+		}
 
-			if (!SendMsg(theBuffer, 2, rtnBuffer, 3) || rtnBuffer[0] != theBuffer[0] || rtnBuffer[1] != theBuffer[1])
-			{
-				fprintf(stderr, "failed to verify while writing configuration bits\n");
-				fail = true;
-			}
+		if (!SendFrame(frame, size, echo, &mismatch) || mismatch >= 0 || !SendMsg(frame, 0, &status, 1))
+		{
+			fprintf(stderr, "failed to verify while writing configuration bits\n");
+			fail = true;
 		}
+
+		written++;
 	}
 
+	if (verboseOutput && !fail)
+		fprintf(stdout, "configuration bits: %u of %u words written\n", written, cfgsize / 2);
+
 	return(!fail);
 }
 
@@ -1710,52 +2681,54 @@ static bool DoWriteConfigBits18(const PIC_DEFINITION *picDevice, unsigned char *
 static bool DoWriteConfigBits(const PIC_DEFINITION *picDevice, unsigned char *cfgbits, unsigned int cfgsize, unsigned int offset)
 {
 	bool				fail;
-	unsigned int	i, j;
+	unsigned int	i, j, k;
 	const unsigned char	*cfgmask;
 	unsigned short int	cfgdata, savebits, fixedbits;
 	unsigned char	theBuffer[3], rtnBuffer[3];
 
 	cfgmask = picDevice->defx;
 
+	if ((offset + cfgsize > (j = GetConfigSize(picDevice) * 2)) || !cfgsize || (cfgsize & 1))
+	{
+		fprintf(stderr, "Invalid request of size %u to write configuration"
+			" bits.\nThis device configuration space size is %u\n",
+			cfgsize, j);
+		return false;
+	}
+
 	for (i=0; i<cfgsize; i++)		// mask out invalid bits
-		cfgbits[i] &= cfgmask[i];
+		cfgbits[i] &= cfgmask[offset + i];
 
-	if (picDevice->fixedCfgBitsSize)		// need to restore factory set bits
-	{
+	if (picDevice->fixedCfgBitsSize || (is18device && !suppressWrite))	// read once, for the factory set bits
+	{																					// and the 18xxx words already there
 		if (!DoReadCfg(picDevice, false))	// read current config registers into readConfigBits[]
 		{
 			fprintf(stderr, "failed to read configuration bits\n");
 			return false;
 		}
+	}
 
-		for (i=0; i<picDevice->fixedCfgBitsSize; i++)
+	if (picDevice->fixedCfgBitsSize)		// need to restore factory set bits
+	{
+		for (i=offset / 2; i<picDevice->fixedCfgBitsSize && i<(offset + cfgsize) / 2; i++)
 		{
-			cfgdata = cfgbits[2 * i] << 8 | (cfgbits[2 * i + 1] & 0xff);	// get blank data
+			k = 2 * i - offset;									// where word i is in cfgbits
+			cfgdata = cfgbits[k] << 8 | (cfgbits[k + 1] & 0xff);	// get blank data
 			fixedbits = picDevice->fixedCfgBits[i];		// get bits read from device
 			savebits = readConfigBits[i] & fixedbits;		// get the read bits we need to restore
 			cfgdata &= ~fixedbits;								// mask out that part of fixed data
 			cfgdata |= savebits;									// add in the bits we read from device
-			cfgbits[2 * i] = cfgdata >> 8;					// modify blank buffer data
-			cfgbits[2 * i + 1] = cfgdata & 0xff;
+			cfgbits[k] = cfgdata >> 8;							// modify blank buffer data
+			cfgbits[k + 1] = cfgdata & 0xff;
 		}
 	}
 
-	if ((cfgsize > (j = GetConfigSize(picDevice) * 2)) || !cfgsize || (cfgsize & 1))
-	{
-		fprintf(stderr, "Invalid request of size %u to write configuration"
-			" bits.\nThis device configuration space size is %u\n",
-			cfgsize, j);
-		return false;
-	}
-
 	if (comm_debug)
 	{
 		if (suppressWrite)
-			fprintf(comm_debug, "\nWrite Configuration bits - write suppressed");
+			TracePrintf("\nWrite Configuration bits - write suppressed");
 		else
-			fprintf(comm_debug, "\nWrite Configuration bits");
-
-		comm_debug_count = 0;
+			TracePrintf("\nWrite Configuration bits");
 	}
 
 	if (is18device)			// if 18xxx device, must use different algorithm
@@ -1868,11 +2841,9 @@ static bool DoEraseConfigBits(const PIC_DEFINITION *picDevice)
 	if (comm_debug)
 	{
 		if (suppressWrite)
-			fprintf(comm_debug, "\nErase Configuration (write cfg cmd) - write suppressed");
+			TracePrintf("\nErase Configuration (write cfg cmd) - write suppressed");
 		else
-			fprintf(comm_debug, "\nErase Configuration (write cfg cmd)");
-
-		comm_debug_count = 0;
+			TracePrintf("\nErase Configuration (write cfg cmd)");
 	}
 
 	fail = !DoWriteConfigBits(picDevice, theBuffer, size, 0);
@@ -1910,11 +2881,9 @@ static bool DoWriteIDLocs(const PIC_DEFINITION *picDevice, unsigned char *idlocs
 	if (comm_debug)
 	{
 		if (suppressWrite)
-			fprintf(comm_debug, "\nWrite ID Locations - write suppressed");
+			TracePrintf("\nWrite ID Locations - write suppressed");
 		else
-			fprintf(comm_debug, "\nWrite ID Locations");
-
-		comm_debug_count = 0;
+			TracePrintf("\nWrite ID Locations");
 	}
 
 	if (!SendMsg(theBuffer, 1, rtnBuffer, 1) || rtnBuffer[0] != theBuffer[0])
@@ -1996,11 +2965,9 @@ static bool DoEraseIDLocs(const PIC_DEFINITION *picDevice)
 		if (comm_debug)
 		{
 			if (suppressWrite)
-				fprintf(comm_debug, "\nErase ID Locations (write ID cmd) - write suppressed");
+				TracePrintf("\nErase ID Locations (write ID cmd) - write suppressed");
 			else
-				fprintf(comm_debug, "\nErase ID Locations (write ID cmd)");
-
-			comm_debug_count = 0;
+				TracePrintf("\nErase ID Locations (write ID cmd)");
 		}
 
 		fail = !DoWriteIDLocs(picDevice, theBuffer, size);
@@ -2016,96 +2983,84 @@ static bool DoEraseIDLocs(const PIC_DEFINITION *picDevice)
 }
 
 //--------------------------------------------------------------------
-// copy buffer to device, starting at word address startAddr_w, running for size_w words
-//  DOES NOT boundary-check range -- will attempt to write outside of device's memory
-//  Returns true if okay, false if failed
-//  Verify error counts as failure only if failOnVerf = true
-
-static bool WritePgmRange(const PIC_DEFINITION *picDevice, unsigned short int startAddr_w, unsigned short int size_w, unsigned char *buffer)
+// send one block of program words (already in programmer byte order) with a
+// single set range and write program command.
+//  *mismatch is set to the offset of the first byte that didn't echo back
+//  correctly, or -1. *confirmed is set to the number of words whose echo came
+//  back correctly before anything went wrong.
+//  If stopOnMismatch is true the block is abandoned at the first bad echo
+//  (the programmer is left waiting for the rest and must be resynchronized).
+//  Returns false if the exchange with the programmer broke down
+
+static bool WritePgmBlock(const PIC_DEFINITION *picDevice, unsigned short int startAddr_w, unsigned short int size_w,
+	unsigned char *buffer, unsigned char *rtnBuffer, int *mismatch, unsigned int *confirmed, bool stopOnMismatch)
 {
-	bool				fail, verifyFail, nowrite;
-	unsigned char	temp, cmdBuffer[2];
-	int				idx;
+	bool				fail, nowrite;
+	unsigned char	cmdBuffer[2], cmd;
+	unsigned int	idx;
 
-	fail = verifyFail = false;
+	if (IsRemote(serialDevice))
+		return RemoteWritePgmBlock(picDevice, startAddr_w, size_w, buffer, mismatch, confirmed, stopOnMismatch);
+
+	fail = false;
+	*mismatch = -1;
+	*confirmed = 0;
+	idx = 0;
 	nowrite = suppressWrite;
 	suppressWrite = false;
 
 	if (SetRange(picDevice, startAddr_w, size_w))
 	{
-		idx = 0;
-
-		while (idx < (size_w * 2))
-		{
-			temp = buffer[idx + 1];
-			buffer[idx + 1] = buffer[idx];				// swap byte order (make it little endian)
-			buffer[idx] = temp;
-			idx += 2;
-		}
-
 		cmdBuffer[0] = CMD_WRITE_PGM;						// add in the command
 		suppressWrite = nowrite;
+		cmd = SelectTiming(CMD_WRITE_PGM);
 
 		if (comm_debug)
 		{
-			fprintf(comm_debug, "\nWrite Program");
+			TracePrintf("\nWrite Program");
 
 			if (suppressWrite)
-				fprintf(comm_debug, " - write suppressed");
-
-			comm_debug_count = 0;
-			sendCommand = true;
+				TracePrintf(" - write suppressed");
 		}
 
 		if (SendMsg(cmdBuffer, 1 ,cmdBuffer, 1))		// send the command, watch for it to bounce back
 		{
 			if (comm_debug && suppressWrite)
-			{
-				fprintf(comm_debug, "\n");
-				comm_debug_count = 0;
-			}
+				TracePrintf("\n");
 
 			if (*cmdBuffer == CMD_WRITE_PGM)
 			{
 				writingProgram = true;
-				idx = 0;
 
-				while (!fail && (idx < (size_w * 2)))
+				if (GetQuirks() & QUIRK_LOCKSTEP)
 				{
-					if (ISPflag || (is18device && isWarp13))
-						fail = !SendMsgWait(&buffer[idx], 2, cmdBuffer, 2);
-					else
-						fail = !SendMsg(&buffer[idx], 2, cmdBuffer, 2);
-
-					if (!fail)
+					while (!fail && (idx < (unsigned int) (size_w * 2)) && !(stopOnMismatch && *mismatch >= 0))
 					{
-						if ((buffer[idx] != cmdBuffer[0]) || (buffer[idx + 1] != cmdBuffer[1]))
-							verifyFail = true;						// didn't get back what we sent
+						fail = !SendMsgWait(&buffer[idx], 2, &rtnBuffer[idx], 2);
+
+						if (!fail)
+						{
+							if (((buffer[idx] != rtnBuffer[idx]) || (buffer[idx + 1] != rtnBuffer[idx + 1])) && *mismatch < 0)
+								*mismatch = idx;					// didn't get back what we sent
 
-						idx += 2;
-						ShowHashMark(idx);
+							idx += 2;
+							ShowHashMark(idx);
+						}
 					}
-					else
-						fprintf(stderr, "failed to send write program data\n");
 				}
+				else		// keep a window of words in flight, check echoes as they arrive
+					fail = !SendMsgStream(buffer, size_w * 2, rtnBuffer, pipeWindow * 2, mismatch, stopOnMismatch, &idx, true);
 
-				if (!fail)
+				*confirmed = ((*mismatch >= 0) ? (unsigned int) *mismatch : idx) / 2;
+
+				if (fail)
+					fprintf(stderr, "failed to send write program data\n");
+				else if (stopOnMismatch && *mismatch >= 0)
+					fail = true;								// the rest of the block was never sent
+				else if (!SendMsg(buffer, 0, cmdBuffer, 1) && !suppressWrite)	// eat the trailing zero
 				{
-					if (SendMsg(buffer, 0, cmdBuffer, 1))		// eat the trailing zero
-					{
-						if (verifyFail && !suppressWrite)
-						{
-							if (!ignoreVerfErr)
-								fprintf(stderr, "failed to verify while writing to program space\n");
-							else					// report it but don't fail on it
-								fprintf(stderr, "Warning: failed to verify while writing to program space\n");
-						}
-					}
-					else if (!suppressWrite)
-					{
-						fprintf(stderr, "failed to get trailing 0\n");
-						fail = true;
-					}
+					fprintf(stderr, "failed to get trailing 0\n");
+					fail = true;
 				}
 			}
 			else
@@ -2119,373 +3074,1527 @@ static bool WritePgmRange(const PIC_DEFINITION *picDevice, unsigned short int st
 			fprintf(stderr, "failed to send write program command\n");
 			fail = true;
 		}
+
+		SelectTiming(cmd);
 	}
 	else		// set range failed
 		fail = true;
 
 	suppressWrite = nowrite;
 	writingProgram = false;
-	return(!(fail || (!ignoreVerfErr && verifyFail)));
+	return(!fail);
 }
 
-// For 18Fxxx devices (and possibly others), the Warp-13 resets it's program
-// counter to zero on receipt of a SetRange command regardless of the actual
-// address sent. Therefore we must accumulate all program data and send it as
-// one block even if the hex file is not contiguous.
-//
-// NOTE: This *requires* that any eeprom data, configuration data, or ID
-// location data must be at the end of the hex file.
-//
+//--------------------------------------------------------------------
+// get back in step with the programmer after a failed exchange (see
+// ResyncProgrammer). The speed stays as it is: the programmers have no
+// command to change theirs, so a lower one on our side can't help.
+// Returns true if the programmer is ready for the next command
 
-static bool DoWritePgm18(const PIC_DEFINITION *picDevice, FILE *theFile)
+static bool Resync(const PIC_DEFINITION *picDevice)
 {
-	bool				fail, fileDone;
-	unsigned char	*theBuffer;
-	unsigned int	i, j, startAddr, curAddr, nextAddr, size, align, pgmsize, datasize, idsize, cfgsize;
-	unsigned char	data, temp;
-	unsigned int	devCfgAddr, devIDAddr, devDataAddr;
+	if (comm_debug)
+		TracePrintf("\nResynchronizing");
 
-	fail = fileDone = false;
-	align = GetWordAlign(picDevice) * 2;
-	pgmsize = GetPgmSize(picDevice) * 2;
+	return ResyncProgrammer(picDevice);
+}
 
-	if ((theBuffer = (unsigned char *) malloc(BUFFERSIZE)))
-	{
-		InitHashMark(pgmsize, hashWidth);	// go to too much effort to set the width
-		InitParse();								// get ready to start reading the hex file
-		fileDone = !GetNextByte(theFile, &nextAddr, &data);	// get a byte and the initial address
-		devCfgAddr = GetConfigStart(picDevice) * 2;	// address of device's config memory
-		devIDAddr  = GetIDAddr(picDevice) * 2;		// address of id locations.
-		devDataAddr = GetEepromStart(picDevice);	// address of eeprom data
-		datasize = GetDataSize(picDevice);
-		idsize = GetIDSize(picDevice) * 2;
-		cfgsize = GetConfigSize(picDevice) * 2;
+//--------------------------------------------------------------------
+// reset the programmer (abandoning whatever command it was in the middle
+// of), drain the line, make sure it answers a ping, then load the device
+// parameters again. The link itself (speed, error count) is left alone.
+// Returns true if the programmer is ready for the next command
 
-		for (i=0; i<BUFFERSIZE; i++)	// prefill buffer since hex file may not be contiguous
-			theBuffer[i] = 0xff;
+static bool ResyncProgrammer(const PIC_DEFINITION *picDevice)
+{
+	unsigned char	theBuffer[64];
 
-		size = 0;
+	if (!ResetProgrammer())
+		return false;
 
-		while (!fileDone && !fail)
-		{
-			startAddr = nextAddr;	// the first address of the new block
-			curAddr = startAddr;
+	while (ReadBytes(serialDevice, theBuffer, sizeof(theBuffer), RESYNC_QUIET) > 0)
+		;												// wait for the line to go quiet
 
-			if (curAddr >= BUFFERSIZE)	// if not within program range, must be config, ID, etc
-			{
-				if (size)					// write any pending program data
-				{
-					fail = !WritePgmRange(picDevice, 0, size / 2, theBuffer);
-				}
+	FlushBytes(serialDevice);
+	return PingProgrammer() && DoInitPIC(picDevice);
+}
 
-				size = 0;					// then start at beginning of buffer
-			}
-			else
-				size = startAddr;			// number of bytes waiting to be sent
+//--------------------------------------------------------------------
+// copy buffer to device, starting at word address startAddr_w, running for size_w words
+//  DOES NOT boundary-check range -- will attempt to write outside of device's memory
+//  Returns true if okay, false if failed
+//  Verify error counts as failure only if failOnVerf = true
+//  Up to pipeWindow words are sent ahead of their echoes (except where the
+//  programmer needs each byte echoed before the next one is sent)
+//  If the exchange breaks down (timeout or bad echo), the programmer is
+//  resynchronized and writing resumes from the last word whose echo was
+//  confirmed, up to resyncRetries times
 
-			if (align && (startAddr % align) && startAddr < pgmsize) // assuming program addr starts at zero.
-			{
-				if (startAddr < align)
-				{
-					fprintf(stderr, "Error: Wrong addressing "
-						"on hex file (unaligned address "
-						"at position 0x%X). Wrong processor type?\n",
-						 startAddr);
-						 fail = true;
-						 break;
-				}
+static bool WritePgmRange(const PIC_DEFINITION *picDevice, unsigned short int startAddr_w, unsigned short int size_w, unsigned char *buffer)
+{
+	bool				fail, retry;
+	unsigned char	temp, *rtnBuffer;
+	int				idx, mismatch;
+	unsigned int	done, confirmed, retries;
+
+	if (!(rtnBuffer = (unsigned char *) malloc(size_w * 2 + 1)))	// room for every echo
+	{
+		fprintf(stderr, "failed to malloc %d bytes\n", size_w * 2 + 1);
+		return false;
+	}
+
+	idx = 0;
+
+	while (idx < (size_w * 2))
+	{
+		temp = buffer[idx + 1];
+		buffer[idx + 1] = buffer[idx];				// swap byte order (make it little endian)
+		buffer[idx] = temp;
+		idx += 2;
+	}
+
+	done = 0;											// words known to be written
+	retries = suppressWrite ? 0 : resyncRetries;
+
+	do
+	{
+		retry = (retries > 0);						// only give up on a block early if it will be tried again
+		fail = !WritePgmBlock(picDevice, startAddr_w + done, size_w - done, &buffer[done * 2], rtnBuffer,
+			&mismatch, &confirmed, retry && !ignoreVerfErr);
+
+		if (!(fail || (mismatch >= 0 && !ignoreVerfErr)) || !retry)
+			break;
+
+		if (SetRangeAtZero(picDevice, true))	// can't start part way through, so start over
+			done = 0;
+		else
+			done += confirmed;
+
+		if (done >= size_w)						// every word made it, only the trailing zero was lost
+		{
+			fail = !Resync(picDevice);
+			break;
+		}
+
+		retries--;
+		fprintf(stderr, "lost step with programmer at word 0x%04x, retrying (%u %s left)\n",
+			startAddr_w + done, retries, (retries == 1) ? "retry" : "retries");
+
+		if (!Resync(picDevice))
+		{
+			fprintf(stderr, "failed to resynchronize with programmer\n");
+			break;
+		}
+	}
+	while (true);
+
+	if (!fail && mismatch >= 0 && !suppressWrite)
+	{
+		if (!ignoreVerfErr)
+			fprintf(stderr, "failed to verify while writing to program space at word 0x%04x\n",
+				startAddr_w + done + mismatch / 2);
+		else					// report it but don't fail on it
+			fprintf(stderr, "Warning: failed to verify while writing to program space at word 0x%04x\n",
+				startAddr_w + done + mismatch / 2);
+	}
+
+	free(rtnBuffer);
+	return(!(fail || (!ignoreVerfErr && mismatch >= 0)));
+}
+
+//--------------------------------------------------------------------
+// read size_w words of program memory starting at startAddr_w. The buffer
+// must hold size_w * 2 + 2 bytes: the command, the words (little endian)
+// and the terminating zero, so the data starts at buffer[1]
+
+static bool ReadPgmRange(const PIC_DEFINITION *picDevice, unsigned int startAddr_w, unsigned int size_w, unsigned char *buffer)
+{
+	unsigned char	temp;
+	unsigned int	idx;
+
+	if (!SetRange(picDevice, startAddr_w, size_w))
+		return false;
+
+	buffer[0] = CMD_READ_PGM;
+
+	if (comm_debug)
+		TracePrintf("\nRead Program");
+
+			// ask it to fill the buffer (plus the command plus a terminating zero)
+	if (!SendMsg(buffer, 1, buffer, size_w * 2 + 2))
+	{
+		fprintf(stderr, "failed to send read program command\n");
+		return false;
+	}
+
+	// DEBUG shouldn't need to swap byte order here but we do
+
+	for (idx=1; idx < size_w * 2 + 1; idx += 2)
+	{
+		temp = buffer[idx + 1];
+		buffer[idx + 1] = buffer[idx];	// swap byte order (make it little endian)
+		buffer[idx] = temp;
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------
+// find out whether reads on a programmer listed with QUIRK_SETRANGE_PC
+// really start at zero. The first few program words are read, then a word
+// that differs from the first is read on its own: if it comes back, set
+// range works for reads. Only reads, so the device is left alone; if the
+// words are all the same (a blank part) the test can't tell.
+
+static void TestSetRangeReads(const PIC_DEFINITION *picDevice)
+{
+	unsigned char			buffer[SETRANGE_TEST_WORDS * 2 + 2], single[4];
+	unsigned int			i;
+	unsigned short int	first, word;
+
+	setRangeReads = SETRANGE_UNKNOWN;			// tested once per run
+
+	if (GetPgmSize(picDevice) < SETRANGE_TEST_WORDS || !ReadPgmRange(picDevice, 0, SETRANGE_TEST_WORDS, buffer))
+		return;
+
+	first = buffer[1] | (buffer[2] << 8);
+
+	for (i=1; i<SETRANGE_TEST_WORDS; i++)
+	{
+		if ((buffer[i * 2 + 1] | (buffer[i * 2 + 2] << 8)) != first)
+			break;
+	}
+
+	if (i == SETRANGE_TEST_WORDS)
+	{
+		if (comm_debug)
+			TracePrintf("\nSet range read test: first %u words all 0x%04x, can't tell\n", SETRANGE_TEST_WORDS, first);
+
+		return;
+	}
+
+	word = buffer[i * 2 + 1] | (buffer[i * 2 + 2] << 8);
+
+	if (!ReadPgmRange(picDevice, i, 1, single))
+		return;
+
+	setRangeReads = ((single[1] | (single[2] << 8)) == word) ? SETRANGE_WORKS : SETRANGE_AT_ZERO;
+
+	if (comm_debug)
+		TracePrintf("\nSet range read test: word 0x%x read alone as 0x%04x (0x%04x in place, 0x%04x at 0): %s\n", i,
+			single[1] | (single[2] << 8), word, first, (setRangeReads == SETRANGE_WORKS) ? "works" : "starts at zero");
+}
+
+//--------------------------------------------------------------------
+// --test-setrange: find out whether writes on a programmer listed with
+// QUIRK_SETRANGE_PC land where set range says. A row of zero words is
+// written as the second row of program memory and the first two rows are
+// read back: the row turns up either where it was sent or at zero. That
+// programs the device, so it is only done on a flash part that is blank
+// in every region, and a bulk erase afterwards leaves it blank as it was.
+// The answer is kept for this firmware version in FIRMWARE_FILE, where
+// SetRangeAtZero looks for it.
+
+static bool TestSetRangeWrites(const PIC_DEFINITION *picDevice)
+{
+	unsigned char	*buffer, status;
+	unsigned int	row, i;
+	bool				atRow, atZero;
+	char				key[32], line[64];
+	int				lock;
+
+	if (!(GetQuirks() & QUIRK_SETRANGE_PC))
+	{
+		fprintf(stdout, "This programmer doesn't need a set range test for %s\n", picDevice->name);
+		return true;
+	}
+
+	row = GetWordAlign(picDevice) ? GetWordAlign(picDevice) : 1;
+
+	if (!IsFlashDevice(picDevice) || GetPgmSize(picDevice) < 2 * row)
+	{
+		fprintf(stderr, "set range test: needs a flash part\n");
+		return false;
+	}
+
+	if (!BlankStatus(&status) || (status & (BLANK_PGM | BLANK_CFG | BLANK_ID | BLANK_DATA)))
+	{
+		fprintf(stderr, "set range test: needs a blank part (erase it with -ef first)\n");
+		return false;
+	}
+
+	if (!(buffer = (unsigned char *) calloc(1, row * 4 + 2)))
+	{
+		fprintf(stderr, "set range test: out of memory\n");
+		return false;
+	}
+
+	if (comm_debug)
+		TracePrintf("\nSet range write test: %u zero words at 0x%x\n", row, row);
+
+	atRow = atZero = false;
+
+	if (WritePgmRange(picDevice, row, row, buffer) && ReadPgmRange(picDevice, 0, 2 * row, buffer))
+	{
+		atZero = atRow = true;
+
+		for (i=0; i<row; i++)
+		{
+			atZero = atZero && !buffer[i * 2 + 1] && !buffer[i * 2 + 2];
+			atRow = atRow && !buffer[(row + i) * 2 + 1] && !buffer[(row + i) * 2 + 2];
+		}
+	}
+
+	free(buffer);
+
+	if (!DoEraseFlash(picDevice))
+	{
+		fprintf(stderr, "set range test: program memory may still hold zero words at 0x0 or 0x%x\n", row);
+		return false;
+	}
+
+	if (atRow == atZero)						// neither, or both
+	{
+		fprintf(stderr, "set range test: the test row came back %s, can't tell\n", atRow ? "twice" : "nowhere");
+		return false;
+	}
+
+	setRangeWrites = atRow ? SETRANGE_WORKS : SETRANGE_AT_ZERO;
+	snprintf(key, sizeof(key), "warp13-%08x", w13version);
+	snprintf(line, sizeof(line), "%s %s\n", key, atRow ? "works" : "zero");
+	lock = LockLearned(FIRMWARE_FILE);
+	SaveLearned(FIRMWARE_FILE, key, line);
+	UnlockLearned(lock);
+
+	fprintf(stdout, "Programmer firmware 0x%08x %s (saved in ~/%s)\n", w13version,
+		atRow ? "handles set range, 18xxx program memory goes in pieces" : "starts set range at zero", FIRMWARE_FILE);
+	return true;
+}
+
+//--------------------------------------------------------------------
+// return true if set range starts reads (or, with writing, writes) at
+// zero. Only programmers listed with QUIRK_SETRANGE_PC are asked about,
+// and only where it matters: the 18xxx program memory paths. For writes,
+// what --test-setrange saved for this firmware version is used; for
+// reads, a write that worked is enough, or the read test is run. Anything
+// not shown to work counts as starting at zero.
+
+static bool SetRangeAtZero(const PIC_DEFINITION *picDevice, bool writing)
+{
+	char	key[32], line[64], fileKey[32], result[16];
+
+	if (!(GetQuirks() & QUIRK_SETRANGE_PC))
+		return false;
+
+	if (setRangeWrites == SETRANGE_UNTESTED)
+	{
+		snprintf(key, sizeof(key), "warp13-%08x", w13version);
+
+		if (LoadLearned(FIRMWARE_FILE, key, line, sizeof(line)) && sscanf(line, "%31s %15s", fileKey, result) == 2)
+			setRangeWrites = strcmp(result, "works") ? SETRANGE_AT_ZERO : SETRANGE_WORKS;
+		else
+			setRangeWrites = SETRANGE_UNKNOWN;
+
+		if (setRangeWrites == SETRANGE_WORKS && verboseOutput)
+			fprintf(stdout, "Programmer firmware 0x%08x handles set range, 18xxx program memory goes in pieces\n", w13version);
+	}
+
+	if (writing || setRangeWrites == SETRANGE_WORKS)
+		return setRangeWrites != SETRANGE_WORKS;
+
+	if (setRangeReads == SETRANGE_UNTESTED)
+		TestSetRangeReads(picDevice);
+
+	return setRangeReads != SETRANGE_WORKS;
+}
+
+//--------------------------------------------------------------------
+// receives a read of program memory a chunk at a time (see StreamPgmRange).
+// Return false to stop reading
+
+typedef bool (*PGM_SINK)(void *context, const unsigned char *theBytes, unsigned int address, unsigned int size);
+
+//--------------------------------------------------------------------
+// read size_w words of program memory from startAddr_w and hand them to
+// sink as they arrive, READ_CHUNK_WORDS at a time (little endian, with
+// their byte address), so the caller's work overlaps the rest of the
+// transfer; the serial port keeps receiving meanwhile. The first skip_w
+// words are read but not passed on (for QUIRK_SETRANGE_PC, where every
+// read starts at zero). If sink returns false the read is cut short by
+// resetting the programmer (see ResyncProgrammer); that is the caller's
+// choice, not trouble on the link.
+// Return false if the read failed
+
+static bool StreamPgmRange(const PIC_DEFINITION *picDevice, unsigned int startAddr_w, unsigned int size_w, unsigned int skip_w,
+	PGM_SINK sink, void *context)
+{
+	unsigned char	theBuffer[READ_CHUNK_WORDS * 2], temp;
+	unsigned int	addr, end, count, idx;
+
+	if (!SetRange(picDevice, startAddr_w, size_w))
+		return false;
+
+	theBuffer[0] = CMD_READ_PGM;
+
+	if (comm_debug)
+		TracePrintf("\nRead Program");
+
+	if (!SendMsg(theBuffer, 1, theBuffer, 1) || theBuffer[0] != CMD_READ_PGM)
+	{
+		fprintf(stderr, "failed to send read program command\n");
+		return false;
+	}
+
+	end = (startAddr_w + size_w) * 2;
+
+	for (addr=startAddr_w * 2; addr<end; addr+=count)
+	{
+		count = (end - addr < sizeof(theBuffer)) ? end - addr : sizeof(theBuffer);
+
+		if (addr < (startAddr_w + skip_w) * 2 && addr + count > (startAddr_w + skip_w) * 2)
+			count = (startAddr_w + skip_w) * 2 - addr;		// end the chunk where the skipping does
+
+		if (!SendMsg(NULL, 0, theBuffer, count))
+		{
+			fprintf(stderr, "failed to read program memory at 0x%04x\n", addr / 2);
+			return false;
+		}
+
+		if (addr < (startAddr_w + skip_w) * 2)
+			continue;
+
+		for (idx=0; idx < count; idx += 2)
+		{
+			temp = theBuffer[idx + 1];
+			theBuffer[idx + 1] = theBuffer[idx];	// swap byte order (make it little endian)
+			theBuffer[idx] = temp;
+		}
+
+		if (!sink(context, theBuffer, addr, count))
+			return ResyncProgrammer(picDevice);	// the programmer is still sending the rest
+	}
+
+	if (!SendMsg(NULL, 0, theBuffer, 1) || theBuffer[0] != 0)
+	{
+		fprintf(stderr, "failed to read trailing 0\n");
+		return false;
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------
+// read the ID locations. The buffer must hold GetIDSize() * 2 + 2 bytes:
+// the command, the words (big endian) and the terminating zero
+
+static bool ReadIDLocs(const PIC_DEFINITION *picDevice, unsigned char *buffer)
+{
+	unsigned int	size;
+
+	size = GetIDSize(picDevice) * 2;
+	buffer[0] = CMD_READ_ID;
+
+	if (comm_debug)
+		TracePrintf("\nRead ID Locations");
+
+	if (!SendMsg(buffer, 1, buffer, size + 2))
+	{
+		fprintf(stderr, "failed to send read ID command\n");
+		return false;
+	}
+
+	if ((buffer[0] != CMD_READ_ID) || (buffer[size + 1] != 0))
+	{
+		fprintf(stderr, "failed to read ID locations\n");
+		return false;
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------
+// return true if the passed device is a flash part (xxFxxx or xxLFxxx),
+// one whose program memory can be rewritten in place
+
+static bool IsFlashDevice(const PIC_DEFINITION *picDevice)
+{
+	const char	*name = picDevice->name;
+
+	while (isdigit(*name))
+		name++;
+
+	if (toupper(*name) == 'L')
+		name++;
+
+	return(toupper(*name) == 'F');
+}
+
+//--------------------------------------------------------------------
+// estimate how long erasing program memory one way takes (in microseconds),
+// from the size of program memory, the round trip time, the line speed and
+// what the programmer's commands have taken so far. A bulk erase also
+// pays for reading the regions in keep (BLANK_DATA, BLANK_ID, BLANK_CFG)
+// beforehand and writing them back afterwards.
+// Return ERASE_INVALID if the device can't be erased that way
+
+static unsigned long long EraseCost(const PIC_DEFINITION *picDevice, int method, unsigned long long roundTrip, unsigned char keep)
+{
+	unsigned long long	byteTime, wordTime, oscCal, cost;
+	unsigned int			words;
+	bool						oscWiped;
+
+	byteTime = 10000000ULL / baudRate;					// start and stop bits
+	oscCal = (GetOscCalSize(picDevice) && GetOscCalStart(picDevice)) ? 2 * (roundTrip + 4 * byteTime) : 0;	// read it and write it back
+
+	if (GetQuirks() & QUIRK_LOCKSTEP)
+		wordTime = 2 * (roundTrip + byteTime);
+	else
+		wordTime = roundTrip + 4 * byteTime;
+
+	switch (method)
+	{
+		case ERASE_BULK:										// clears the whole device, osc cal too
+			if (!IsFlashDevice(picDevice))
+				return ERASE_INVALID;
+
+			cost = roundTrip + TimingEstimate(CMD_ERASE_FLASH, ERASE_FLASH_ESTIMATE) + oscCal;
+
+			if ((keep & BLANK_DATA) && GetDataSize(picDevice))
+				cost += 2 * roundTrip + GetDataSize(picDevice) * (byteTime + EEPROM_BYTE_ESTIMATE);
+
+			if ((keep & BLANK_ID) && GetIDSize(picDevice))
+				cost += 2 * roundTrip + GetIDSize(picDevice) * (2 * byteTime + wordTime);
+
+			if ((keep & BLANK_CFG) && GetConfigSize(picDevice))
+				cost += 3 * roundTrip + GetConfigSize(picDevice) * (2 * byteTime + wordTime);
+
+			return cost;
+
+		case ERASE_STREAM:									// a round trip for every word
+			if (!IsFlashDevice(picDevice) || is18device)
+				return ERASE_INVALID;
+
+			words = EraseWords(picDevice, &oscWiped);
+
+			if (!oscWiped)										// stops short of osc cal, nothing to save
+				oscCal = 0;
+
+			return 2 * roundTrip + words * wordTime + TimingEstimate(CMD_BLANK_CHECK, BLANK_CHECK_ESTIMATE) + oscCal;
+	}
+
+	return ERASE_INVALID;
+}
+
+//--------------------------------------------------------------------
+// bulk erase the device, but read the regions in keep (BLANK_DATA,
+// BLANK_ID, BLANK_CFG) first and write them back afterwards, so only
+// program memory and the regions not kept end up blank. Osc cal is
+// kept by DoEraseFlash. EEPROM that was blank isn't written back.
+
+static bool DoEraseFlashKeeping(const PIC_DEFINITION *picDevice, unsigned char keep)
+{
+	unsigned char	idBuffer[32], idLocs[32], cfgBuffer[MAX_CFG_SIZE * 2];
+	unsigned int	i, dataSize, idSize, cfgSize;
+	bool				fail, dataBlank;
+
+	dataSize = (keep & BLANK_DATA) ? GetDataSize(picDevice) : 0;
+	idSize = (keep & BLANK_ID) ? GetIDSize(picDevice) * 2 : 0;
+	cfgSize = (keep & BLANK_CFG) ? GetConfigSize(picDevice) * 2 : 0;
+
+	if (idSize + 2 > sizeof(idBuffer) || cfgSize > sizeof(cfgBuffer))
+	{
+		fprintf(stderr, "Device %s has too many ID or configuration words to keep\n", picName);
+		return false;
+	}
+
+	if (dataSize && !ReadEepromImage(picDevice))
+		return false;
+
+	if (idSize && !ReadIDLocs(picDevice, idBuffer))
+		return false;
+
+	if (cfgSize && !DoReadCfg(picDevice, false))
+		return false;
+
+	for (i=0; i<idSize; i+=2)					// DoWriteIDLocs takes them low byte first
+	{
+		idLocs[i] = idBuffer[i + 2];
+		idLocs[i + 1] = idBuffer[i + 1];
+	}
+
+	for (i=0; i<cfgSize / 2; i++)
+	{
+		cfgBuffer[2 * i] = readConfigBits[i] >> 8;
+		cfgBuffer[2 * i + 1] = readConfigBits[i] & 0xff;
+	}
+
+	dataBlank = true;
+
+	for (i=0; i<dataSize; i++)
+		dataBlank = dataBlank && eepromData[i + 1] == 0xff;
+
+	if (comm_debug)
+		TracePrintf("\nErase Flash keeping 0x%02x", keep);
+
+	if (!DoEraseFlash(picDevice))
+		return false;
+
+	fail = false;
+
+	if (dataSize && !dataBlank)
+		fail = !WriteEepromImage(picDevice, dataSize);
+
+	if (idSize && !fail)
+		fail = !DoWriteIDLocs(picDevice, idLocs, idSize);
+
+	if (cfgSize && !fail)
+		fail = !DoWriteConfigBits(picDevice, cfgBuffer, cfgSize, 0);
+
+	if (fail)
+		fprintf(stderr, "Device %s was erased, but not everything kept could be written back\n", picName);
+
+	return(!fail);
+}
+
+//--------------------------------------------------------------------
+// -e auto: erase program memory the cheapest way the device and the
+// programmer allow, leaving the regions in keep (BLANK_DATA, BLANK_ID,
+// BLANK_CFG) as they were. The programmer has no row erase command, so
+// the choice is between streaming blank words and a bulk erase with the
+// kept regions read first and written back; nothing is done if program
+// memory is already known to be blank. Osc cal is only saved and restored
+// by the methods that would wipe it. If erased isn't NULL it is set to
+// the regions (BLANK_xxx) left blank.
+
+static const char	*eraseMethodName[ERASE_METHODS] = {"bulk flash erase, keeping the rest", "blank word streaming"};
+
+static bool DoEraseAuto(const PIC_DEFINITION *picDevice, unsigned char keep, unsigned char *erased)
+{
+	unsigned long long	roundTrip, cost, best;
+	int						method, choice;
+
+	if (erased)
+		*erased = BLANK_PGM;
+
+	if (pgmBlank)
+	{
+		if (verboseOutput)
+			fprintf(stdout, "Program memory is already blank, erase skipped\n");
+
+		return true;
+	}
+
+	if (!(roundTrip = MeasureRoundTrip()))
+		roundTrip = 1000;									// not measured (writes suppressed): assume a millisecond
+
+	choice = -1;
+	best = ERASE_INVALID;
+
+	for (method=0; method<ERASE_METHODS; method++)
+	{
+		cost = EraseCost(picDevice, method, roundTrip, keep);
+
+		if (cost == ERASE_INVALID)
+			continue;
+
+		if (verboseOutput)
+			fprintf(stdout, "  %s: about %llu.%03llu s\n", eraseMethodName[method], cost / 1000000, cost / 1000 % 1000);
+
+		if (cost < best)
+		{
+			best = cost;
+			choice = method;
+		}
+	}
+
+	if (choice < 0)
+	{
+		fprintf(stderr, "Device %s can't be erased electrically\n", picName);
+		return false;
+	}
+
+	if (verboseOutput)
+		fprintf(stdout, "Erase method: %s\n", eraseMethodName[choice]);
+
+	if (comm_debug)
+		TracePrintf("\nErase auto: %s, round trip %llu us, estimate %llu us", eraseMethodName[choice], roundTrip, best);
+
+	if (choice == ERASE_BULK)
+	{
+		if (erased)
+			*erased = (BLANK_PGM | BLANK_DATA | BLANK_ID | BLANK_CFG) & ~keep;
+
+		return DoEraseFlashKeeping(picDevice, keep);
+	}
+
+	return DoErasePgm(picDevice, false, true);
+}
+
+//--------------------------------------------------------------------
+// read back what the device holds wherever the image would write, and
+// forget the parts of the image that are already there (-wpd), so the
+// plan only writes what changed. Program memory is compared a row
+// (GetWordAlign words) at a time, since that is the smallest write.
+// ID locations, EEPROM and configuration are each written as a whole
+// by the programmer, so they are either skipped or written completely.
+// Only the bits the device implements are compared. Osc cal is always
+// written.
+
+static bool DiffImage(const PIC_DEFINITION *picDevice, IMAGE *image)
+{
+	IMAGE_REGION			*theRegion;
+	unsigned char			*theBuffer, idBuffer[32];
+	unsigned int			row, start, end, i, j, scale, rows, changed;
+	unsigned short int	mask, fileWord, devWord;
+	bool						differ;
+
+	theRegion = &image->region[IMAGE_PGM];
+
+	if (theRegion->low < theRegion->high)
+	{
+		row = GetWordAlign(picDevice) * 2;
+
+		if (!row)
+			row = 2;
+
+		start = SetRangeAtZero(picDevice, false) ? 0 : theRegion->low / row * row;
+		end = (theRegion->high + row - 1) / row * row;
+
+		if (end > theRegion->size)
+			end = theRegion->size;
+
+		if (!(theBuffer = (unsigned char *) malloc(end - start + 2)))
+		{
+			fprintf(stderr, "failed to malloc %u bytes\n", end - start + 2);
+			return false;
+		}
+
+		if (!ReadPgmRange(picDevice, start / 2, (end - start) / 2, theBuffer))
+		{
+			free(theBuffer);
+			return false;
+		}
+
+		mask = GetWordWidth(picDevice);
+		rows = changed = 0;
+
+		for (i=start; i<end; i+=row)
+		{
+			if (!ImagePresent(image, IMAGE_PGM, i, row))
+				continue;
+
+			differ = false;
+
+			for (j=i; j<i+row && j+1<end && !differ; j+=2)
+			{
+				if (theRegion->present[j] || theRegion->present[j + 1])
+				{
+					fileWord = theRegion->data[j] | (theRegion->data[j + 1] << 8);
+					devWord = theBuffer[j - start + 1] | (theBuffer[j - start + 2] << 8);
+					differ = ((fileWord ^ devWord) & mask) != 0;
+				}
+			}
+
+			rows++;
+
+			if (differ)
+				changed++;
+			else
+				ImageForget(image, IMAGE_PGM, i, row);
+		}
+
+		free(theBuffer);
+
+		if (verboseOutput)
+			fprintf(stdout, "program memory: %u of %u rows differ\n", changed, rows);
+	}
+
+	theRegion = &image->region[IMAGE_ID];
+
+	if (theRegion->low < theRegion->high && theRegion->size + 2 <= sizeof(idBuffer))
+	{
+		if (!ReadIDLocs(picDevice, idBuffer))
+			return false;
+
+		mask = (picDevice->def[PD_ID_MASKH] << 8) | picDevice->def[PD_ID_MASKL];
+		differ = false;
+
+		for (i=0; i<theRegion->high && !differ; i+=2)
+		{
+			fileWord = theRegion->data[i] | (theRegion->data[i + 1] << 8);
+			devWord = (idBuffer[i + 1] << 8) | idBuffer[i + 2];
+			differ = ((fileWord ^ devWord) & mask) != 0;
+		}
+
+		if (!differ)
+			ImageForget(image, IMAGE_ID, 0, theRegion->size);
+
+		if (verboseOutput)
+			fprintf(stdout, "ID locations: %s\n", differ ? "differ" : "unchanged");
+	}
+
+	theRegion = &image->region[IMAGE_DATA];
+
+	if (theRegion->low < theRegion->high)
+	{
+		if (!ReadEepromImage(picDevice))
+			return false;
+
+		scale = (GetWordWidth(picDevice) == 0xffff) ? 1 : 2;
+		differ = false;
+
+		for (i=0; i * scale < theRegion->high && !differ; i++)
+			differ = theRegion->data[i * scale] != eepromData[i + 1];
+
+		if (!differ)
+			ImageForget(image, IMAGE_DATA, 0, theRegion->size);
+
+		if (verboseOutput)
+			fprintf(stdout, "EEPROM data: %s\n", differ ? "differs" : "unchanged");
+	}
+
+	theRegion = &image->region[IMAGE_CFG];
+
+	if (theRegion->low < theRegion->high)
+	{
+		if (!DoReadCfg(picDevice, false))
+			return false;
+
+		differ = false;
+
+		for (i=0; i<theRegion->high && i/2 < 8 && !differ; i+=2)
+		{
+			mask = (picDevice->defx[i] << 8) | picDevice->defx[i + 1];
+
+			if (i/2 < picDevice->fixedCfgBitsSize)
+				mask &= ~picDevice->fixedCfgBits[i/2];		// factory set, restored rather than written
+
+			fileWord = theRegion->data[i] | (theRegion->data[i + 1] << 8);
+			differ = ((fileWord ^ readConfigBits[i/2]) & mask) != 0;
+		}
+
+		if (!differ)
+			ImageForget(image, IMAGE_CFG, 0, theRegion->size);
+
+		if (verboseOutput)
+			fprintf(stdout, "configuration bits: %s\n", differ ? "differ" : "unchanged");
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------
+// fill in the EEPROM locations the file doesn't set with what the device
+// holds now, so writing the data space (which always goes as a whole)
+// keeps them, e.g. a per-unit calibration (-wpm). Nothing is read if
+// the file has no EEPROM data.
+
+static bool MergeEepromData(const PIC_DEFINITION *picDevice, IMAGE *image)
+{
+	IMAGE_REGION	*theRegion = &image->region[IMAGE_DATA];
+	unsigned int	i, scale;
+
+	if (theRegion->low == theRegion->high)
+		return true;
+
+	if (!ReadEepromImage(picDevice))
+		return false;
+
+	scale = (GetWordWidth(picDevice) == 0xffff) ? 1 : 2;
+
+	for (i=0; i<GetDataSize(picDevice); i++)
+	{
+		if (!theRegion->present[i * scale])
+		{
+			ImageSetByte(image, IMAGE_DATA, i * scale, eepromData[i + 1]);
+
+			if (scale == 2)
+				ImageSetByte(image, IMAGE_DATA, i * scale + 1, 0);	// as a hex file has it
+		}
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------
+// on a device known to be blank, blank words in the file needn't be
+// written. Forget every row (GetWordAlign words) of program memory that
+// holds only blank words; the planner still fills gaps of up to
+// PLAN_MERGE_WORDS with them, so the writes are only split where that
+// costs less than sending the run.
+
+static void SkipBlankRows(const PIC_DEFINITION *picDevice, IMAGE *image)
+{
+	IMAGE_REGION			*theRegion = &image->region[IMAGE_PGM];
+	unsigned int			row, i, j, skipped;
+	unsigned short int	blank, fileWord;
+	bool						isBlank;
+
+	row = GetWordAlign(picDevice) * 2;
+
+	if (!row)
+		row = 2;
+
+	blank = GetWordWidth(picDevice);
+	skipped = 0;
+
+	for (i=theRegion->low / row * row; i<theRegion->high; i+=row)
+	{
+		if (!ImagePresent(image, IMAGE_PGM, i, row))
+			continue;
+
+		isBlank = true;
+
+		for (j=i; j<i+row && j+1<theRegion->size && isBlank; j+=2)
+		{
+			fileWord = theRegion->data[j] | (theRegion->data[j + 1] << 8);
+			isBlank = (fileWord & blank) == blank;
+		}
+
+		if (isBlank)
+		{
+			ImageForget(image, IMAGE_PGM, i, row);
+			skipped += row / 2;
+		}
+	}
+
+	if (comm_debug)
+		TracePrintf("\nPlan: device is blank, skipping %u blank words\n", skipped);
+}
+
+//--------------------------------------------------------------------
+// load a hex file into an image laid out in the regions of the passed
+// device. Addresses in the file are bytes, two per word, except for the
+// EEPROM of parts addressed in octets (18xxx), which has one per byte.
+// Returns false (with the image empty) if the file doesn't fit the device
+
+static bool LoadImage(const PIC_DEFINITION *picDevice, FILE *theFile, IMAGE *image)
+{
+	unsigned int	scale;
+	bool				ok;
+
+	scale = (GetWordWidth(picDevice) == 0xffff) ? 1 : 2;
+	ImageInit(image);
+
+	ok = ImageSetRegion(image, IMAGE_PGM, 0, GetPgmSize(picDevice) * 2, GetWordWidth(picDevice)) &&
+		ImageSetRegion(image, IMAGE_OSCCAL, GetOscCalStart(picDevice) * 2, GetOscCalSize(picDevice) * 2, GetWordWidth(picDevice)) &&
+		ImageSetRegion(image, IMAGE_ID, GetIDAddr(picDevice) * 2, GetIDSize(picDevice) * 2, 0xffff) &&
+		ImageSetRegion(image, IMAGE_DATA, GetEepromStart(picDevice) * scale, GetEepromStart(picDevice) ? GetDataSize(picDevice) * scale : 0, 0xffff) &&
+		ImageSetRegion(image, IMAGE_CFG, GetConfigStart(picDevice) * 2, GetConfigSize(picDevice) * 2, 0xffff) &&
+		ImageLoad(image, theFile);
+
+	if (!ok)
+		ImageFree(image);
+
+	return ok;
+}
+
+//--------------------------------------------------------------------
+// work out the writes that program an image into the passed device:
+// program memory, then osc cal, ID locations and EEPROM, and configuration
+// last since it may protect the rest. Program runs are only merged over a
+// gap (see PLAN_MERGE_WORDS) when the device is known to be blank, since
+// the gap is written blank and that would erase flash words the file
+// doesn't set. ID locations and EEPROM are written from their first byte,
+// as the programmer commands for them do; so is configuration, except on
+// 18xxx parts, which write each word at its own address and leave the
+// words the file doesn't set alone.
+//
+// For 18Fxxx devices (and possibly others), the Warp-13 resets it's program
+// counter to zero on receipt of a SetRange command regardless of the actual
+// address sent (QUIRK_SETRANGE_PC). Unless its firmware has been shown
+// to write where asked (see SetRangeAtZero), all program data must go as
+// one block from address zero, even if the hex file is not contiguous.
+
+static bool PlanImage(const PIC_DEFINITION *picDevice, const IMAGE *image, PLAN *plan)
+{
+	unsigned int	align;
+
+	align = GetWordAlign(picDevice) * 2;
+
+	return ImagePlan(image, IMAGE_PGM, align ? align : 2, pgmBlank ? PLAN_MERGE_WORDS * 2 : 0, SetRangeAtZero(picDevice, true), plan) &&
+		ImagePlan(image, IMAGE_OSCCAL, 2, 0, false, plan) &&
+		ImagePlan(image, IMAGE_ID, 2, 0, true, plan) &&
+		ImagePlan(image, IMAGE_DATA, 1, 0, true, plan) &&
+		ImagePlan(image, IMAGE_CFG, 2, 0, !is18device, plan);
+}
+
+//--------------------------------------------------------------------
+// carry out one write of a plan
+
+static bool WritePlanStep(const PIC_DEFINITION *picDevice, const IMAGE *image, const PLAN_STEP *step)
+{
+	const IMAGE_REGION	*theRegion = &image->region[step->region];
+	bool						fail;
+	unsigned char			*theBuffer, temp;
+	unsigned int			i, size;
+
+	size = theRegion->size - step->start;			// the writers may look past the step (to the end of the region)
+
+	if (!(theBuffer = (unsigned char *) malloc(size + 1)))
+	{
+		fprintf(stderr, "failed to malloc %d bytes\n", size + 1);
+		return false;
+	}
+
+	memcpy(theBuffer, &theRegion->data[step->start], size);
+
+	if (comm_debug)
+	{
+		TracePrintf("\nPlan: region %d, address 0x%x, %u bytes\n", step->region,
+			theRegion->base + step->start, step->size);
+	}
+
+	switch (step->region)
+	{
+		case IMAGE_PGM:
+		case IMAGE_OSCCAL:
+			fail = !WritePgmRange(picDevice, (theRegion->base + step->start) / 2, step->size / 2, theBuffer);
+			break;
+
+		case IMAGE_ID:
+			fail = !DoWriteIDLocs(picDevice, theBuffer, step->size);
+			break;
+
+		case IMAGE_DATA:
+			fail = !DoWriteEepromData(picDevice, theBuffer, step->start, step->size);
+			break;
+
+		case IMAGE_CFG:
+			for (i=0; i + 1 < size; i += 2)		// DoWriteConfigBits needs big endian, so swap bytes
+			{
+				temp = theBuffer[i];
+				theBuffer[i] = theBuffer[i + 1];
+				theBuffer[i + 1] = temp;
+			}
+
+			fail = !DoWriteConfigBits(picDevice, theBuffer, step->size, step->start);
+			break;
+
+		default:
+			fail = true;
+			break;
+	}
+
+	free(theBuffer);
+	return(!fail);
+}
+
+//--------------------------------------------------------------------
+// write the program space of the passed device (and whatever else the
+// hex file holds). The whole file is read first, so the writes depend
+// only on the data and not on how the file's records are laid out.
+// With differential set, only what differs from the device is written.
+// With mergeData set, EEPROM locations the file doesn't set keep their
+// contents. Blank words aren't written to a device known to be blank.
+
+static bool DoWritePgm(const PIC_DEFINITION *picDevice, FILE *theFile, bool differential, bool mergeData)
+{
+	bool				fail;
+	IMAGE				image;
+	PLAN				plan;
+	unsigned int	i;
+
+	fail = false;
+	memset(&plan, 0, sizeof(plan));
+
+	if (LoadImage(picDevice, theFile, &image))
+	{
+		if (pgmBlank)
+			SkipBlankRows(picDevice, &image);
+
+		if ((!mergeData || MergeEepromData(picDevice, &image)) &&
+			(!differential || DiffImage(picDevice, &image)) && PlanImage(picDevice, &image, &plan))
+		{
+			if (!suppressWrite)
+				pgmBlank = false;
+
+			if (comm_debug)
+				TracePrintf("\nPlan: %u bytes from the hex file in %u writes\n", image.bytes, plan.count);
+
+			InitHashMark(GetPgmSize(picDevice) * 2, hashWidth);	// go to too much effort to set the width
+
+			for (i=0; i<plan.count && !fail; i++)
+				fail = !WritePlanStep(picDevice, &image, &plan.step[i]);
+
+			UnInitHashMark();
+		}
+		else
+			fail = true;
+
+		PlanFree(&plan);
+		ImageFree(&image);
+	}
+	else
+		fail = true;
+
+	printf("Program write complete\n");
+	return(!fail);
+}
+
+//--------------------------------------------------------------------
+// report a word (or byte) of the device that doesn't match the file
+
+static void ReportVerify(const char *region, unsigned int address, unsigned int devValue, unsigned int fileValue)
+{
+	fprintf(stderr, "%s mismatch at 0x%04x: device 0x%04x, file 0x%04x\n", region, address, devValue, fileValue);
+}
+
+//--------------------------------------------------------------------
+// what verifying program memory needs to know as the chunks arrive
+
+typedef struct
+{
+	const IMAGE				*image;
+	unsigned short int	mask;			// bits the device implements
+	bool						all;			// report every mismatch
+	unsigned int			errors;		// mismatches found
+} VERIFY_STATE;
+
+//--------------------------------------------------------------------
+// compare a chunk of program memory with the image (a PGM_SINK).
+// Return false to stop at the first mismatch
+
+static bool VerifyPgmChunk(void *context, const unsigned char *theBytes, unsigned int address, unsigned int size)
+{
+	VERIFY_STATE			*state = (VERIFY_STATE *) context;
+	const IMAGE_REGION	*theRegion = &state->image->region[IMAGE_PGM];
+	unsigned int			i;
+	unsigned short int	fileWord, devWord;
+
+	for (i=0; i<size; i+=2, address+=2)
+	{
+		if (!theRegion->present[address] && !theRegion->present[address + 1])
+			continue;
+
+		fileWord = theRegion->data[address] | (theRegion->data[address + 1] << 8);
+		devWord = theBytes[i] | (theBytes[i + 1] << 8);
+
+		if ((fileWord ^ devWord) & state->mask)
+		{
+			ReportVerify("program memory", address / 2, devWord & state->mask, fileWord & state->mask);
+			state->errors++;
+
+			if (!state->all)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------
+// compare the device with the regions of an image selected by regions
+// (BLANK_PGM etc, reusing the blank check bits). Only what the file holds
+// is read back: program memory in runs (merged as for writing) that are
+// compared as they arrive (see StreamPgmRange). Unless all is set, stop at the first mismatch.
+// Return false if anything differs or can't be read
+
+static bool VerifyImage(const PIC_DEFINITION *picDevice, const IMAGE *image, unsigned char regions, bool all)
+{
+	const IMAGE_REGION	*theRegion;
+	PLAN						plan;
+	VERIFY_STATE			state;
+	unsigned char			idBuffer[32];
+	unsigned int			i, scale, errors;
+	unsigned short int	mask, fileWord, devWord;
+	bool						fail;
+
+	fail = false;
+	memset(&plan, 0, sizeof(plan));
+	state.image = image;
+	state.mask = GetWordWidth(picDevice);
+	state.all = all;
+	state.errors = 0;
+
+	if (regions & BLANK_PGM)
+	{
+		if (ImagePlan(image, IMAGE_PGM, 2, PLAN_MERGE_WORDS * 2, SetRangeAtZero(picDevice, false), &plan))
+		{
+			for (i=0; i<plan.count && !fail && (all || !state.errors); i++)
+				fail = !StreamPgmRange(picDevice, plan.step[i].start / 2, plan.step[i].size / 2, 0, VerifyPgmChunk, &state);
+		}
+		else
+			fail = true;
+
+		PlanFree(&plan);
+	}
+
+	errors = state.errors;
+
+	theRegion = &image->region[IMAGE_ID];
+
+	if ((regions & BLANK_ID) && theRegion->low < theRegion->high && !fail && (all || !errors))
+	{
+		if (theRegion->size + 2 <= sizeof(idBuffer) && ReadIDLocs(picDevice, idBuffer))
+		{
+			mask = (picDevice->def[PD_ID_MASKH] << 8) | picDevice->def[PD_ID_MASKL];
+
+			for (i=theRegion->low & ~1; i<theRegion->high && (all || !errors); i+=2)
+			{
+				fileWord = theRegion->data[i] | (theRegion->data[i + 1] << 8);
+				devWord = (idBuffer[i + 1] << 8) | idBuffer[i + 2];
+
+				if ((theRegion->present[i] || theRegion->present[i + 1]) && ((fileWord ^ devWord) & mask))
+				{
+					ReportVerify("ID locations", GetIDAddr(picDevice) + i / 2, devWord & mask, fileWord & mask);
+					errors++;
+				}
+			}
+		}
+		else
+			fail = true;
+	}
+
+	theRegion = &image->region[IMAGE_DATA];
+
+	if ((regions & BLANK_DATA) && theRegion->low < theRegion->high && !fail && (all || !errors))
+	{
+		if (ReadEepromImage(picDevice))
+		{
+			scale = (GetWordWidth(picDevice) == 0xffff) ? 1 : 2;
+
+			for (i=theRegion->low / scale; i * scale < theRegion->high && (all || !errors); i++)
+			{
+				if (theRegion->present[i * scale] && theRegion->data[i * scale] != eepromData[i + 1])
+				{
+					ReportVerify("EEPROM data", i, eepromData[i + 1], theRegion->data[i * scale]);
+					errors++;
+				}
+			}
+		}
+		else
+			fail = true;
+	}
+
+	theRegion = &image->region[IMAGE_CFG];
+
+	if ((regions & BLANK_CFG) && theRegion->low < theRegion->high && !fail && (all || !errors))
+	{
+		if (DoReadCfg(picDevice, false))
+		{
+			for (i=theRegion->low & ~1; i<theRegion->high && i/2 < 8 && (all || !errors); i+=2)
+			{
+				mask = (picDevice->defx[i] << 8) | picDevice->defx[i + 1];
+
+				if (i/2 < picDevice->fixedCfgBitsSize)
+					mask &= ~picDevice->fixedCfgBits[i/2];		// factory set, not from the file
+
+				fileWord = theRegion->data[i] | (theRegion->data[i + 1] << 8);
+
+				if ((theRegion->present[i] || theRegion->present[i + 1]) && ((fileWord ^ readConfigBits[i/2]) & mask))
+				{
+					ReportVerify("configuration bits", GetConfigStart(picDevice) + i / 2, readConfigBits[i/2] & mask, fileWord & mask);
+					errors++;
+				}
+			}
+		}
+		else
+			fail = true;
+	}
+
+	if (errors)
+	{
+		fprintf(stderr, "Verify failed%s\n", all ? "" : " (stopped at the first mismatch)");
+		fail = true;
+	}
+	else if (!fail)
+		printf("Verify complete\n");
 
-				for (i=0; i < startAddr % align; i++)
-					theBuffer[size++] = 0xff;
+	return(!fail);
+}
 
-				startAddr -= startAddr % align;
-			}
+//--------------------------------------------------------------------
+// The checksum MPLAB shows for a device: the 16 bit sum of every
+// program memory word (masked to the word width, blank where nothing is
+// programmed) and of every configuration word under its mask, leaving out
+// factory set bits. 18xxx parts are summed by bytes. The same sum is
+// worked out for a hex file and for what a device holds, so the two can
+// be compared at a glance. (MPLAB sums code protected parts differently.)
 
-			theBuffer[size++] = data;		// the first data byte of the new block
+// add a run of program memory (little endian words) to a checksum
 
-			while ((!(fileDone = !GetNextByte(theFile, &nextAddr, &data))))	// get next byte
-			{
-				if (size >= BUFFERSIZE)
-				{
-					fail = true;
-					break;
-				}
+static unsigned short int ChecksumPgm(const PIC_DEFINITION *picDevice, unsigned short int sum, const unsigned char *theBytes, unsigned int size)
+{
+	unsigned short int	mask;
+	unsigned int			i;
 
-				if (curAddr + 1 == nextAddr)	// use this byte now only if it's sequential
-				{
-					curAddr++;
-					theBuffer[size++] = data;
-				}
-				else
-					break;
-			}
+	mask = GetWordWidth(picDevice);
 
-			if (fail)
-				break;
+	for (i=0; i + 1 < size; i+=2)
+	{
+		if (mask == 0xffff)
+			sum += theBytes[i] + theBytes[i + 1];
+		else
+			sum += (theBytes[i] | (theBytes[i + 1] << 8)) & mask;
+	}
 
-			if (align && (startAddr < pgmsize) && (size % align)) // take care of unaligned/incomplete writes.
-			{
-				j = align - (size % align);
+	return sum;
+}
 
-				for (i=0; i<j; i++)
-					theBuffer[size++] = 0xff;
-			}
-			else if (!align && (size & 1))			// Don't allow odd sizes
-				theBuffer[size++] = 0xff;
+// add one configuration word (number index) to a checksum
 
-			if ((startAddr >= devCfgAddr) && ((startAddr + size) <= (devCfgAddr + cfgsize)))	// at config bits address?
-			{
-				if (size <= cfgsize)	// must not be greater than this
-				{										// inside configuration space, write as configuration
-					for (j=0; j<size; j += 2)	// DoWriteConfigBits needs big endian, so swap bytes
-					{
-						temp = theBuffer[j];
-						theBuffer[j] = theBuffer[j + 1];
-						theBuffer[j + 1] = temp;
-					}
+static unsigned short int ChecksumCfg(const PIC_DEFINITION *picDevice, unsigned short int sum, unsigned int index, unsigned short int cfgWord)
+{
+	unsigned short int	mask;
 
-					fail = !DoWriteConfigBits(picDevice, theBuffer, size, startAddr - devCfgAddr);
-				}
-				else
-				{
-					fprintf(stderr, "Configuration data not written: size is %u bytes (device's limit is %u)\n",
-						size, cfgsize);
-				}
+	mask = (picDevice->defx[index * 2] << 8) | picDevice->defx[index * 2 + 1];
 
-				size = 0;
-			}
-			else if (startAddr == devIDAddr)
-			{
-				if (size <= idsize)
-				{
-					fail = !DoWriteIDLocs(picDevice, theBuffer, size);
-				}
-				else
-				{
-					fprintf(stderr,
-						"ID locations not written: size is %u bytes (device's limit is %u)\n",
-						size, idsize);
-				}
+	if (index < picDevice->fixedCfgBitsSize)
+		mask &= ~picDevice->fixedCfgBits[index];		// factory set, not part of the program
 
-				size = 0;
-			}
-			else if (devDataAddr && (startAddr >= devDataAddr) && (startAddr < (devDataAddr + datasize)))
-			{
-				if ((startAddr + size) <= (devDataAddr + datasize))
-				{
-					fail = !DoWriteEepromData(picDevice, theBuffer, startAddr - devDataAddr, size);
-				}
-				else
-				{
-					fprintf(stderr,
-						"EEPROM data not written: size is %u bytes (device's limit is %u)\n",
-						size, datasize);
-				}
+	cfgWord &= mask;
 
-				size = 0;
-			}
-			else if ((startAddr + size) > pgmsize)
-			{
-				fprintf(stderr,
-					"Invalid range in hex file: 0x%x - 0x%x, max 0x%x\n",
-					startAddr, startAddr + size, pgmsize);
-				fail = true;
-			}
-		}
+	if (GetWordWidth(picDevice) == 0xffff)
+		return sum + (cfgWord >> 8) + (cfgWord & 0xff);
 
-		if (size && !fail)
-		{
-// Will only get here if program data was read from file with no config, device ID, or eeprom data in hex file
-			fail = !WritePgmRange(picDevice, 0, size / 2, theBuffer);
-		}
+	return sum + cfgWord;
+}
 
-		UnInitHashMark();
-		free(theBuffer);
+// checksum of a hex file loaded into an image
+
+static unsigned short int ImageChecksum(const PIC_DEFINITION *picDevice, const IMAGE *image)
+{
+	const IMAGE_REGION	*theRegion;
+	unsigned short int	sum;
+	unsigned int			i;
+
+	theRegion = &image->region[IMAGE_PGM];
+	sum = ChecksumPgm(picDevice, 0, theRegion->data, theRegion->size);
+
+	theRegion = &image->region[IMAGE_CFG];
+
+	for (i=0; i + 1 < theRegion->size && i / 2 < 8; i+=2)
+		sum = ChecksumCfg(picDevice, sum, i / 2, theRegion->data[i] | (theRegion->data[i + 1] << 8));
+
+	return sum;
+}
+
+// add a chunk of program memory to a checksum as it is read (a PGM_SINK)
+
+typedef struct
+{
+	const PIC_DEFINITION	*picDevice;
+	unsigned short int	sum;
+} CHECKSUM_STATE;
+
+static bool ChecksumChunk(void *context, const unsigned char *theBytes, unsigned int address, unsigned int size)
+{
+	CHECKSUM_STATE	*state = (CHECKSUM_STATE *) context;
+
+	state->sum = ChecksumPgm(state->picDevice, state->sum, theBytes, size);
+	return true;
+}
+
+// checksum of what the device holds, summed as program memory arrives.
+// Return false if it can't be read
+
+static bool DeviceChecksum(const PIC_DEFINITION *picDevice, unsigned short int *sum)
+{
+	CHECKSUM_STATE	state;
+	unsigned int	i;
+
+	state.picDevice = picDevice;
+	state.sum = 0;
+
+	if (!StreamPgmRange(picDevice, 0, GetPgmSize(picDevice), 0, ChecksumChunk, &state) || !DoReadCfg(picDevice, false))
+		return false;
+
+	for (i=0; i<GetConfigSize(picDevice) && i < 8; i++)
+		state.sum = ChecksumCfg(picDevice, state.sum, i, readConfigBits[i]);
+
+	*sum = state.sum;
+	return true;
+}
+
+// -rk: show the device's checksum
+
+static bool DoReadChecksum(const PIC_DEFINITION *picDevice)
+{
+	unsigned short int	sum;
+
+	if (!DeviceChecksum(picDevice, &sum))
+	{
+		fprintf(stderr, "failed to read the device for its checksum\n");
+		return false;
 	}
+
+	if (verboseOutput)
+		fprintf(stdout, "Checksum 0x%04x\n", sum);
 	else
+		fprintf(stdout, "0x%04x\n", sum);						// quiet mode just shows the value
+
+	return true;
+}
+
+//--------------------------------------------------------------------
+// verify the passed device against a hex file, region by region and/or
+// (with checksum) by comparing the device's checksum with the file's
+
+static bool DoVerify(const PIC_DEFINITION *picDevice, FILE *theFile, unsigned char regions, bool all, bool checksum)
+{
+	bool				fail;
+	IMAGE				image;
+	unsigned short int	fileSum, devSum;
+
+	if (!LoadImage(picDevice, theFile, &image))
+		return false;
+
+	fail = regions && !VerifyImage(picDevice, &image, regions, all);
+
+	if (checksum && !fail)
 	{
-		fprintf(stderr, "failed to malloc %d bytes\n", BUFFERSIZE);
-		fail = true;
+		fileSum = ImageChecksum(picDevice, &image);
+
+		if (!DeviceChecksum(picDevice, &devSum))
+			fail = true;
+		else if (!verboseOutput)
+			fprintf(stdout, "0x%04x 0x%04x\n", devSum, fileSum);		// quiet mode just shows the two
+		else if (devSum == fileSum)
+			fprintf(stdout, "Checksum 0x%04x matches\n", devSum);
+		else
+			fprintf(stdout, "Checksum mismatch: device 0x%04x, file 0x%04x\n", devSum, fileSum);
+
+		fail = fail || devSum != fileSum;
 	}
 
-	printf("Program write complete\n");
+	ImageFree(&image);
 	return(!fail);
 }
 
 //--------------------------------------------------------------------
-// write the program space of the passed device
-
-static bool DoWritePgm(const PIC_DEFINITION *picDevice, FILE *theFile)
+// -ee: erase only if the device isn't already blank where a hex file
+// (or without one, anywhere) is about to be written. A single blank
+// check covers every region; only the bits for the regions the file
+// touches count. Only the regions that aren't blank are erased: program
+// memory the quickest way (see DoEraseAuto) that keeps the regions the
+// file doesn't touch, EEPROM, ID locations and configuration by their own
+// erase commands unless that already cleared them. When every region
+// needs erasing, one bulk erase does it all.
+
+static bool DoEraseIfDirty(const PIC_DEFINITION *picDevice, FILE *theFile)
 {
-	bool				fail, fileDone;
-	unsigned char	*theBuffer;
-	unsigned int	i, j, startAddr, curAddr, nextAddr, size, align, pgmsize, datasize, idsize, cfgsize;
-	unsigned char	data, temp;
-	unsigned int	devCfgAddr, devIDAddr, devDataAddr;
-
-	if (is18device && isWarp13)			// Warp-13 SetRange broken for 18F devices
-		return DoWritePgm18(picDevice, theFile);	// so must send all program data as one block
+	static const unsigned char	regionBlank[IMAGE_REGIONS] = {BLANK_PGM, 0, BLANK_ID, BLANK_DATA, BLANK_CFG};	// by IMAGE_xxx
+	unsigned char	regions, status, all, erased;
+	IMAGE				image;
+	int				i;
+	bool				fail;
 
-	fail = fileDone = false;
-	align = GetWordAlign(picDevice) * 2;
-	pgmsize = GetPgmSize(picDevice) * 2;
+	all = BLANK_PGM | BLANK_CFG | BLANK_ID | (GetDataSize(picDevice) ? BLANK_DATA : 0);
+	regions = all;
 
-	if ((theBuffer = (unsigned char *) malloc(BUFFERSIZE)))
+	if (theFile)
 	{
-		InitHashMark(pgmsize, hashWidth);	// go to too much effort to set the width
-		InitParse();								// get ready to start reading the hex file
-		fileDone = !GetNextByte(theFile, &nextAddr, &data);	// get a byte and the initial address
-		devCfgAddr = GetConfigStart(picDevice) * 2;	// address of device's config memory
-		devIDAddr  = GetIDAddr(picDevice) * 2;		// address of id locations.
-		devDataAddr = GetEepromStart(picDevice) * 2;	// address of eeprom data
-		datasize = GetDataSize(picDevice) * 2;
-		idsize = GetIDSize(picDevice) * 2;
-		cfgsize = GetConfigSize(picDevice) * 2;
+		if (!LoadImage(picDevice, theFile, &image))
+			return false;
 
-//printf("\n\nConfig adrs 0x%x, size %d\n", devCfgAddr, cfgsize);
-//printf("ID adrs 0x%x, size %d\n", devIDAddr, idsize);
-//printf("EEPROM adrs 0x%x, size %d\n\n", devDataAddr, datasize);
+		regions = 0;
 
-		while (!fileDone && !fail)
+		for (i=0; i<IMAGE_REGIONS; i++)
 		{
-			startAddr = nextAddr;	// the first address of the new block
-			curAddr = startAddr;
-			size = 0;					// number of bytes waiting to be sent
+			if (image.region[i].low < image.region[i].high)
+				regions |= regionBlank[i];
+		}
 
-			if (align && (startAddr % align) && (startAddr < pgmsize)) // assuming program addr starts at zero.
-			{
-				if (startAddr < align)
-				{
-					fprintf(stderr, "Error: Wrong addressing "
-						"on hex file (unaligned address "
-						"at position 0x%X). Wrong processor type?\n",
-						 startAddr);
-						 fail = true;
-						 break;
-				}
+		ImageFree(&image);
+	}
 
-				for (i=0; i < startAddr % align; i++)
-					theBuffer[size++] = 0xff;
+	if (!regions)
+		return true;								// nothing to be written
 
-				startAddr -= startAddr % align;
-			}
+	if (!BlankStatus(&status))
+		return false;
 
-			theBuffer[size++] = data;		// the first data byte of the new block
+	status &= regions;
 
-			while ((!(fileDone = !GetNextByte(theFile, &nextAddr, &data))))	// get next byte
-			{
-				if (size >= BUFFERSIZE)
-				{
-					fail = true;
-					break;
-				}
+	if (!status)
+	{
+		if (regions & BLANK_PGM)
+			pgmBlank = true;						// writes can skip blank words from now on
 
-				if ((curAddr + 1) == nextAddr)	// use this byte now only if it's sequential
-				{
-					curAddr++;
-					theBuffer[size++] = data;
-				}
-				else
-					break;				// non-sequential, write this buffer then start another
-			}
+		if (verboseOutput)
+			fprintf(stdout, "Device is blank, erase skipped\n");
 
-			if (fail)
-				break;
+		return true;
+	}
 
-			if (align && (startAddr < pgmsize) && (size % align)) // take care of unaligned/incomplete writes.
-			{
-				j = align - (size % align);
+	if (comm_debug)
+		TracePrintf("\nErase if dirty: regions 0x%02x, not blank 0x%02x", regions, status);
 
-				for (i=0; i<j; i++)
-					theBuffer[size++] = 0xff;
-			}
-			else if (!align && (size & 1))			// Don't allow odd sizes
-				theBuffer[size++] = 0xff;
+	if (!IsFlashDevice(picDevice))
+	{
+		fprintf(stderr, "Device %s isn't blank and can't be erased electrically\n", picName);
+		return false;
+	}
 
-			if (startAddr == devCfgAddr)			// at config bits address?
-			{
-				if (size <= cfgsize)	// must not be greater than this
-				{										// inside configuration space, write as configuration
-					for (j=0; j<size; j += 2)	// DoWriteConfigBits needs big endian, so swap bytes
-					{
-						temp = theBuffer[j];
-						theBuffer[j] = theBuffer[j + 1];
-						theBuffer[j + 1] = temp;
-					}
+	if (status == all)
+		return DoEraseFlash(picDevice);
 
-					fail = !DoWriteConfigBits(picDevice, theBuffer, size, startAddr - devCfgAddr);
-				}
-				else
-				{
-					fprintf(stderr, "Configuration data not written: size is %u bytes (device's limit is %u)\n",
-						size, cfgsize);
-				}
-			}
-			else if (startAddr == devIDAddr)
-			{
-				if (size <= idsize)
-				{
-					fail = !DoWriteIDLocs(picDevice, theBuffer, size);
-				}
-				else
-				{
-					fprintf(stderr,
-						"ID locations not written: size is %u bytes (device's limit is %u)\n",
-						size, idsize);
-				}
-			}
-			else if (devDataAddr && (startAddr >= devDataAddr) && (startAddr < (devDataAddr + datasize)))
-			{
-				if ((startAddr + size) <= (devDataAddr + datasize))
-				{
-					fail = !DoWriteEepromData(picDevice, theBuffer, startAddr - devDataAddr, size);
-				}
-				else
-				{
-					fprintf(stderr,
-						"EEPROM data not written: size is %u bytes (device's limit is %u)\n",
-						size, datasize);
-				}
-			}
-			else if ((startAddr + size) > pgmsize)
-			{
-				fprintf(stderr,
-					"Invalid range in hex file: 0x%x - 0x%x, max 0x%x\n",
-					startAddr, startAddr + size, pgmsize);
-				fail = true;
-			}
-			else
-			{			// if not any of the above, try to write where ever it lands
-				fail = !WritePgmRange(picDevice, startAddr / 2, size / 2, theBuffer);
-			}
-		}
+	fail = false;
 
-		UnInitHashMark();
-		free(theBuffer);
-	}
-	else
+	if (status & BLANK_PGM)
 	{
-		fprintf(stderr, "failed to malloc %d bytes\n", BUFFERSIZE);
-		fail = true;
+		fail = !DoEraseAuto(picDevice, all & ~regions, &erased);
+		status &= ~erased;
 	}
 
-	printf("Program write complete\n");
+	if ((status & BLANK_DATA) && !fail)
+		fail = !DoEraseData(picDevice, false);
+
+	if ((status & BLANK_ID) && !fail)
+		fail = !DoEraseIDLocs(picDevice);
+
+	if ((status & BLANK_CFG) && !fail)
+		fail = !DoEraseConfigBits(picDevice);
+
 	return(!fail);
 }
 
 //--------------------------------------------------------------------
-// Read the program space of the passed device
+// a read of program memory going out as hex records
 
-static bool DoReadPgm(const PIC_DEFINITION *picDevice, FILE *theFile)
+typedef struct
+{
+	HEX_OUT				hexOut;
+	unsigned short int	blankData;		// lines of only this aren't written
+} READ_HEX;
+
+//--------------------------------------------------------------------
+// write a chunk of program memory as hex records (a PGM_SINK)
+
+static bool ReadHexChunk(void *context, const unsigned char *theBytes, unsigned int address, unsigned int size)
+{
+	READ_HEX	*readHex = (READ_HEX *) context;
+
+	HexOutWrite(&readHex->hexOut, theBytes, address, size, readHex->blankData);
+	return true;
+}
+
+//--------------------------------------------------------------------
+// Read the program space of the passed device, length words from word
+// address start (0 = to the end). Only the range is transferred, except
+// on programmers that start every read at zero (QUIRK_SETRANGE_PC), where
+// everything before it has to be read and dropped. The hex records are
+// written as the words arrive.
+
+static bool DoReadPgm(const PIC_DEFINITION *picDevice, FILE *theFile, unsigned int start, unsigned int length)
 {
 	bool				fail;
-	unsigned char	temp, *theBuffer;
-	unsigned int	size;						// size of the device's program memory (in bytes)
-	unsigned int	idx;
+	unsigned int	skip;						// words read ahead of the range
 	unsigned short int	blankData;
+	READ_HEX			readHex;
+
+	if (start < GetPgmSize(picDevice) && !length)
+		length = GetPgmSize(picDevice) - start;
+
+	if (start > GetPgmSize(picDevice) || length > GetPgmSize(picDevice) - start)
+	{
+		fprintf(stderr, "Range 0x%x:0x%x is outside program memory (0x%x words)\n", start, length, GetPgmSize(picDevice));
+		return false;
+	}
 
 	fail = false;
-	size = GetPgmSize(picDevice) * 2;
+	skip = SetRangeAtZero(picDevice, false) ? start : 0;
 	blankData = (picDevice->def[PD_PGM_WIDTHH] << 8) | (picDevice->def[PD_PGM_WIDTHL] & 0xff);
 
 	if (DoReadCfg(picDevice, false))
@@ -2493,49 +4602,12 @@ static bool DoReadPgm(const PIC_DEFINITION *picDevice, FILE *theFile)
 		if (~readConfigBits[0] & picDevice->cpbits)
 			fprintf(stderr, "Warning: device is code protected: configuration bits = 0x%04x\n", readConfigBits[0]);
 
-		if (SetRange(picDevice, 0, size / 2))	// size in words
-		{
-					// get a buffer this big plus one char for the command and a 0 at the end
-			if ((theBuffer = (unsigned char *) malloc(size + 2)))
-			{
-				theBuffer[0] = CMD_READ_PGM;
-
-				if (comm_debug)
-				{
-					fprintf(comm_debug, "\nRead Program");
-					comm_debug_count = 0;
-					sendCommand = true;
-				}
-
-							// ask it to fill the buffer (plus the command plus a terminating zero)
-				if (SendMsg(theBuffer, 1, theBuffer, size + 2))
-				{
-					// DEBUG shouldn't need to swap byte order here but we do
-
-					for (idx=1; idx < size + 1; idx += 2)
-					{
-						temp = theBuffer[idx + 1];
-						theBuffer[idx + 1] = theBuffer[idx];	// swap byte order (make it little endian)
-						theBuffer[idx] = temp;
-					}
-
-					WriteHexRecord(theFile, &theBuffer[1], 0, size, blankData);	// write hex records to selected stream
-				}
-				else
-				{
-					fprintf(stderr, "failed to send read program command\n");
-					fail = true;
-				}
+		readHex.blankData = blankData;
+		HexOutStart(&readHex.hexOut, theFile);
 
-				free(theBuffer);
-			}
-			else
-			{
-				fprintf(stderr, "failed to allocate buffer\n");
-				fail = true;				// failed to malloc
-			}
-		}
-		else		// set range failed
+		if (StreamPgmRange(picDevice, start - skip, length + skip, skip, ReadHexChunk, &readHex))
+			HexOutEnd(&readHex.hexOut);		// write hex records to selected stream as the words arrive
+		else
 			fail = true;
 	}
 	else
@@ -2552,7 +4624,6 @@ static bool DoReadPgm(const PIC_DEFINITION *picDevice, FILE *theFile)
 
 static bool DoReadID(const PIC_DEFINITION *picDevice)
 {
-	bool				fail;
 	unsigned int	i, size;
 	unsigned char	theBuffer[32];
 
@@ -2564,41 +4635,17 @@ static bool DoReadID(const PIC_DEFINITION *picDevice)
 		return false;
 	}
 
-	fail = false;
-	theBuffer[0] = CMD_READ_ID;
-
-	if (comm_debug)
-	{
-		fprintf(comm_debug, "\nRead ID Locations");
-		comm_debug_count = 0;
-		sendCommand = true;
-	}
-
-	if (SendMsg(theBuffer, 1, theBuffer, size + 2))
-	{
-		if ((theBuffer[0] == CMD_READ_ID) && (theBuffer[size + 1] == 0))
-		{
-			if (verboseOutput)
-				fprintf(stdout, "ID locations: ");	// if in quiet mode, only the values will be returned
+	if (!ReadIDLocs(picDevice, theBuffer))
+		return false;
 
-			for (i=0; i<size; i+= 2)
-				fprintf(stdout, "0x%02x%02x ", theBuffer[i + 1], theBuffer[i + 2]);
+	if (verboseOutput)
+		fprintf(stdout, "ID locations: ");	// if in quiet mode, only the values will be returned
 
-			fprintf(stdout, "\n");
-		}
-		else
-		{
-			fprintf(stderr, "failed to read ID locations\n");
-			fail = true;
-		}
-	}
-	else
-	{
-		fprintf(stderr, "failed to send read ID command\n");
-		fail = true;
-	}
+	for (i=0; i<size; i+= 2)
+		fprintf(stdout, "0x%02x%02x ", theBuffer[i + 1], theBuffer[i + 2]);
 
-	return(!fail);
+	fprintf(stdout, "\n");
+	return true;
 }
 
 //--------------------------------------------------------------------
@@ -2616,10 +4663,7 @@ static bool DoInitPIC(const PIC_DEFINITION *picDevice)
 	theBuffer[0] = CMD_LOAD_INFO;
 
 	if (comm_debug)
-	{
-		fprintf(comm_debug, "\nLoad Processor Info");
-		comm_debug_count = 0;
-	}
+		TracePrintf("\nLoad Processor Info");
 
 		// send load processor info command, wait for command to echo back
 	if (SendMsg(theBuffer, 1, theBuffer, 1))
@@ -2641,10 +4685,7 @@ static bool DoInitPIC(const PIC_DEFINITION *picDevice)
 					theBuffer[0] = CMD_LOAD_EXT_INFO;
 
 					if (comm_debug)
-					{
-						fprintf(comm_debug, "\nLoad Extended Configuration");
-						comm_debug_count = 0;
-					}
+						TracePrintf("\nLoad Extended Configuration");
 
 						// send load extended processor info command, wait for command to echo back
 					if (SendMsg(theBuffer, 1, theBuffer, 1))
@@ -2667,10 +4708,7 @@ static bool DoInitPIC(const PIC_DEFINITION *picDevice)
 									theBuffer[0] = CMD_LOAD_EXT_INFO;
 
 									if (comm_debug)
-									{
-										fprintf(comm_debug, "\nLoad Extended Configuration - old firmware");
-										comm_debug_count = 0;
-									}
+										TracePrintf("\nLoad Extended Configuration - old firmware");
 
 						  				// send load extended processor info command, wait for command to echo back
 									if (SendMsg(theBuffer, 1, theBuffer, 1))
@@ -2761,7 +4799,34 @@ static char *GetNextFlag(int *argc, char **argv[])
 		return(*(*argv - 1));			// but return pointer to this one
 	}
 
-	return(NULL);
+	return(NULL);
+}
+
+//--------------------------------------------------------------------
+// if the next argument is an address range (start:length), read it and
+// move past it. Both are numbers as atoi_base reads them. Without a
+// range, start and length are left at 0 (everything).
+// Return false if it looks like a range but isn't one
+
+static bool GetRangeFlag(int *argc, char **argv[], unsigned int *start, unsigned int *length)
+{
+	char	*range, *colon;
+	bool	ok;
+
+	*start = *length = 0;
+
+	if (!*argc || !isdigit((unsigned char) ***argv) || !(colon = strchr(**argv, ':')))
+		return true;									// not a range (C:\out.hex is a file name)
+
+	range = GetNextFlag(argc, argv);
+	*colon = '\0';
+	ok = atoi_base(range, start) && atoi_base(colon + 1, length) && *length;
+	*colon = ':';
+
+	if (!ok)
+		fprintf(stderr, "Unable to interpret '%s' as an address range (start:length)\n", range);
+
+	return ok;
 }
 
 //--------------------------------------------------------------------
@@ -2769,12 +4834,12 @@ static char *GetNextFlag(int *argc, char **argv[])
 
 static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, char *flags)
 {
-	bool				fail = false;
+	bool				fail = false, differential = false, mergeData = false, allMismatches = false, checksum = false;
 	char				*fileName = (char *) 0;
 	FILE				*theFile = stdout;
 	unsigned char	blankMode, *cbfr;
 	unsigned int	i, count, count2, *ibfr, iddata;
-	unsigned int	oscCalBits;
+	unsigned int	oscCalBits, rangeStart, rangeLength;
 
 	switch (*flags)
 	{
@@ -2828,7 +4893,7 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 					switch (*flags)
 					{
 						case 'p':
-							fail = !DoErasePgm(picDevice, true);
+							fail = !DoErasePgm(picDevice, true, false);
 							break;
 
 						case 'c':
@@ -2852,13 +4917,40 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 							fail = !DoEraseFlash(picDevice);
 							break;
 
+						case 'a':
+							fail = !DoEraseAuto(picDevice, BLANK_DATA | BLANK_ID | BLANK_CFG, NULL);
+							break;
+
+						case 'e':
+							if ((fileName = GetNextFlag(argc, argv)))
+							{
+								if ((theFile = fopen(fileName, "r")))
+								{
+									fail = !DoEraseIfDirty(picDevice, theFile);
+									fclose(theFile);
+								}
+								else
+								{
+									fprintf(stderr, "unable to open input file: '%s'\n", fileName);
+									fail = true;
+								}
+							}
+							else
+								fail = !DoEraseIfDirty(picDevice, NULL);	// no file, so check everything
+							break;
+
 					}
 
 					flags++;
 				}
 			}
+			else if (*argc && !strcmp(**argv, "auto"))
+			{
+				GetNextFlag(argc, argv);
+				fail = !DoEraseAuto(picDevice, BLANK_DATA | BLANK_ID | BLANK_CFG, NULL);
+			}
 			else
-				fprintf(stderr, "specify one or more regions to erase (p|c|i|d|o)\n");
+				fprintf(stderr, "specify one or more regions to erase (p|c|i|d|o|f|a|e), or auto\n");
 			break;
 
 		case 'r':								// read
@@ -2871,6 +4963,12 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 					switch (*flags)
 					{
 						case 'p':
+							if (!GetRangeFlag(argc, argv, &rangeStart, &rangeLength))
+							{
+								fail = true;
+								break;
+							}
+
 							if ((fileName = GetNextFlag(argc, argv)))
 								theFile = fopen(fileName, "w");
 							else
@@ -2878,7 +4976,7 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 
 							if (theFile)
 							{
-								fail = !DoReadPgm(picDevice, theFile);		// read program data, write to stream
+								fail = !DoReadPgm(picDevice, theFile, rangeStart, rangeLength);		// read program data, write to stream
 
 								if (theFile != stdout)		// if we wrote it to a file,
 									fclose(theFile);			// close the file
@@ -2896,7 +4994,17 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 							fail = !DoReadID(picDevice);	// read ID locations
 							break;
 
+						case 'k':
+							fail = !DoReadChecksum(picDevice);	// read everything, show the checksum
+							break;
+
 						case 'd':
+							if (!GetRangeFlag(argc, argv, &rangeStart, &rangeLength))
+							{
+								fail = true;
+								break;
+							}
+
 							if ((fileName = GetNextFlag(argc, argv)))
 								theFile = fopen(fileName, "w");
 							else
@@ -2904,7 +5012,7 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 
 							if (theFile)
 							{
-								fail = !DoReadData(picDevice, theFile);	// read data memory
+								fail = !DoReadData(picDevice, theFile, rangeStart, rangeLength);	// read data memory
 
 								if (theFile != stdout)		// if we wrote it to a file,
 									fclose(theFile);			// close the file
@@ -2923,7 +5031,7 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 				}
 			}
 			else
-				fprintf(stderr, "specify one or more regions to read (p|c|i|d|o)\n");
+				fprintf(stderr, "specify one or more regions to read (p|c|i|d|o|k)\n");
 
 			break;
 
@@ -2937,12 +5045,34 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 					case 'p':
 						flags++;
 
-						if (*flags && (toupper(*flags) == 'X'))
+						for (; *flags && !fail; flags++)
 						{
-							suppressWrite = true;
-							ignoreVerfErr = true;
+							switch (toupper(*flags))
+							{
+								case 'X':
+									suppressWrite = true;
+									ignoreVerfErr = true;
+									break;
+
+								case 'D':
+									if (!IsFlashDevice(picDevice))
+									{
+										fprintf(stderr, "Differential write (-wpd) is only for flash devices.\n");
+										fail = true;
+									}
+
+									differential = true;
+									break;
+
+								case 'M':
+									mergeData = true;		// keep the EEPROM bytes the file doesn't set
+									break;
+							}
 						}
 
+						if (fail)
+							break;
+
 						if ((fileName = GetNextFlag(argc, argv)))
 							theFile = fopen(fileName, "r");
 						else
@@ -2950,7 +5080,7 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 
 						if (theFile)
 						{
-							fail = !DoWritePgm(picDevice, theFile);
+							fail = !DoWritePgm(picDevice, theFile, differential, mergeData);
 
 							if (theFile != stdin)					// if we read it from a file,
 								fclose(theFile);						// close the file
@@ -3074,6 +5204,8 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 						break;
 
 					case 'd':
+						flags++;
+
 						if ((fileName = GetNextFlag(argc, argv)))
 							theFile = fopen(fileName, "r");
 						else
@@ -3081,7 +5213,7 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 
 						if (theFile)
 						{
-							fail = !DoWriteData(picDevice, theFile);
+							fail = !DoWriteData(picDevice, theFile, *flags && (toupper(*flags) == 'M'));
 
 							if (theFile != stdin)					// if we read it from a file,
 								fclose(theFile);						// close the file
@@ -3124,9 +5256,70 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 
 			break;
 
-		case 'v':	// [TODO]				// verify
-			fprintf(stderr, "verify is not implemented yet\n");
-			// DEBUG verify device goes here
+		case 'v':								// verify
+			flags++;
+			blankMode = 0;						// regions to verify (BLANK_xxx)
+
+			while (*flags)
+			{
+				switch (*flags)
+				{
+					case 'p':
+						blankMode |= BLANK_PGM;
+						break;
+
+					case 'c':
+						blankMode |= BLANK_CFG;
+						break;
+
+					case 'i':
+						blankMode |= BLANK_ID;
+						break;
+
+					case 'd':
+						blankMode |= BLANK_DATA;
+						break;
+
+					case 'a':
+						allMismatches = true;		// report all mismatches, don't stop at the first
+						break;
+
+					case 'k':
+						checksum = true;				// compare checksums
+						break;
+
+					default:
+						break;				// ignore undefined flags
+				}
+
+				flags++;
+			}
+
+			if (!blankMode && !checksum)
+			{
+				fprintf(stderr, "specify one or more regions to verify (p|c|i|d), or k\n");
+				fail = true;
+				break;
+			}
+
+			if ((fileName = GetNextFlag(argc, argv)))
+				theFile = fopen(fileName, "r");
+			else
+				theFile = stdin;
+
+			if (theFile)
+			{
+				fail = !DoVerify(picDevice, theFile, blankMode, allMismatches, checksum);
+
+				if (theFile != stdin)					// if we read it from a file,
+					fclose(theFile);						// close the file
+			}
+			else
+			{
+				fprintf(stderr, "unable to open input file: '%s'\n", fileName);
+				fail = true;
+			}
+
 			break;
 
 		default:
@@ -3137,51 +5330,352 @@ static bool DoTasks(int *argc, char **argv[], const PIC_DEFINITION *picDevice, c
 }
 
 //--------------------------------------------------------------------
-// Initialize the serial port
-// Once the device is opened and locked, this sets up the port, and makes sure the handshake looks good.
+// reset the programmer and wait for it to raise CTS, then turn on flow control
+// return true if the programmer came back
 
-static bool InitDevice(int serialDevice, unsigned int baudRate, unsigned char dataBits, unsigned char stopBits, unsigned char parity)
+static bool ResetProgrammer()
 {
-	bool						fail;						// haven't failed (yet)
-	bool						CTS, DCD;
-	unsigned short int	ctsTimeOut;
+	bool						fail;
+
+	resetSeen = false;
+
+	if (IsRemote(serialDevice))					// the agent watches CTS
+		return RemoteReset();
 
 	fail = false;
 
-	if (ConfigureDevice(serialDevice, baudRate, dataBits, stopBits, parity, false))	// set up the device
+	if (ConfigureFlowControl(serialDevice, false))	// no flow control at the moment (raise RTS)
 	{
-		if (ConfigureFlowControl(serialDevice, false))	// no flow control at the moment (raise RTS)
+		ResetPICSTART();
+
+		if (!WaitForCTS(serialDevice, CTS_TIMEOUT))	// looks every millisecond
 		{
-			ResetPICSTART();
-			ctsTimeOut = 100;							// allow about 100 ms (0.1 sec) for CTS to show up
+			fprintf(stderr, "programmer not detected (CTS is false)\n");
+			fail = true;							// didn't see CTS, assume device is not present or not ready, fail
+		}
+		else
+			ConfigureFlowControl(serialDevice, true);	// looks ok to use flow control, so allow it
 
-			do
-			{
-				GetDeviceStatus(serialDevice, &CTS, &DCD);	// see if CTS is true
+		FlushBytes(serialDevice);						// get rid of any pending data
+	}
+	else
+	{
+		fprintf(stderr, "could not configure flow control\n");
+		fail = true;
+	}
+
+	return(!fail);
+}
+
+//--------------------------------------------------------------------
+// find the last line of a file of things learned (kept in the home
+// directory) whose first word is key. Return false if there isn't one
+
+static bool LoadLearned(const char *file, const char *key, char *line, int size)
+{
+	FILE		*theFile;
+	char		path[256], fileLine[256], fileKey[200];
+	char		*home;
+	bool		found;
+
+	found = false;
 
-				if (CTS)
-					break;								// break out if it is
+	if ((home = getenv("HOME")))
+	{
+		snprintf(path, sizeof(path), "%s/%s", home, file);
 
-				usleep(1000);							// wait 1 ms (more or less), try again
+		if ((theFile = fopen(path, "r")))
+		{
+			while (fgets(fileLine, sizeof(fileLine), theFile))
+			{
+				if (sscanf(fileLine, "%199s", fileKey) == 1 && !strcmp(fileKey, key))
+				{
+					snprintf(line, size, "%s", fileLine);
+					found = true;
+				}
 			}
-			while (ctsTimeOut--);
 
-			if (!CTS)
+			fclose(theFile);
+		}
+	}
+
+	return found;
+}
+
+//--------------------------------------------------------------------
+// another picp may be saving to the same file: hold its lock file while
+// entries are read and replaced, so neither loses the other's update.
+// Return what UnlockLearned needs
+
+static int LockLearned(const char *file)
+{
+	int	lock;
+#ifndef WIN32
+	char	path[256];
+	char	*home;
+
+	lock = -1;
+
+	if ((home = getenv("HOME")))
+	{
+		snprintf(path, sizeof(path), "%s/%s.lock", home, file);
+
+		if ((lock = open(path, O_RDWR | O_CREAT, 0644)) != -1)
+			flock(lock, LOCK_EX);
+	}
+#else
+	lock = -1;
+#endif
+
+	return lock;
+}
+
+static void UnlockLearned(int lock)
+{
+#ifndef WIN32
+	if (lock != -1)
+		close(lock);								// releases the lock
+#endif
+}
+
+//--------------------------------------------------------------------
+// replace the line for key in a file of things learned with line (which
+// must start with key and end with a newline). The caller holds the lock
+
+static void SaveLearned(const char *file, const char *key, const char *line)
+{
+	FILE				*theFile;
+	char				path[256], temp[280], fileLine[256], fileKey[200];
+	char				*home, *others, *more;
+	size_t			size, used;
+	bool				written;
+
+	if (!(home = getenv("HOME")))
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", home, file);
+	others = NULL;
+	size = used = 0;
+
+	if ((theFile = fopen(path, "r")))				// keep the other entries
+	{
+		while (fgets(fileLine, sizeof(fileLine), theFile))
+		{
+			if (sscanf(fileLine, "%199s", fileKey) == 1 && strcmp(fileKey, key))
 			{
-				fprintf(stderr, "programmer not detected (CTS is false)\n");
-				fail = true;							// didn't see CTS, assume device is not present or not ready, fail
+				if (used + strlen(fileLine) + 1 > size)
+				{
+					size = (size + strlen(fileLine) + 1) * 2;
+
+					if (!(more = (char *) realloc(others, size)))
+						break;
+
+					others = more;
+				}
+
+				strcpy(&others[used], fileLine);
+				used += strlen(fileLine);
 			}
-			else
-				ConfigureFlowControl(serialDevice, true);	// looks ok to use flow control, so allow it
+		}
+
+		fclose(theFile);
+	}
+
+	// write a new file and rename it over the old one, so a reader never
+	// sees it half written
+	snprintf(temp, sizeof(temp), "%s.%d", path, (int) getpid());
+
+	if ((theFile = fopen(temp, "w")))
+	{
+		if (others)
+			fputs(others, theFile);
+
+		fputs(line, theFile);
+		written = !ferror(theFile);
+		written = (fclose(theFile) == 0) && written;
+
+#ifdef WIN32
+		if (written)
+			remove(path);							// rename won't replace a file here
+#endif
+		if (!written || rename(temp, path))
+			remove(temp);
+	}
+
+	free(others);
+}
+
+//--------------------------------------------------------------------
+// find what has been learned about this port: the speed found by
+// --baud auto and the reset pulse its programmer needs (0 = not known)
+
+static void LoadPortInfo(const char *name, unsigned int *rate, unsigned int *pulse)
+{
+	char				line[256], port[200];
+	unsigned int	fileRate, filePulse;
+
+	*rate = *pulse = 0;
+	filePulse = 0;
+
+	if (LoadLearned(PORT_FILE, name, line, sizeof(line)) && sscanf(line, "%199s %u %u", port, &fileRate, &filePulse) >= 2)
+	{
+		*rate = fileRate;
+		*pulse = filePulse;
+	}
+}
+
+//--------------------------------------------------------------------
+// remember what was learned about this port (replacing any earlier entry,
+// a value of 0 keeps what was there)
+
+static void SavePortInfo(const char *name, unsigned int rate, unsigned int pulse)
+{
+	char				line[256];
+	unsigned int	oldRate, oldPulse;
+	int				lock;
+
+	lock = LockLearned(PORT_FILE);
+	LoadPortInfo(name, &oldRate, &oldPulse);
+
+	if (!rate)
+		rate = oldRate;
+
+	if (!pulse)
+		pulse = oldPulse;
+
+	snprintf(line, sizeof(line), "%s %u %u\n", name, rate, pulse);
+	SaveLearned(PORT_FILE, name, line);
+	UnlockLearned(lock);
+}
+
+//--------------------------------------------------------------------
+// use the reset pulse learned for this port, if there is one
+
+static void LoadResetPulse(const char *name)
+{
+	unsigned int	rate, pulse;
+
+	LoadPortInfo(name, &rate, &pulse);
+
+	if (pulse && pulse <= RESET_PULSE_MAX)
+	{
+		resetPulse = pulse;
+		pulseLearned = true;
+	}
+}
+
+//--------------------------------------------------------------------
+// see whether the programmer answers reliably at this speed
+
+static bool ProbeBaud(unsigned int rate)
+{
+	int				i, numRead;
+	unsigned int	got;
+	unsigned char	theBuffer[4];
+
+	if (!ConfigureDevice(serialDevice, rate, 8, 1, 0, false) || !ResetProgrammer())
+		return false;
+
+	for (i=0; i<BAUD_PROBE_PINGS; i++)
+	{
+		theBuffer[0] = CMD_REQUEST_MODEL;
+		WriteBytes(serialDevice, theBuffer, 1);
+
+		if (ReadBytes(serialDevice, theBuffer, 1, BAUD_PROBE_TIMEOUT) != 1 || theBuffer[0] != PIC_ACK)
+			return false;
+
+		theBuffer[0] = CMD_REQUEST_VERSION;
+		WriteBytes(serialDevice, theBuffer, 1);
 
-			FlushBytes(serialDevice);						// get rid of any pending data
+		for (got=0; got<sizeof(theBuffer); got+=numRead)
+		{
+			if ((numRead = ReadBytes(serialDevice, &theBuffer[got], sizeof(theBuffer) - got, BAUD_PROBE_TIMEOUT)) <= 0)
+				return false;
 		}
-		else
+
+		if (theBuffer[0] != CMD_REQUEST_VERSION)
+			return false;
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------
+// find the fastest speed the programmer answers at, trying the one
+// remembered for this port first. Return 0 if there isn't one.
+
+static unsigned int FindBaud(const char *name)
+{
+	int				i;
+	unsigned int	rate, pulse;
+
+	LoadPortInfo(name, &rate, &pulse);
+
+	if (rate && ProbeBaud(rate))
+		return rate;
+
+	if (!ResetProgrammer())							// nothing there at all, no point trying every speed
+		return 0;
+
+	for (i=0; baudList[i]; i++)
+	{
+		if (baudList[i] != rate && ProbeBaud(baudList[i]))
 		{
-			fprintf(stderr, "could not configure flow control\n");
-			fail = true;
+			SavePortInfo(name, baudList[i], 0);
+			return baudList[i];
+		}
+	}
+
+	fprintf(stderr, "programmer did not answer at any speed\n");
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// read --baud auto|N, return false if the speed isn't understood
+
+static bool GetBaudOption(int *argc, char ***argv)
+{
+	unsigned int	i, rate;
+
+	if (*argc < 2 || strcmp((*argv)[0], "--baud"))
+		return true;									// not given
+
+	if (!strcmp((*argv)[1], "auto"))
+		baudAuto = true;
+	else
+	{
+		if (!atoi_base((*argv)[1], &rate))
+			rate = 0;
+
+		for (i=0; baudList[i] && baudList[i] != rate; i++)
+			;
+
+		if (!baudList[i])
+		{
+			fprintf(stderr, "Unsupported baud rate '%s'\n", (*argv)[1]);
+			return false;
 		}
+
+		baudRate = rate;
 	}
+
+	*argc -= 2;
+	*argv += 2;
+	return true;
+}
+
+//--------------------------------------------------------------------
+// Initialize the serial port
+// Once the device is opened and locked, this sets up the port, and makes sure the handshake looks good.
+
+static bool InitDevice(int serialDevice, unsigned int baudRate, unsigned char dataBits, unsigned char stopBits, unsigned char parity)
+{
+	bool						fail;						// haven't failed (yet)
+
+	fail = false;
+
+	if (ConfigureDevice(serialDevice, baudRate, dataBits, stopBits, parity, false))	// set up the device
+		fail = !ResetProgrammer();
 	else
 	{
 		fprintf(stderr, "could not configure device parameters\n");
@@ -3335,8 +5829,7 @@ static void ShowDevices()
 //	1) should write cause a blank check before writing?  should it program anyway if no bits that should be 1 are 0?
 //	2) several different writes are needed (program, ID, data, config)
 //	3) likewise, several different reads are needed
-//	4) need to be able to specify a range of addresses to read, instead of reading the entire device
-//	5) should erase be an option?  several different erases? erase plus a set of flags to indicate what to erase?
+//	4) should erase be an option?  several different erases? erase plus a set of flags to indicate what to erase?
 
 //--------------------------------------------------------------------
 // tell the user how to use this program
@@ -3347,33 +5840,64 @@ static void Usage()
 			" (c) 2000-2004 Cosmodog, Ltd. (http://www.cosmodog.com)\n"
 			" (c) 2004-2006 Jeff Post (http://home.pacbell.net/theposts/picmicro)\n"
 			" GNU General Public License\n", programName, versionString);
-	fprintf(stdout, "\nUsage: %s [-c] [-d] [-v] ttyname [-v] devtype [-i] [-h] [-q] [-v] [-s [size]] [-b|-r|-w|-e][pcidof]\n", programName);
+	fprintf(stdout, "\nUsage: %s [--baud auto|rate] [-c] [-d] [-v] ttyname [-v] devtype [-i] [-h] [-q] [-v] [-p [size]] [-s [size]] [-t [count]] [--probe-link [count]] [--test-setrange] [-b|-r|-w|-e|-v][pcidof]\n", programName);
 	fprintf(stdout, " where:\n");
 	fprintf(stdout, "  ttyname is the serial (or USB) device the programmer is attached to\n");
-	fprintf(stdout, "     (e.g. /dev/ttyS0 or com1)\n");
+	fprintf(stdout, "     (e.g. /dev/ttyS0 or com1), or on Linux/Unix one of\n");
+	fprintf(stdout, "     pty:path (a pseudo-terminal), tcp:host:port (a network serial bridge),\n");
+	fprintf(stdout, "     replay:file (play back a picpcomm.trc recorded with -c),\n");
+	fprintf(stdout, "     agent:host:port (a picp --agent on the machine with the programmer)\n");
 	fprintf(stdout, "  devtype is the pic device to be used (12C508, 16C505, etc.)\n");
+	fprintf(stdout, "  --baud auto|rate sets the serial speed (default %d), auto finds the fastest the\n", BAUD_DEFAULT);
+	fprintf(stdout, "     programmer answers at and remembers it in ~/%s (must be before ttyname)\n", PORT_FILE);
+	fprintf(stdout, "  --agent [host:]port ttyname (instead of ttyname and devtype) serves the programmer\n");
+	fprintf(stdout, "     on ttyname to picp on other machines, which use agent:host:port as their ttyname;\n");
+	fprintf(stdout, "     there is no authentication, so it listens on loopback only unless given a host\n");
+	fprintf(stdout, "     (* for every interface)\n");
+	fprintf(stdout, "  --probe-link [count] times [count] pings and set range echoes (default %d) and reports\n", PROBE_COUNT_DEFAULT);
+	fprintf(stdout, "     round trips, echo throughput and errors; exits with 2 if the link is degraded\n");
+	fprintf(stdout, "  --test-setrange checks, on a blank flash 18xxx part, whether a Warp-13's firmware\n");
+	fprintf(stdout, "     writes where set range says; it programs a few words, erases the whole part\n");
+	fprintf(stdout, "     again, and saves the answer in ~/%s for -wp to use\n", FIRMWARE_FILE);
 	fprintf(stdout, "  -b blank checks the requested region or regions\n");
-	fprintf(stdout, "  -c enable comm line debug output to picpcomm.log (must be before ttyname)\n");
+	fprintf(stdout, "  -c enable comm line debug output to picpcomm.trc (must be before ttyname),\n");
+	fprintf(stdout, "     picptrace [-t] [picpcomm.trc [logfile]] turns it into text\n");
 	fprintf(stdout, "  -d (if only parameter) show device list\n");
 	fprintf(stdout, "  -d devtype - show device information\n");
 	fprintf(stdout, "  -e erases the requested region (flash parts only)\n");
+	fprintf(stdout, "  -e auto (or -ea) erases program memory the quickest way that leaves the rest alone\n");
+	fprintf(stdout, "  -ee [filename] erases only if the device isn't blank where filename would be\n");
+	fprintf(stdout, "     written (anywhere, without filename)\n");
 	fprintf(stdout, "  -f ignores verify errors while writing\n");
 	fprintf(stdout, "  -h show this help\n");
 	fprintf(stdout, "  -i use ISP protocol (must be first option after devtype)\n");
+	fprintf(stdout, "  -l ttyname [ttyname ...] (if first parameter) show the programmer on each port\n");
+	fprintf(stdout, "  -p [size] keeps up to [size] program words in flight while writing (default %d, -p alone = 1)\n", PIPE_WINDOW_DEFAULT);
 	fprintf(stdout, "  -q sets quiet mode (excess messages supressed)\n");
 	fprintf(stdout, "  -r initiates a read (Intel Hex record format)\n");
 	fprintf(stdout, "  -s [size] shows a hash mark status bar of length [size] while erasing/writing\n");
+	fprintf(stdout, "  -t [count] resynchronizes and resumes a failed program write up to [count] times (default %d, -t alone = 0)\n", RESYNC_RETRIES);
 	fprintf(stdout, "  -w writes to the requested region\n");
 	fprintf(stdout, "     -wpx will suppress actual writing to program space (for debugging picp)\n");
+	fprintf(stdout, "     -wpd writes only the rows, config, ID and EEPROM that differ from the device (flash parts)\n");
+	fprintf(stdout, "     -wpm (or -wdm) keeps the EEPROM bytes the file doesn't set instead of erasing them\n");
 	fprintf(stdout, "  -v (if given after ttyname or after devtype) show programmer version number\n");
 	fprintf(stdout, "  -v (if only parameter) show picp version number\n");
+	fprintf(stdout, "  -v followed by regions (e.g. -vpcid [filename]) verifies them against a hex file,\n");
+	fprintf(stdout, "     reading back only what the file holds and stopping at the first mismatch\n");
+	fprintf(stdout, "     (add a, e.g. -vpa, to report every mismatch)\n");
+	fprintf(stdout, "  -vk [filename] compares the device's MPLAB checksum with the hex file's\n");
 	fprintf(stdout, "  Read/Write/Erase parameters:\n");
 	fprintf(stdout, "    p [filename] = program memory, optionally reading/writing filename\n");
+	fprintf(stdout, "       -rp start:length [filename] reads only length words from word address start\n");
 	fprintf(stdout, "    c [val] = configuration bits (val is a numeric word value when writing)\n");
 	fprintf(stdout, "    i [val] = ID locations\n");
 	fprintf(stdout, "    d [filename] = data memory, optionally reading/writing filename\n");
+	fprintf(stdout, "       -rd start:length [filename] reads only length bytes from data address start\n");
 	fprintf(stdout, "    o [val] = oscillator calibration space\n");
 	fprintf(stdout, "    f = entire flash device (only applies to -e, erase)\n");
+	fprintf(stdout, "    a = program memory, by whichever erase is quickest (only applies to -e, erase)\n");
+	fprintf(stdout, "    k = MPLAB checksum of program memory and configuration (only applies to -r and -v)\n");
 	fprintf(stdout, "  filename is an optional input or output file (default is stdin/stdout)\n");
 	fprintf(stdout, "\n");
 	fprintf(stdout, "Flags are operated on in order, from left to right.  If any operation fails,\n");
@@ -3743,19 +6267,501 @@ int loadPicDefinitions(void)
 	return count;
 }
 
+//--------------------------------------------------------------------
+// Identify the programmers attached to several ports at once.
+// Each port runs its own little state machine (reset, wait for CTS, ping,
+// get version) from a single event loop, so the time taken is that of the
+// slowest port rather than the sum of all of them.
+
+#define SCAN_RESET		0			// DTR is low, waiting out the reset pulse
+#define SCAN_CTS			1			// DTR raised, waiting for CTS
+#define SCAN_PING			2			// CMD_REQUEST_MODEL sent
+#define SCAN_VERSION		3			// CMD_REQUEST_VERSION sent
+#define SCAN_DONE			4
+
+typedef struct
+{
+	char				*name;			// device name
+	int				step;				// SCAN_xxx
+	int				tries;			// ping/version attempts, or CTS polls, left
+	unsigned int	need, got;		// bytes wanted and received for this step
+	unsigned char	rtnBuffer[4];
+	unsigned int	pulse;			// reset pulse in use (microseconds)
+	bool				found;
+} SCAN_STATE;
+
+// send a one byte command and wait for need bytes of reply
+
+static void ScanSend(IO_PORT *port, unsigned char cmd, unsigned int need)
+{
+	SCAN_STATE	*scan = (SCAN_STATE *) port->state;
+
+	scan->need = need;
+	scan->got = 0;
+	WriteBytes(port->theDevice, &cmd, 1);
+	IoLoopModify(port, IO_READABLE);
+	IoSetTimeout(port, CharTimeout);
+}
+
+// the port is done, one way or another. A programmer that didn't answer
+// after the shorter pulse remembered for the port is reset again with the
+// full RESET_PULSE_MAX before giving up on it.
+
+static void ScanFinish(IO_PORT *port)
+{
+	SCAN_STATE	*scan = (SCAN_STATE *) port->state;
+
+	if (!scan->found && scan->pulse < RESET_PULSE_MAX)
+	{
+		scan->pulse = RESET_PULSE_MAX;
+		scan->step = SCAN_RESET;
+		IoLoopModify(port, 0);
+		ConfigureFlowControl(port->theDevice, false);
+		SetDTR(port->theDevice, false);			// lower DTR to reset the programmer
+		IoSetTimeout(port, scan->pulse);
+		return;
+	}
+
+	if (scan->found)
+		fprintf(stdout, "%s: programmer firmware version %d.%02d.%02d\n", scan->name,
+			scan->rtnBuffer[1], scan->rtnBuffer[2], scan->rtnBuffer[3]);
+	else
+		fprintf(stdout, "%s: no programmer detected\n", scan->name);
+
+	scan->step = SCAN_DONE;
+	IoLoopRemove(port);
+}
+
+static void ScanHandler(IO_PORT *port, unsigned int events)
+{
+	bool			CTS, DCD;
+	int			numRead;
+	SCAN_STATE	*scan = (SCAN_STATE *) port->state;
+
+	if (events & IO_ERROR)
+	{
+		ScanFinish(port);
+		return;
+	}
+
+	switch (scan->step)
+	{
+		case SCAN_RESET:
+			SetDTR(port->theDevice, true);			// end of the reset pulse
+			scan->step = SCAN_CTS;
+			scan->tries = 100;							// allow about 100 ms for CTS
+			IoSetTimeout(port, 1000);
+			break;
+
+		case SCAN_CTS:
+			GetDeviceStatus(port->theDevice, &CTS, &DCD);
+
+			if (CTS)
+			{
+				ConfigureFlowControl(port->theDevice, true);
+				FlushBytes(port->theDevice);
+				scan->step = SCAN_PING;
+				scan->tries = 5;
+				ScanSend(port, CMD_REQUEST_MODEL, 1);
+			}
+			else if (scan->tries--)
+				IoSetTimeout(port, 1000);
+			else
+				ScanFinish(port);
+
+			break;
+
+		case SCAN_PING:
+		case SCAN_VERSION:
+			if (events & IO_TIMEOUT)
+			{
+				if (--scan->tries > 0)
+					ScanSend(port, (scan->step == SCAN_PING) ? CMD_REQUEST_MODEL : CMD_REQUEST_VERSION, scan->need);
+				else
+					ScanFinish(port);
+
+				break;
+			}
+
+			while (scan->got < scan->need &&		// take everything that is waiting
+				(numRead = ReadBytes(port->theDevice, &scan->rtnBuffer[scan->got], scan->need - scan->got, 0)) > 0)
+				scan->got += numRead;
+
+			if (scan->got < scan->need)
+				break;										// wait for the rest
+
+			if (scan->step == SCAN_PING)
+			{
+				if (scan->rtnBuffer[0] == PIC_ACK)
+				{
+					scan->step = SCAN_VERSION;
+					scan->tries = 5;
+					ScanSend(port, CMD_REQUEST_VERSION, 4);
+				}
+				else if (--scan->tries > 0)
+					ScanSend(port, CMD_REQUEST_MODEL, 1);
+				else
+					ScanFinish(port);
+			}
+			else
+			{
+				scan->found = (scan->rtnBuffer[0] == CMD_REQUEST_VERSION);
+				ScanFinish(port);
+			}
+
+			break;
+	}
+}
+
+static bool ScanPorts(int count, char **names)
+{
+	int			i;
+	bool			fail;
+	unsigned int	rate, pulse;
+	IO_LOOP		*loop;
+	IO_PORT		*ports;
+	SCAN_STATE	*scans;
+
+	if (!(loop = IoLoopCreate()))
+	{
+		fprintf(stderr, "scanning several ports at once is not supported on this system\n");
+		return false;
+	}
+
+	ports = (IO_PORT *) calloc(count, sizeof(IO_PORT));
+	scans = (SCAN_STATE *) calloc(count, sizeof(SCAN_STATE));
+
+	if (!ports || !scans)
+	{
+		fprintf(stderr, "failed to allocate memory\n");
+		free(ports);
+		free(scans);
+		IoLoopDestroy(loop);
+		return false;
+	}
+
+	fail = false;
+
+	for (i=0; i<count; i++)
+	{
+		scans[i].name = names[i];
+		scans[i].step = SCAN_DONE;
+		ports[i].theDevice = -1;
+		ports[i].handler = &ScanHandler;
+		ports[i].state = &scans[i];
+
+		if (!OpenDevice(names[i], &ports[i].theDevice))
+		{
+			ports[i].theDevice = -1;
+			fprintf(stdout, "%s: failed to open device (%s)\n", names[i], strerror(errno));	// EMFILE: raise ulimit -n for big racks
+			continue;
+		}
+
+		if (!ConfigureDevice(ports[i].theDevice, 19200, 8, 1, 0, false) ||
+			!ConfigureFlowControl(ports[i].theDevice, false) ||
+			!IoLoopAdd(loop, &ports[i], 0))
+		{
+			fprintf(stdout, "%s: failed to set up the serial port\n", names[i]);
+			continue;
+		}
+
+		LoadPortInfo(names[i], &rate, &pulse);
+		scans[i].step = SCAN_RESET;
+		scans[i].pulse = (pulse && pulse <= RESET_PULSE_MAX) ? pulse : RESET_PULSE_MAX;
+		SetDTR(ports[i].theDevice, false);			// lower DTR to reset the programmer
+		IoSetTimeout(&ports[i], scans[i].pulse);
+	}
+
+	if (!IoLoopRun(loop))
+	{
+		fprintf(stderr, "error %d, %s\n", errno, strerror(errno));
+		fail = true;
+	}
+
+	for (i=0; i<count; i++)
+	{
+		if (ports[i].theDevice != -1)
+			CloseDevice(ports[i].theDevice);
+	}
+
+	free(ports);
+	free(scans);
+	IoLoopDestroy(loop);
+	return(!fail);
+}
+
+//--------------------------------------------------------------------
+// picp --agent: serve clients on the network (agent:host:port) from the
+// programmer on this machine, running the echo-checked operations here
+// so that each costs one network round trip instead of one per word.
+// See agent.h for the requests.
+
+// tell the client how far a write has got (every so often)
+static void AgentShowProgress(unsigned int curOps)
+{
+	unsigned char	value[4];
+
+	if (curOps < agentProgress || curOps >= agentProgress + AGENT_PROGRESS_STEP)
+	{
+		agentProgress = curOps;
+		AgentPutLong(value, curOps);
+		AgentSend(agentClient, AGENT_PROGRESS, value, sizeof(value));
+	}
+}
+
+// take on the client's device and programmer settings from a request
+static const PIC_DEFINITION *GetAgentHeader(const unsigned char *request)
+{
+	char					name[AGENT_NAME_SIZE];
+	PIC_DEFINITION		*picDevice;
+
+	memcpy(name, request, AGENT_NAME_SIZE);
+	name[AGENT_NAME_SIZE - 1] = '\0';
+
+	if (!(picDevice = GetPICDefinition(name)))
+	{
+		fprintf(stderr, "agent: unrecognized PIC device type: '%s'\n", name);
+		return NULL;
+	}
+
+	programmerSupport = request[AGENT_NAME_SIZE];
+	ISPflag = (request[AGENT_NAME_SIZE + 1] & AGENT_FLAG_ISP) != 0;
+	oldFirmware = (request[AGENT_NAME_SIZE + 1] & AGENT_FLAG_OLD_FW) != 0;
+	suppressWrite = (request[AGENT_NAME_SIZE + 1] & AGENT_FLAG_NOWRITE) != 0;
+	pipeWindow = (request[AGENT_NAME_SIZE + 2] << 8) | request[AGENT_NAME_SIZE + 3];
+
+	if (!pipeWindow || pipeWindow > PIPE_WINDOW_MAX)
+		pipeWindow = PIPE_WINDOW_DEFAULT;
+
+	return picDevice;
+}
+
+// pass on anything the programmer has said
+static void AgentForward()
+{
+	unsigned char	theBytes[256];
+	int				numRead;
+
+	while (ByteWaiting(serialDevice, 0) && (numRead = (int) ReadBytes(serialDevice, theBytes, sizeof(theBytes), 0)) > 0)
+	{
+		if (!AgentSend(agentClient, AGENT_DATA, theBytes, numRead))
+			break;
+	}
+}
+
+// carry out one request from the client
+static void AgentOperation(unsigned char type, unsigned char *frame, unsigned int length)
+{
+	const PIC_DEFINITION	*picDevice;
+	unsigned char			result[9], *rtnBuffer;
+	unsigned int			size, confirmed, resultBytes;
+	int						mismatch;
+
+	mismatch = -1;
+	confirmed = 0;
+	result[0] = false;
+	resultBytes = 1;
+
+	switch (type)
+	{
+		case AGENT_DATA:
+			WriteBytes(serialDevice, frame, length);
+			return;
+
+		case AGENT_DTR:
+			if (length)
+				SetDTR(serialDevice, frame[0] != 0);
+			return;
+
+		case AGENT_FLUSH:
+			FlushBytes(serialDevice);
+			return;
+
+		case AGENT_RESET:
+			if (length >= 4 && AgentGetLong(frame) && AgentGetLong(frame) <= RESET_PULSE_MAX)
+				resetPulse = AgentGetLong(frame);		// the client knows what its programmer needs
+
+			result[0] = ResetProgrammer();
+			break;
+
+		case AGENT_SET_RANGE:
+			if (length == AGENT_OP_HEADER + 8 && (picDevice = GetAgentHeader(frame)))
+				result[0] = SetRange(picDevice, AgentGetLong(&frame[AGENT_OP_HEADER]), AgentGetLong(&frame[AGENT_OP_HEADER + 4]));
+			break;
+
+		case AGENT_WRITE_PGM:
+			size = (length >= AGENT_OP_HEADER + 9) ? AgentGetLong(&frame[AGENT_OP_HEADER + 4]) : 0;
+
+			if (size && size <= 0xffff && length == AGENT_OP_HEADER + 9 + size * 2 && (picDevice = GetAgentHeader(frame)))
+			{
+				if ((rtnBuffer = (unsigned char *) malloc(size * 2 + 1)))
+				{
+					agentProgress = 0;
+					result[0] = WritePgmBlock(picDevice, AgentGetLong(&frame[AGENT_OP_HEADER]), size, &frame[AGENT_OP_HEADER + 9],
+						rtnBuffer, &mismatch, &confirmed, frame[AGENT_OP_HEADER + 8] != 0);
+					free(rtnBuffer);
+				}
+			}
+
+			AgentPutLong(&result[5], confirmed);
+			resultBytes = 9;
+			break;
+
+		case AGENT_WRITE_DATA:
+			size = (length >= AGENT_OP_HEADER + 4) ? AgentGetLong(&frame[AGENT_OP_HEADER]) : 0;
+
+			if (size && size <= MAX_EEPROM_DATA_SIZE && length == AGENT_OP_HEADER + 4 + size && GetAgentHeader(frame))
+			{
+				memcpy(&eepromData[1], &frame[AGENT_OP_HEADER + 4], size);
+				result[0] = SendEepromData(size, &mismatch);
+			}
+
+			resultBytes = 5;
+			break;
+
+		default:
+			fprintf(stderr, "agent: unknown request 0x%02x\n", type);
+			return;
+	}
+
+	if (resultBytes > 1)
+		AgentPutLong(&result[1], mismatch);
+
+	suppressWrite = false;
+	AgentSend(agentClient, AGENT_RESULT, result, resultBytes);
+}
+
+// the client sent something, or hung up
+static void AgentClientHandler(IO_PORT *port, unsigned int events)
+{
+	unsigned char	type;
+	unsigned int	length;
+
+	if (!AgentReceive(port->theDevice, &type, agentFrame, AGENT_MAX_FRAME, &length))
+	{
+		IoLoopRemove(port);
+		IoLoopRemove((IO_PORT *) port->state);
+		return;
+	}
+
+	AgentOperation(type, agentFrame, length);
+	AgentForward();									// anything left over from the operation
+}
+
+// the programmer sent something
+static void AgentDeviceHandler(IO_PORT *port, unsigned int events)
+{
+	if (events & IO_ERROR)
+	{
+		fprintf(stderr, "agent: lost the programmer's port\n");
+		agentDeviceLost = true;
+		IoLoopRemove(port);
+		IoLoopRemove((IO_PORT *) port->state);
+		return;
+	}
+
+	AgentForward();
+}
+
+static bool RunAgent(const char *address)
+{
+	int			listener;
+	bool			fail;
+	IO_LOOP		*loop;
+	IO_PORT		client, device;
+
+	if (!(loop = IoLoopCreate()))
+	{
+		fprintf(stderr, "the agent is not supported on this system\n");
+		return false;
+	}
+
+	if (!(agentFrame = (unsigned char *) malloc(AGENT_MAX_FRAME)))
+	{
+		fprintf(stderr, "failed to malloc %d bytes\n", AGENT_MAX_FRAME);
+		IoLoopDestroy(loop);
+		return false;
+	}
+
+	fail = false;
+
+	if (OpenDevice(deviceName, &serialDevice))
+	{
+		LoadResetPulse(deviceName);
+
+		if ((!baudAuto || (baudRate = FindBaud(deviceName))) &&
+			ConfigureDevice(serialDevice, baudRate, 8, 1, 0, false))
+		{
+			if ((listener = AgentListen(address)) != -1)
+			{
+				if (verboseOutput)
+					fprintf(stdout, "agent for %s at %u baud, listening on %s\n", deviceName, baudRate, address);
+
+				while (!fail && !agentDeviceLost && (agentClient = AgentAccept(listener)) != -1)
+				{
+					memset(&client, 0, sizeof(client));
+					memset(&device, 0, sizeof(device));
+					client.theDevice = agentClient;
+					client.handler = &AgentClientHandler;
+					client.state = &device;
+					device.theDevice = serialDevice;
+					device.handler = &AgentDeviceHandler;
+					device.state = &client;
+					FlushBytes(serialDevice);				// nothing from before this client
+
+					if (!IoLoopAdd(loop, &client, IO_READABLE) || !IoLoopAdd(loop, &device, IO_READABLE) || !IoLoopRun(loop))
+					{
+						fprintf(stderr, "error %d, %s\n", errno, strerror(errno));
+						IoLoopRemove(&client);
+						IoLoopRemove(&device);
+						fail = true;
+					}
+
+					close(agentClient);
+					agentClient = -1;
+					suppressWrite = false;
+				}
+
+				close(listener);
+			}
+			else
+			{
+				fprintf(stderr, "agent can't listen on %s\n", address);
+				fail = true;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "could not configure device parameters\n");
+			fail = true;
+		}
+
+		CloseDevice(serialDevice);
+	}
+	else
+	{
+		fprintf(stderr, "failed to open device '%s'\n", deviceName);
+		fail = true;
+	}
+
+	free(agentFrame);
+	IoLoopDestroy(loop);
+	return(!fail && !agentDeviceLost);
+}
+
 //--------------------------------------------------------------------
 // Program PICs through a serial port
 
 int main(int argc,char *argv[])
 {
 	bool				fail;
-	unsigned int	baudRate;
 	unsigned char	dataBits, stopBits, parity;
 	bool				done;
 	char				*flags;
 	time_t			tp;
 	struct tm		*date_time;
 	int				i, year;
+	unsigned int	probeCount;
 	const PIC_DEFINITION	*picDevice = NULL;
 
 #ifdef BETA
@@ -3775,6 +6781,9 @@ int main(int argc,char *argv[])
 	hashWidth = false;								// don't show hask marks by default
 	ignoreVerfErr = false;							// by default stop on verify errors
 
+	if (argc > 1 && (!strcmp(argv[0], "-l") || !strcmp(argv[0], "-L")))	// list programmers on several ports
+		return(!ScanPorts(argc - 1, &argv[1]));
+
 	if (!loadPicDefinitions())
 	{
 		fprintf(stderr, "\n%s: version %s\n", programName, versionString);
@@ -3782,11 +6791,21 @@ int main(int argc,char *argv[])
 		return 1;
 	}
 
+	if (!GetBaudOption(&argc, &argv))				// serial speed, may come before or after -c
+		return 1;
+
 	if (argc > 2)										// need at least four arguments to do anything
 	{
 		if ((!strcmp(argv[0], "-c")) || (!strcmp(argv[0], "-C")))	// if first argument is '-c', debug comm line
 		{
-			comm_debug = fopen("picpcomm.log", "a");
+			comm_debug = fopen("picpcomm.trc", "ab");
+
+			if (comm_debug && !TraceStart(comm_debug))
+			{
+				fprintf(stderr, "can't start the comm debug trace\n");
+				fclose(comm_debug);
+				comm_debug = NULL;
+			}
 
 			if (comm_debug)
 			{
@@ -3797,20 +6816,38 @@ int main(int argc,char *argv[])
 				while (year > 100)
 					year -= 100;
 
-				fprintf(comm_debug, "\nPicp %s comm debug file opened %02d/%02d/%02d %02d:%02d\nOptions:",
+				TracePrintf("\nPicp %s comm debug file opened %02d/%02d/%02d %02d:%02d\nOptions:",
 					versionString,
 					date_time->tm_mon + 1,
 					date_time->tm_mday, year,
 					date_time->tm_hour, date_time->tm_min);
 
 				for (i=0; i<argc; i++)
-					fprintf(comm_debug, " %s", argv[i]);
+					TracePrintf(" %s", argv[i]);
 
-				fprintf(comm_debug, "\n");
+				TracePrintf("\n");
 			}
 
 			argc--;
 			argv++;
+
+			if (!GetBaudOption(&argc, &argv) || argc < 2)	// --baud may also follow -c
+			{
+				Usage();
+				return 1;
+			}
+		}
+
+		if (!strcmp(argv[0], "--agent"))					// serve a programmer on this machine to the network
+		{
+			if (argc != 3)
+			{
+				Usage();
+				return 1;
+			}
+
+			deviceName = argv[2];
+			return RunAgent(argv[1]) ? 0 : 1;
 		}
 
 		deviceName = *argv++;								// name of the device (probably)
@@ -3824,12 +6861,13 @@ int main(int argc,char *argv[])
 
 			if (OpenDevice(deviceName, &serialDevice))		// open the serial device
 			{
-				baudRate = 19200;
+				LoadResetPulse(deviceName);
 				dataBits = 8;
 				stopBits = 1;
 				parity = 0;
 
-				if (InitDevice(serialDevice, baudRate, dataBits, stopBits, parity))	// initialize the serial port
+				if ((!baudAuto || (baudRate = FindBaud(deviceName))) &&
+					InitDevice(serialDevice, baudRate, dataBits, stopBits, parity))	// initialize the serial port
 				{
 					if (DoGetProgrammerType())				// ask what kind of programmer is attached, fail if none or one we don't support
 					{
@@ -3888,7 +6926,10 @@ int main(int argc,char *argv[])
 										switch (*flags)
 										{
 											case 'v':
-												DoShowVersion();
+												if (flags[1])						// -v with regions verifies
+													fail = !DoTasks(&argc, &argv, picDevice, flags);
+												else
+													DoShowVersion();
 												break;
 
 											case 'f':
@@ -3938,6 +6979,41 @@ int main(int argc,char *argv[])
 
 												break;
 
+											case 'p':
+												if (argc && **argv != '-')		// if the next argument isn't preceeded by a '-'
+												{
+													fail = !atoi_base(*argv, &pipeWindow);	// try to read the next argument as a number
+													argv++;							// skip to the next argument
+													argc--;
+
+													if (fail)
+														fprintf(stderr, "Unable to interpret '%s' as a numerical value\n", *(argv - 1));
+													else if (!pipeWindow || pipeWindow > PIPE_WINDOW_MAX)
+													{
+														fprintf(stderr, "Pipeline window must be 1 to %d words\n", PIPE_WINDOW_MAX);
+														fail = true;
+													}
+												}
+												else
+													pipeWindow = 1;			// no size means wait for each word's echo
+
+												break;
+
+											case 't':
+												if (argc && **argv != '-')		// if the next argument isn't preceeded by a '-'
+												{
+													fail = !atoi_base(*argv, &resyncRetries);	// try to read the next argument as a number
+													argv++;							// skip to the next argument
+													argc--;
+
+													if (fail)
+														fprintf(stderr, "Unable to interpret '%s' as a numerical value\n", *(argv - 1));
+												}
+												else
+													resyncRetries = 0;			// no count means give up at the first failure
+
+												break;
+
 											case 'b':
 											case 'r':
 											case 'w':
@@ -3945,6 +7021,35 @@ int main(int argc,char *argv[])
 												fail = !DoTasks(&argc, &argv, picDevice, flags);	// do the requested operation
 												break;
 
+											case '-':
+												if (!strcmp(flags, "-probe-link"))	// measure the link to the programmer
+												{
+													probeCount = PROBE_COUNT_DEFAULT;
+
+													if (argc && **argv != '-')		// if the next argument isn't preceeded by a '-'
+													{
+														fail = !atoi_base(*argv, &probeCount);	// try to read the next argument as a number
+														argv++;							// skip to the next argument
+														argc--;
+
+														if (fail)
+															fprintf(stderr, "Unable to interpret '%s' as a numerical value\n", *(argv - 1));
+														else if (!probeCount)
+														{
+															fprintf(stderr, "Link probe needs at least one round trip\n");
+															fail = true;
+														}
+													}
+
+													if (!fail)
+														fail = !ProbeLink(picDevice, probeCount);
+												}
+												else if (!strcmp(flags, "-test-setrange"))	// find out where this firmware's set range writes go
+													fail = !TestSetRangeWrites(picDevice);
+												else
+													fprintf(stderr, "bad argument: '%s'\n", *(argv - 1));	// back up, show the trouble spot
+												break;
+
 											case '\0':						// ignore a stray dash
 												break;
 
@@ -3979,6 +7084,7 @@ int main(int argc,char *argv[])
 					fail = true;
 				}
 
+				LogSerialStats();
 				CloseDevice(serialDevice);
 			}
 			else
@@ -4028,12 +7134,13 @@ int main(int argc,char *argv[])
 				{
 					if (OpenDevice(deviceName, &serialDevice))		// open the serial device
 					{
-						baudRate = 19200;
+						LoadResetPulse(deviceName);
 						dataBits = 8;
 						stopBits = 1;
 						parity = 0;
 
-						if (InitDevice(serialDevice, baudRate, dataBits, stopBits, parity))	// initialize the serial port
+						if ((!baudAuto || (baudRate = FindBaud(deviceName))) &&
+							InitDevice(serialDevice, baudRate, dataBits, stopBits, parity))	// initialize the serial port
 						{
 							fprintf(stdout, "\n");
 
@@ -4058,6 +7165,9 @@ int main(int argc,char *argv[])
 		}
 	}
 
+	if (!fail && linkDegraded)
+		return 2;		// the programmer works, but the link to it is below par
+
 	return(fail);	// return 0 if okay (not failed)
 }
 
@@ -0,0 +1,90 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+//
+//	This program is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU General Public License
+//	as published by the Free Software Foundation; either version 2
+//	of the License, or (at your option) any later version.
+//
+//	This program is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with this program; if not, write to the Free Software
+//	Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+//
+//-----------------------------------------------------------------------------
+
+// picptrace.c
+// Convert a picp comm debug trace (picpcomm.trc, written with -c) to the
+// picpcomm.log text format
+//
+// usage: picptrace [-t] [tracefile [logfile]]
+//   -t shows when each run of bytes went by, and the command in progress
+//   tracefile defaults to picpcomm.trc, logfile to stdout
+
+#include	<stdio.h>
+#include	<string.h>
+
+#include	"trace.h"
+
+int main(int argc, char *argv[])
+{
+	FILE	*in, *out;
+	bool	showTimes;
+	int	result;
+
+	showTimes = false;
+
+	if (argc > 1 && !strcmp(argv[1], "-t"))
+	{
+		showTimes = true;
+		argc--;
+		argv++;
+	}
+
+	if (!(in = fopen((argc > 1) ? argv[1] : "picpcomm.trc", "rb")))
+	{
+		fprintf(stderr, "can't open %s\n", (argc > 1) ? argv[1] : "picpcomm.trc");
+		return 1;
+	}
+
+	out = stdout;
+
+	if (argc > 2 && !(out = fopen(argv[2], "w")))
+	{
+		fprintf(stderr, "can't create %s\n", argv[2]);
+		fclose(in);
+		return 1;
+	}
+
+	result = 0;
+
+	if (!TraceDecode(in, out, showTimes))
+	{
+		fprintf(stderr, "%s is not a picp trace file\n", (argc > 1) ? argv[1] : "picpcomm.trc");
+		result = 1;
+	}
+
+	fclose(in);
+
+	if (out != stdout)
+		fclose(out);
+
+	return result;
+}
@@ -81,7 +81,7 @@ static void DumpIntelHexExtendedAddressRecord(FILE *theFile, unsigned int addres
 //  address -- the address of the record
 //  theBytes -- pointer to the actual data
 //  numBytes -- number of bytes in the record
-static void DumpIntelHexLine(FILE *theFile, unsigned int address, unsigned char *theBytes, int numBytes, unsigned short int blankData)
+static void DumpIntelHexLine(FILE *theFile, unsigned int address, const unsigned char *theBytes, int numBytes, unsigned short int blankData)
 {
 	int	i, checkSum;
 	unsigned short int	data;
@@ -107,6 +107,7 @@ static void DumpIntelHexLine(FILE *theFile, unsigned int address, unsigned char
 
 	if (!skip)
 	{
+		address &= 0xffff;					// the upper half went out in an extended address record
 		fprintf(theFile, ":%02X%04X%02X", numBytes, address, DATARECORD);	// write the stub (colon, length of record, address, record type)
 		checkSum = 0;
 
@@ -129,35 +130,63 @@ static void DumpIntelHexEOR(FILE *theFile)
 }
 
 //-----------------------------------------------------------------------------
-// write a hex record to the output file
-// DEBUG should be able to specify intel hex or motorola S
-void WriteHexRecord(FILE *outFile, unsigned char *theBuffer, unsigned int address, unsigned short int size, unsigned short int blankData)
+// start writing hex records to outFile a piece at a time
+
+void HexOutStart(HEX_OUT *hexOut, FILE *outFile)
 {
-	int				bytesLeft, numBytes;
-	unsigned int	extendedAddress;
-	
-	bytesLeft = size;
-	extendedAddress = address & 0xffff0000;
+	hexOut->file = outFile;
+	hexOut->extendedAddress = 0;
+	hexOut->started = false;
+}
 
-	DumpIntelHexExtendedAddressRecord(outFile, extendedAddress >> 16);
+//-----------------------------------------------------------------------------
+// write the records for size bytes at address (the pieces must be written
+// in increasing address order). Records are REC_LENGTH bytes from address,
+// so pieces that are a multiple of that long come out the same as a
+// single write of the whole buffer.
+
+void HexOutWrite(HEX_OUT *hexOut, const unsigned char *theBuffer, unsigned int address, unsigned int size, unsigned short int blankData)
+{
+	unsigned int	bytesLeft, numBytes;
 
-	while (bytesLeft)
+	for (bytesLeft = size; bytesLeft; bytesLeft -= numBytes)
 	{
+		if (!hexOut->started || ((address & 0xffff0000) != hexOut->extendedAddress))
+		{
+			hexOut->extendedAddress = address & 0xffff0000;
+			hexOut->started = true;
+			DumpIntelHexExtendedAddressRecord(hexOut->file, hexOut->extendedAddress >> 16);
+		}
+
 		numBytes = bytesLeft > REC_LENGTH ? REC_LENGTH : bytesLeft;
 
-		if (((address + numBytes) & 0xffff0000) != extendedAddress)
-			numBytes = extendedAddress - address;
+		if (((address + numBytes) & 0xffff0000) != hexOut->extendedAddress)
+			numBytes = hexOut->extendedAddress + 0x10000 - address;	// stop at the 64K boundary
 
-		DumpIntelHexLine(outFile, address, &theBuffer[size - bytesLeft], numBytes, blankData);
+		DumpIntelHexLine(hexOut->file, address, &theBuffer[size - bytesLeft], numBytes, blankData);
 		address += numBytes;
-		bytesLeft -= numBytes;
-
-		if (bytesLeft && ((address & 0xffff0000) != extendedAddress))
-		{
-			extendedAddress = address & 0xffff0000;
-			DumpIntelHexExtendedAddressRecord(outFile, extendedAddress >> 16);
-		}
 	}
+}
+
+//-----------------------------------------------------------------------------
+// finish the hex file
+
+void HexOutEnd(HEX_OUT *hexOut)
+{
+	if (!hexOut->started)
+		DumpIntelHexExtendedAddressRecord(hexOut->file, hexOut->extendedAddress >> 16);
+
+	DumpIntelHexEOR(hexOut->file);
+}
+
+//-----------------------------------------------------------------------------
+// write a hex record to the output file
+// DEBUG should be able to specify intel hex or motorola S
+void WriteHexRecord(FILE *outFile, unsigned char *theBuffer, unsigned int address, unsigned int size, unsigned short int blankData)
+{
+	HEX_OUT	hexOut;
 
-	DumpIntelHexEOR(outFile);
+	HexOutStart(&hexOut, outFile);
+	HexOutWrite(&hexOut, theBuffer, address, size, blankData);
+	HexOutEnd(&hexOut);
 }
@@ -17,6 +17,24 @@
 #ifndef __RECORD_H_
 #define __RECORD_H_
 
-void	WriteHexRecord(FILE *outFile, unsigned char *theBuffer, unsigned int address, unsigned short int size, unsigned short int blankData);
+#include <stdio.h>
+
+#ifdef WIN32
+#define	bool	int
+#endif
+
+// hex records written a piece at a time (as the data arrives)
+
+typedef struct
+{
+	FILE				*file;
+	unsigned int	extendedAddress;		// upper half of the addresses being written
+	bool				started;					// the first extended address record is out
+} HEX_OUT;
+
+void	HexOutStart(HEX_OUT *hexOut, FILE *outFile);
+void	HexOutWrite(HEX_OUT *hexOut, const unsigned char *theBuffer, unsigned int address, unsigned int size, unsigned short int blankData);
+void	HexOutEnd(HEX_OUT *hexOut);
+void	WriteHexRecord(FILE *outFile, unsigned char *theBuffer, unsigned int address, unsigned int size, unsigned short int blankData);
 
 #endif // defined __RECORD_H_
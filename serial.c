@@ -25,6 +25,8 @@
 // serial device
 
 #include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
@@ -34,23 +36,256 @@
 #define	true	TRUE
 #else
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <termios.h>
 #include	<strings.h>
+#include	<errno.h>
+#endif
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/serial.h>
 #endif
 
 #include <fcntl.h>
 #include <unistd.h>
 
 #include	"serial.h"
+#include	"transport.h"
+#include	"trace.h"
+#include	"agent.h"
 
 #define MIN_CHARS		0		// DEBUG something is amiss with this, if VTIME is non-zero we get EAGAIN returned instead of zero (and no delay)
 #define CHAR_TIMEOUT	0		// character timeout (read fails and returns if this much time passes without a character) in 1/10's sec
 
+#define RX_RING_SIZE	4096	// receive ring size for each device (power of 2)
+#define LOW_LATENCY_MS	1		// USB-serial latency timer setting we ask for (in ms)
+
 extern FILE	*comm_debug;
-extern int	comm_debug_count;
-extern bool	sendCommand;
 extern bool	suppressWrite;
 
+#ifndef WIN32
+// Everything the kernel has waiting is drained into a per-device receive
+// ring in one read, and later ReadBytes calls are served from memory.
+// Each open device gets its own, so any number can be open at once.
+
+typedef struct rx_port
+{
+	struct rx_port	*next;					// next open device
+	int				theDevice;				// descriptor this ring belongs to
+	unsigned int	head;						// where the next received byte goes
+	unsigned int	tail;						// next byte to hand to the caller
+	unsigned char	ring[RX_RING_SIZE];
+	SERIAL_STATS	stats;
+	LINK				link;						// how bytes reach the device
+} RX_PORT;
+
+// What the tty and pty transports must put back when the device is closed
+
+typedef struct
+{
+	struct termios	oldTerminalParams;	// settings when we opened it
+	int				oldSerialFlags;		// ASYNC_xxx flags before we set low latency (-1 = unchanged)
+	int				oldLatency;				// latency_timer before we changed it (-1 = unchanged)
+	int				latency;					// latency_timer now in effect (-1 = none)
+	char				latencyPath[128];		// sysfs latency_timer file for this device
+} TTY_STATE;
+
+static RX_PORT	*rxPorts = NULL;			// open devices
+
+// Find the receive ring for theDevice, optionally allocating one.
+// Returns NULL if it has none (or there isn't enough memory for one).
+
+static RX_PORT *GetRxPort(int theDevice, bool claim)
+{
+	RX_PORT	*port;
+
+	for (port=rxPorts; port; port=port->next)
+	{
+		if (port->theDevice == theDevice)
+			return port;
+	}
+
+	if (claim)
+	{
+		if (!(port = (RX_PORT *) calloc(1, sizeof(RX_PORT))))
+		{
+			fprintf(stderr, "failed to malloc %u bytes\n", (unsigned int) sizeof(RX_PORT));
+			return NULL;
+		}
+
+		port->theDevice = theDevice;
+		port->link.theDevice = theDevice;
+		port->link.transport = &ttyTransport;		// until OpenDevice says otherwise
+		port->next = rxPorts;
+		rxPorts = port;
+	}
+
+	return port;
+}
+
+// Forget theDevice's receive ring
+
+static void FreeRxPort(RX_PORT *port)
+{
+	RX_PORT	**link;
+
+	for (link=&rxPorts; *link; link=&(*link)->next)
+	{
+		if (*link == port)
+		{
+			*link = port->next;
+			free(port);
+			return;
+		}
+	}
+}
+
+// Return true if theDevice is a terminal (or isn't one of ours, and so
+// is assumed to be one).
+
+static bool IsTerminal(int theDevice)
+{
+	RX_PORT	*port;
+
+	return !(port = GetRxPort(theDevice, false)) || port->link.transport->termios;
+}
+
+// Read everything the kernel has for this device into its ring.
+// Return the number of bytes added, 0 if none, -1 on error.
+
+static int FillRxRing(RX_PORT *port)
+{
+	struct iovec	iov[2];
+	unsigned int	head, room, first;
+	int				numRead;
+
+	head = port->head & (RX_RING_SIZE - 1);
+	room = RX_RING_SIZE - (port->head - port->tail);
+
+	if (!room)
+		return 0;
+
+	first = RX_RING_SIZE - head;				// space up to the end of the ring
+
+	if (first > room)
+		first = room;
+
+	iov[0].iov_base = &port->ring[head];
+	iov[0].iov_len = first;
+	iov[1].iov_base = &port->ring[0];		// and any that wraps to the front
+	iov[1].iov_len = room - first;
+
+	port->stats.readSyscalls++;
+	numRead = port->link.transport->read(&port->link, iov, (room > first) ? 2 : 1);
+
+	if (numRead < 0)
+		return -1;
+
+	port->head += numRead;
+	port->stats.bytesRead += numRead;
+	return numRead;
+}
+#endif
+
+#ifdef __linux__
+// USB-serial adapters hold received bytes for up to their latency timer
+// (16 ms by default on FTDI parts) before passing them on, which dominates
+// every echo the programmer sends. Ask the driver for low latency, and turn
+// the FTDI latency timer down if sysfs lets us. Everything is put back by
+// RestoreLatency.
+
+static int ReadSysfsInt(const char *path)
+{
+	FILE	*theFile;
+	int	value;
+
+	if (!(theFile = fopen(path, "r")))
+		return -1;
+
+	if (fscanf(theFile, "%d", &value) != 1)
+		value = -1;
+
+	fclose(theFile);
+	return value;
+}
+
+static bool WriteSysfsInt(const char *path, int value)
+{
+	FILE	*theFile;
+	bool	ok;
+
+	if (!(theFile = fopen(path, "w")))
+		return false;
+
+	ok = (fprintf(theFile, "%d\n", value) > 0);
+	return (fclose(theFile) == 0) && ok;
+}
+
+// Return true if the tty is a USB-serial adapter (usb-serial drivers such
+// as ftdi_sio, or cdc_acm): its sysfs device sits on the usb-serial or usb
+// bus. Built-in UARTs are left as they are.
+
+static bool IsUsbSerial(const struct stat *st)
+{
+	char	path[128], bus[128], *name;
+	int	size;
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/subsystem", major(st->st_rdev), minor(st->st_rdev));
+
+	if ((size = readlink(path, bus, sizeof(bus) - 1)) <= 0)
+		return false;
+
+	bus[size] = '\0';
+	name = strrchr(bus, '/') ? strrchr(bus, '/') + 1 : bus;
+	return !strcmp(name, "usb-serial") || !strcmp(name, "usb");
+}
+
+static void SetLowLatency(int theDevice, TTY_STATE *tty)
+{
+	struct serial_struct	serial;
+	struct stat				st;
+
+	if (fstat(theDevice, &st) != 0 || !S_ISCHR(st.st_mode) || !IsUsbSerial(&st))
+		return;
+
+	if (ioctl(theDevice, TIOCGSERIAL, &serial) == 0 && !(serial.flags & ASYNC_LOW_LATENCY))
+	{
+		tty->oldSerialFlags = serial.flags;
+		serial.flags |= ASYNC_LOW_LATENCY;
+
+		if (ioctl(theDevice, TIOCSSERIAL, &serial) != 0)
+			tty->oldSerialFlags = -1;
+	}
+
+	snprintf(tty->latencyPath, sizeof(tty->latencyPath), "/sys/dev/char/%u:%u/device/latency_timer",
+		major(st.st_rdev), minor(st.st_rdev));
+
+	if ((tty->latency = ReadSysfsInt(tty->latencyPath)) > LOW_LATENCY_MS &&
+		WriteSysfsInt(tty->latencyPath, LOW_LATENCY_MS))
+	{
+		tty->oldLatency = tty->latency;
+		tty->latency = ReadSysfsInt(tty->latencyPath);
+	}
+}
+
+static void RestoreLatency(int theDevice, TTY_STATE *tty)
+{
+	struct serial_struct	serial;
+
+	if (tty->oldSerialFlags != -1 && ioctl(theDevice, TIOCGSERIAL, &serial) == 0)
+	{
+		serial.flags = tty->oldSerialFlags;
+		ioctl(theDevice, TIOCSSERIAL, &serial);
+	}
+
+	if (tty->oldLatency != -1)
+		WriteSysfsInt(tty->latencyPath, tty->oldLatency);
+}
+#endif
+
 // See if there is unread data waiting on theDevice.
 // This is used to poll theDevice without reading any characters
 // from it.
@@ -60,18 +295,20 @@ extern bool	suppressWrite;
 bool ByteWaiting(int theDevice, unsigned int timeOut)
 {
 #ifndef WIN32
-	fd_set	readSet;
-	struct timeval	timeVal;
+	RX_PORT	*port;
+	LINK		link;
 
-	FD_ZERO(&readSet);						// clear the set
-	FD_SET(theDevice, &readSet);			// add this descriptor to the set
-	timeVal.tv_sec = timeOut / 1000000;	// set up the timeout waiting for one to come ready
-	timeVal.tv_usec = timeOut % 1000000;
+	if ((port = GetRxPort(theDevice, false)))
+	{
+		if (port->head != port->tail)
+			return(true);						// already have some in the ring
 
-	if (select(FD_SETSIZE, &readSet, NULL, NULL, &timeVal) == 1)	// if our descriptor is ready, then report it
-		return(true);
+		port->stats.readSyscalls++;
+		return(port->link.transport->wait(&port->link, timeOut));
+	}
 
-	return(false);
+	link.theDevice = theDevice;
+	return(FdWait(&link, timeOut));
 #else
 	COMSTAT comState;
 	DWORD errors;
@@ -81,6 +318,20 @@ bool ByteWaiting(int theDevice, unsigned int timeOut)
 #endif
 }
 
+// Return the number of received bytes already held in memory for theDevice
+// (a ReadBytes call for them will not have to wait for the device).
+unsigned int BytesBuffered(int theDevice)
+{
+#ifndef WIN32
+	RX_PORT	*port;
+
+	if ((port = GetRxPort(theDevice, false)))
+		return(port->head - port->tail);
+#endif
+
+	return(0);
+}
+
 // Attempt to read at least one byte from theDevice before timeOut.
 // once any byte is seen, attempt to get any more which are pending
 // up to maxBytes
@@ -89,9 +340,10 @@ unsigned int ReadBytes(int theDevice, unsigned char *theBytes, unsigned int maxB
 {
 #ifndef WIN32
 	unsigned int	i, numRead = 0;
+	RX_PORT			*port;
 #else
 	HANDLE			hCom = (HANDLE) theDevice;
-	DWORD				numRead, i;
+	DWORD				numRead;
 	COMMTIMEOUTS	cto;
 #endif
 
@@ -102,34 +354,33 @@ unsigned int ReadBytes(int theDevice, unsigned char *theBytes, unsigned int maxB
 	SetCommTimeouts(hCom, &cto);
 	ReadFile(hCom, theBytes, maxBytes, &numRead, NULL);
 #else
+	if (!(port = GetRxPort(theDevice, true)))
+		return(0);
+
+	port->stats.readCalls++;
+
+	if (port->head != port->tail)				// served from the ring, no system calls needed
+		port->stats.syscallsAvoided += 2;
+
 	if (ByteWaiting(theDevice, timeOut))
 	{
-		numRead = read(theDevice, theBytes, maxBytes);
+		if (port->head == port->tail && FillRxRing(port) < 0)
+			return((unsigned int) -1);
+
+		numRead = port->head - port->tail;
+
+		if (numRead > maxBytes)
+			numRead = maxBytes;
+
+		for (i=0; i<numRead; i++)
+			theBytes[i] = port->ring[(port->tail + i) & (RX_RING_SIZE - 1)];
+
+		port->tail += numRead;
 #endif
 		if (numRead > 0)		// get waiting bytes
 		{
 			if (comm_debug)
-			{
-				for (i=0; i<numRead; i++)
-				{
-					fprintf(comm_debug, " I-0x%02x", theBytes[i]);
-
-					if (sendCommand)
-					{
-						fprintf(comm_debug, "\n");
-						sendCommand = false;
-						comm_debug_count = 0;
-					}
-					else
-						comm_debug_count++;
-
-					if (comm_debug_count >= 8)
-					{
-						comm_debug_count = 0;
-						fprintf(comm_debug, "\n");
-					}
-				}
-			}
+				TraceBytes(theDevice, TRACE_IN, theBytes, numRead);
 		}
 #ifndef WIN32
 		else
@@ -144,48 +395,43 @@ unsigned int ReadBytes(int theDevice, unsigned char *theBytes, unsigned int maxB
 void WriteBytes(int theDevice, unsigned char *theBytes, unsigned int numBytes)
 {
 #ifndef WIN32
-	unsigned int	i;
+	RX_PORT	*port;
 
 	if (!suppressWrite)
-		write(theDevice, theBytes, numBytes);
+	{
+		if ((port = GetRxPort(theDevice, false)))
+			port->link.transport->write(&port->link, theBytes, numBytes);
+		else
+			write(theDevice, theBytes, numBytes);
+	}
 #else
-	DWORD				ret;
-	unsigned int	i;
+	DWORD	ret;
 
 	if (!suppressWrite)
 		WriteFile((HANDLE) theDevice, theBytes, numBytes, &ret, NULL );
 #endif
 
 	if (comm_debug)
-	{
-		for (i=0; i<numBytes; i++)
-		{
-			fprintf(comm_debug, " O-0x%02x", theBytes[i]);
-			comm_debug_count++;
-
-			if (comm_debug_count >= 8)
-			{
-				comm_debug_count = 0;
-				fprintf(comm_debug, "\n");
-			}
-		}
-/*
-		if (comm_debug_count)
-		{
-			comm_debug_count = 0;
-			fprintf(comm_debug, "\n");
-		}
-*/
-	}
+		TraceBytes(theDevice, TRACE_OUT, theBytes, numBytes);
 }
 
 // Flush any bytes that may be waiting at theDevice
 void FlushBytes(int theDevice)
 {
+#ifndef WIN32
+	RX_PORT	*port;
+
+	if ((port = GetRxPort(theDevice, false)))
+		port->tail = port->head;				// forget anything already received
+#endif
+
 	if (!suppressWrite)
 	{
 #ifndef WIN32
-		tcflush(theDevice, TCIOFLUSH);								// flush the input stream
+		if (port)
+			port->link.transport->flush(&port->link);
+		else
+			tcflush(theDevice, TCIOFLUSH);							// flush the input stream
 #else
 		PurgeComm ((HANDLE) theDevice, PURGE_RXCLEAR | PURGE_RXABORT);
 		PurgeComm ((HANDLE) theDevice, PURGE_TXCLEAR | PURGE_TXABORT);
@@ -236,6 +482,9 @@ bool ConfigureDevice(int theDevice, unsigned int baudRate, unsigned char dataBit
 #endif
 
 #ifndef WIN32
+	if (!IsTerminal(theDevice))						// nothing to set up on a network link or replay
+		return(true);
+
 	tcflush(theDevice, TCIOFLUSH);					// flush any unwritten, unread data
 #else
 	GetCommState((HANDLE) theDevice, &dcb);
@@ -426,6 +675,15 @@ void GetDeviceConfiguration(int theDevice, unsigned int *baudRate, unsigned char
 #ifndef WIN32
 	struct termios	terminalParams;
 
+	if (!IsTerminal(theDevice))
+	{
+		*baudRate = 0;										// no line speed, it isn't a serial line
+		*dataBits = 8;
+		*stopBits = 1;
+		*parity = 0;
+		return;
+	}
+
 	if (tcgetattr(theDevice, &terminalParams) != -1)	// read the old value
 	{
 		switch (cfgetospeed(&terminalParams))
@@ -537,6 +795,9 @@ bool ConfigureFlowControl(int theDevice, bool wantControl)
 #ifndef WIN32
 	struct termios	terminalParams;
 
+	if (!IsTerminal(theDevice))
+		return(true);
+
 	if (tcgetattr(theDevice, &terminalParams) != -1)	// read the old value
 	{
 		if (wantControl)
@@ -579,17 +840,20 @@ bool ConfigureFlowControl(int theDevice, bool wantControl)
 void GetDeviceStatus(int theDevice, bool *CTS, bool *DCD)
 {
 #ifndef WIN32
-	int	status;
+	RX_PORT	*port;
+	LINK		link;
 
-	*CTS = *DCD = false;
-
-	if (ioctl(theDevice, TIOCMGET, &status) != -1)
+	if ((port = GetRxPort(theDevice, false)))
 	{
-		if (status & TIOCM_CTS)
-			*CTS = true;
-
-		if(status & TIOCM_CAR)
-			*DCD = true;
+		if (port->link.transport->getLines)
+			port->link.transport->getLines(&port->link, CTS, DCD);
+		else
+			*CTS = *DCD = true;				// no modem lines, always ready
+	}
+	else
+	{
+		link.theDevice = theDevice;
+		ttyTransport.getLines(&link, CTS, DCD);
 	}
 #else
 	DWORD modemStat;
@@ -600,18 +864,71 @@ void GetDeviceStatus(int theDevice, bool *CTS, bool *DCD)
 #endif
 }
 
+// Wait up to timeOut microseconds for CTS to be asserted on theDevice.
+// The modem lines are read every millisecond (TIOCMGET), and the wait is
+// bounded by the clock rather than by counting sleeps, which can run long.
+// No signals or interval timers are used; those belong to the whole
+// process.
+// Return true if CTS came on in time.
+bool WaitForCTS(int theDevice, unsigned int timeOut)
+{
+	bool		CTS, DCD;
+#ifndef WIN32
+	struct timeval		start, now;
+	unsigned int		elapsed;
+	RX_PORT				*port;
+
+	GetDeviceStatus(theDevice, &CTS, &DCD);
+
+	if (CTS || ((port = GetRxPort(theDevice, false)) && port->link.transport != &ttyTransport))
+		return(CTS);							// only a real serial port has lines to wait on
+
+	gettimeofday(&start, NULL);
+	elapsed = 0;
+
+	while (!CTS && elapsed < timeOut)
+	{
+		poll(NULL, 0, 1);							// wait 1 ms (more or less), look again
+		GetDeviceStatus(theDevice, &CTS, &DCD);
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+	}
+
+	return(CTS);
+#else
+	unsigned int	tries;
+
+	for (tries = timeOut / 1000; ; tries--)
+	{
+		GetDeviceStatus(theDevice, &CTS, &DCD);
+
+		if (CTS || !tries)
+			break;
+
+		usleep(1000);								// wait 1 ms (more or less), try again
+	}
+
+	return(CTS);
+#endif
+}
+
 // Set the state of the DTR handshake line
 void SetDTR(int theDevice, bool DTR)
 {
 #ifndef WIN32
-	int	control;
+	RX_PORT	*port;
+	LINK		link;
 
-	control = TIOCM_DTR;
-
-	if (DTR)
-		ioctl(theDevice, TIOCMBIS, &control);
+	if ((port = GetRxPort(theDevice, false)))
+	{
+		if (port->link.transport->setDTR)
+			port->link.transport->setDTR(&port->link, DTR);
+	}
 	else
-		ioctl(theDevice, TIOCMBIC, &control);
+	{
+		link.theDevice = theDevice;
+		ttyTransport.setDTR(&link, DTR);
+	}
 #else
 	DCB dcb;
 
@@ -627,7 +944,111 @@ void SetDTR(int theDevice, bool DTR)
 }
 
 #ifndef WIN32
-static struct termios oldTerminalParams;
+// The tty and pty transports
+
+static bool OpenTerminal(LINK *link, const char *name)
+{
+	TTY_STATE	*tty;
+
+	if (!(tty = (TTY_STATE *) calloc(1, sizeof(TTY_STATE))))
+		return(false);
+
+	tty->oldSerialFlags = -1;					// nothing to restore yet
+	tty->oldLatency = -1;
+	tty->latency = -1;
+
+	// NOTE: the NOCTTY will prevent us from grabbing this terminal as our
+	// controlling terminal (when run from init, we have no controlling
+	// terminal, and we do not want this device to become one!)
+	if ((link->theDevice = open(name, O_NDELAY | O_RDWR | O_NOCTTY)) != -1)
+	{
+		// attempt to read configuration, to verify this is a serial device
+		// and to save settings
+		if (tcgetattr(link->theDevice, &tty->oldTerminalParams) != -1)
+		{
+			link->state = tty;
+			return(true);
+		}
+
+		close(link->theDevice);
+	}
+
+	free(tty);
+	return(false);
+}
+
+static bool TtyOpen(LINK *link, const char *name)
+{
+	if (!OpenTerminal(link, name))
+		return(false);
+
+#ifdef __linux__
+	SetLowLatency(link->theDevice, (TTY_STATE *) link->state);
+#endif
+	return(true);
+}
+
+static void TtyFlush(LINK *link)
+{
+	tcflush(link->theDevice, TCIOFLUSH);
+}
+
+static void TtyGetLines(LINK *link, bool *CTS, bool *DCD)
+{
+	int	status;
+
+	*CTS = *DCD = false;
+
+	if (ioctl(link->theDevice, TIOCMGET, &status) != -1)
+	{
+		if (status & TIOCM_CTS)
+			*CTS = true;
+
+		if(status & TIOCM_CAR)
+			*DCD = true;
+	}
+}
+
+static void TtySetDTR(LINK *link, bool DTR)
+{
+	int	control;
+
+	control = TIOCM_DTR;
+
+	if (DTR)
+		ioctl(link->theDevice, TIOCMBIS, &control);
+	else
+		ioctl(link->theDevice, TIOCMBIC, &control);
+}
+
+// try to set the parameters back as they were, don't care if we fail
+static void TtyClose(LINK *link)
+{
+	TTY_STATE	*tty = (TTY_STATE *) link->state;
+
+	if (tty)
+	{
+#ifdef __linux__
+		RestoreLatency(link->theDevice, tty);
+#endif
+		tcsetattr(link->theDevice, TCSANOW, &tty->oldTerminalParams);
+		free(tty);
+	}
+
+	close(link->theDevice);
+}
+
+const TRANSPORT ttyTransport =
+{
+	NULL, true, TtyOpen, FdRead, FdWait, FdWrite, TtyFlush, TtyGetLines, TtySetDTR, TtyClose
+};
+
+// A pseudo-terminal has no modem lines: CTS is always on and DTR does nothing.
+
+const TRANSPORT ptyTransport =
+{
+	"pty:", true, OpenTerminal, FdRead, FdWait, FdWrite, TtyFlush, NULL, NULL, TtyClose
+};
 #else
 static DCB				oldDcb;
 static COMMTIMEOUTS	oldCto;
@@ -643,20 +1064,25 @@ static COMMTIMEOUTS	oldCto;
 bool OpenDevice(char *theName, int *theDevice)
 {
 #ifndef WIN32
-	// NOTE: the NOCTTY will prevent us from grabbing this terminal as our
-	// controlling terminal (when run from init, we have no controlling
-	// terminal, and we do not want this device to become one!)
-	if ((*theDevice = open(theName, O_NDELAY | O_RDWR | O_NOCTTY)) != -1)
-	{
-		// attempt to read configuration, to verify this is a serial device
-		// and to save settings
-		if (tcgetattr(*theDevice, &oldTerminalParams) != -1)
-			return(true);
+	RX_PORT		*port;
+	LINK			link;
+	const char	*path;
+
+	memset(&link, 0, sizeof(link));
+	link.transport = FindTransport(theName, &path);
+
+	if (!link.transport->open(&link, path))
+		return(false);
 
-		close(*theDevice);
+	if (!(port = GetRxPort(link.theDevice, true)))	// set up its receive ring
+	{
+		link.transport->close(&link);
+		return(false);
 	}
 
-	return(false);
+	port->link = link;
+	*theDevice = link.theDevice;
+	return(true);
 #else
 	HANDLE hCom;
 	DCB dcb;
@@ -717,8 +1143,15 @@ void CloseDevice(int theDevice)
 {
 	// try to set the parameters back as they were, don't care if we fail
 #ifndef WIN32
-	tcsetattr(theDevice, TCSANOW, &oldTerminalParams);
-	close(theDevice);
+	RX_PORT	*port;
+
+	if ((port = GetRxPort(theDevice, false)))
+	{
+		port->link.transport->close(&port->link);
+		FreeRxPort(port);
+	}
+	else
+		close(theDevice);
 #else
 	SetCommTimeouts((HANDLE) theDevice, &oldCto);
 	SetCommState((HANDLE) theDevice, &oldDcb);
@@ -726,3 +1159,68 @@ void CloseDevice(int theDevice)
 #endif
 }
 
+
+// Return the receive statistics for theDevice
+// Return false if there are none (device not open, or no receive ring)
+bool GetSerialStats(int theDevice, SERIAL_STATS *stats)
+{
+#ifndef WIN32
+	RX_PORT	*port;
+
+	if ((port = GetRxPort(theDevice, false)))
+	{
+		*stats = port->stats;
+		return(true);
+	}
+#endif
+
+	return(false);
+}
+
+// Return the USB-serial latency timer (in ms) in effect for theDevice,
+// or -1 if the device doesn't have one. *lowLatency is set if the driver
+// has been asked for low latency.
+int GetDeviceLatency(int theDevice, bool *lowLatency)
+{
+#ifdef __linux__
+	RX_PORT						*port;
+	struct serial_struct	serial;
+
+	*lowLatency = (ioctl(theDevice, TIOCGSERIAL, &serial) == 0 && (serial.flags & ASYNC_LOW_LATENCY));
+
+	if ((port = GetRxPort(theDevice, false)) && port->link.transport == &ttyTransport && port->link.state)
+		return(((TTY_STATE *) port->link.state)->latency);
+#else
+	*lowLatency = false;
+#endif
+
+	return(-1);
+}
+
+// Return true if theDevice is a picp agent (agent:host:port), which can run
+// whole operations for us with RemoteCall.
+bool IsRemote(int theDevice)
+{
+#ifndef WIN32
+	RX_PORT	*port;
+
+	return((port = GetRxPort(theDevice, false)) && port->link.transport == &agentTransport);
+#else
+	return(false);
+#endif
+}
+
+// Have the agent at theDevice carry out a request (see agent.h) and return
+// its result in reply. Return false if it isn't an agent or doesn't answer.
+bool RemoteCall(int theDevice, unsigned char type, const unsigned char *request, unsigned int requestBytes,
+	unsigned char *reply, unsigned int replyBytes, void (*progress)(unsigned int))
+{
+#ifndef WIN32
+	RX_PORT	*port;
+
+	if ((port = GetRxPort(theDevice, false)) && port->link.transport == &agentTransport)
+		return(AgentCall(&port->link, type, request, requestBytes, reply, replyBytes, progress));
+#endif
+
+	return(false);
+}
@@ -21,7 +21,18 @@
 #define	bool	int
 #endif
 
+// Receive statistics, see GetSerialStats()
+
+typedef struct
+{
+	unsigned long	readCalls;			// number of ReadBytes calls
+	unsigned long	readSyscalls;		// select() and read() calls actually made
+	unsigned long	syscallsAvoided;	// calls saved by serving ReadBytes from the receive ring
+	unsigned long	bytesRead;			// bytes received from the device
+} SERIAL_STATS;
+
 bool	ByteWaiting(int theDevice, unsigned int timeOut);
+unsigned int	BytesBuffered(int theDevice);
 unsigned int	ReadBytes(int theDevice, unsigned char *theBytes, unsigned int maxBytes, unsigned int timeOut);
 void	WriteBytes(int theDevice, unsigned char *theBytes, unsigned int numBytes);
 void	FlushBytes(int theDevice);
@@ -29,9 +40,15 @@ bool	ConfigureDevice(int theDevice, unsigned int baudRate, unsigned char dataBit
 void	GetDeviceConfiguration(int theDevice, unsigned int *baudRate, unsigned char *dataBits, unsigned char *stopBits, unsigned char *parity);
 bool	ConfigureFlowControl(int theDevice, bool wantControl);
 void	GetDeviceStatus(int theDevice,bool *CTS,bool *DCD);
+bool	WaitForCTS(int theDevice, unsigned int timeOut);
 void	SetDTR(int theDevice, bool DTR);
 bool	OpenDevice(char *theName, int *theDevice);
 void	CloseDevice(int theDevice);
+bool	GetSerialStats(int theDevice, SERIAL_STATS *stats);
+int	GetDeviceLatency(int theDevice, bool *lowLatency);
+bool	IsRemote(int theDevice);
+bool	RemoteCall(int theDevice, unsigned char type, const unsigned char *request, unsigned int requestBytes,
+			unsigned char *reply, unsigned int replyBytes, void (*progress)(unsigned int));
 
 #endif // defined __SERIAL_H_
 
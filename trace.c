@@ -0,0 +1,408 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+//
+//	This program is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU General Public License
+//	as published by the Free Software Foundation; either version 2
+//	of the License, or (at your option) any later version.
+//
+//	This program is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with this program; if not, write to the Free Software
+//	Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+//
+//-----------------------------------------------------------------------------
+
+// trace.c
+// The comm debug trace, see trace.h.
+//
+// The ring is a bounded queue of TRACE_RING_SIZE slots, each carrying a
+// sequence number. A producer claims the slot at traceHead by advancing
+// traceHead with compare-and-swap (so any number of ports or threads may
+// add records), fills it, then publishes it by setting its sequence to
+// one past its position. The writer takes slots in order once they are
+// published and hands them back by setting the sequence one lap ahead.
+// If the writer falls a whole lap behind, records are counted as lost
+// rather than making the link wait.
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<stdarg.h>
+#include	<time.h>
+#include	<sys/time.h>
+
+#ifdef WIN32
+#include	<windows.h>
+#define	false	FALSE
+#define	true	TRUE
+#else
+#include	<pthread.h>
+#include	<unistd.h>
+#endif
+
+#include	"trace.h"
+
+#define TRACE_RING_SIZE		4096		// records held in memory (a power of 2)
+#define TRACE_INTERVAL		20000		// the writer looks at the ring this often (in microseconds)
+#define TRACE_NOTE_MAX		512		// longest note TracePrintf will record
+#define TRACE_RECORD_HEADER	12			// type, context, length, port, time
+
+typedef struct
+{
+	unsigned int			sequence;			// position this slot is ready for (see above)
+	unsigned char			type;					// TRACE_xxx
+	unsigned char			context;				// command in progress when it was recorded
+	unsigned char			length;				// bytes used in data[]
+	unsigned char			port;					// device the bytes went to or came from
+	unsigned long long	time;					// microseconds since TraceStart
+	unsigned char			data[TRACE_RUN];
+} TRACE_SLOT;
+
+static TRACE_SLOT				traceRing[TRACE_RING_SIZE];
+static unsigned int			traceHead;			// next slot to fill
+static unsigned int			traceTail;			// next slot to write out (only the writer touches it)
+static unsigned int			traceLost;			// records dropped since the writer last looked
+static unsigned char			traceContext;		// command in progress
+static unsigned long long	traceStartTime;
+static FILE						*traceFile;			// NULL when not tracing
+static volatile bool			traceStopping;
+
+#ifndef WIN32
+static pthread_t				traceWriter;
+#endif
+
+//-----------------------------------------------------------------------------
+// microseconds since some fixed point
+
+static unsigned long long TraceClock()
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void PutLittle(unsigned char *theBytes, unsigned long long value, int numBytes)
+{
+	int	i;
+
+	for (i=0; i<numBytes; i++)
+		theBytes[i] = (value >> (i * 8)) & 0xff;
+}
+
+static unsigned long long GetLittle(const unsigned char *theBytes, int numBytes)
+{
+	unsigned long long	value;
+	int						i;
+
+	value = 0;
+
+	for (i=numBytes - 1; i>=0; i--)
+		value = (value << 8) | theBytes[i];
+
+	return value;
+}
+
+//-----------------------------------------------------------------------------
+// add one record to the ring (may be called from any thread)
+
+static void TraceAdd(unsigned char type, int port, const unsigned char *theBytes, unsigned int numBytes)
+{
+	TRACE_SLOT		*slot;
+	unsigned int	pos, seq;
+
+	pos = __atomic_load_n(&traceHead, __ATOMIC_RELAXED);
+
+	while (true)
+	{
+		slot = &traceRing[pos & (TRACE_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+		if (seq == pos)				// free, try to claim it
+		{
+			if (__atomic_compare_exchange_n(&traceHead, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((int) (seq - pos) < 0)	// the writer hasn't got this far, the ring is full
+		{
+			__atomic_fetch_add(&traceLost, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else							// someone else claimed it first
+			pos = __atomic_load_n(&traceHead, __ATOMIC_RELAXED);
+	}
+
+	slot->type = type;
+	slot->context = __atomic_load_n(&traceContext, __ATOMIC_RELAXED);
+	slot->length = numBytes;
+	slot->port = port & 0xff;
+	slot->time = TraceClock() - traceStartTime;
+	memcpy(slot->data, theBytes, numBytes);
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+//-----------------------------------------------------------------------------
+// write out everything published so far (only ever one writer at a time)
+
+static void TraceDrain()
+{
+	TRACE_SLOT		*slot;
+	unsigned char	record[TRACE_RECORD_HEADER + TRACE_RUN];
+	unsigned int	lost;
+
+	while (true)
+	{
+		slot = &traceRing[traceTail & (TRACE_RING_SIZE - 1)];
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != traceTail + 1)
+			break;							// not published yet
+
+		record[0] = slot->type;
+		record[1] = slot->context;
+		record[2] = slot->length;
+		record[3] = slot->port;
+		PutLittle(&record[4], slot->time, 8);
+		memcpy(&record[TRACE_RECORD_HEADER], slot->data, slot->length);
+		fwrite(record, TRACE_RECORD_HEADER + slot->length, 1, traceFile);
+		__atomic_store_n(&slot->sequence, traceTail + TRACE_RING_SIZE, __ATOMIC_RELEASE);
+		traceTail++;
+	}
+
+	if ((lost = __atomic_exchange_n(&traceLost, 0, __ATOMIC_RELAXED)))
+	{
+		record[0] = TRACE_LOST;
+		record[1] = 0;
+		record[2] = 4;
+		record[3] = 0;
+		PutLittle(&record[4], TraceClock() - traceStartTime, 8);
+		PutLittle(&record[TRACE_RECORD_HEADER], lost, 4);
+		fwrite(record, TRACE_RECORD_HEADER + 4, 1, traceFile);
+	}
+
+	fflush(traceFile);
+}
+
+#ifndef WIN32
+static void *TraceWriter(void *arg)
+{
+	while (!traceStopping)
+	{
+		TraceDrain();
+		usleep(TRACE_INTERVAL);
+	}
+
+	TraceDrain();
+	return NULL;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// start tracing to theFile (opened for binary writing), return false if
+// the writer can't be started
+
+bool TraceStart(FILE *theFile)
+{
+	unsigned char	header[TRACE_MAGIC_SIZE + 8];
+	unsigned int	i;
+
+	if (traceFile)
+		return false;
+
+	for (i=0; i<TRACE_RING_SIZE; i++)
+		traceRing[i].sequence = i;
+
+	traceHead = traceTail = traceLost = 0;
+	traceStartTime = TraceClock();
+	memcpy(header, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+	PutLittle(&header[TRACE_MAGIC_SIZE], time(NULL), 8);
+
+	if (fwrite(header, sizeof(header), 1, theFile) != 1)
+		return false;
+
+	traceStopping = false;
+	traceFile = theFile;
+
+#ifndef WIN32
+	if (pthread_create(&traceWriter, NULL, TraceWriter, NULL) != 0)
+	{
+		traceFile = NULL;
+		return false;
+	}
+#endif
+
+	atexit(TraceStop);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// write out what's left and stop tracing (the file is left open)
+
+void TraceStop()
+{
+	if (!traceFile)
+		return;
+
+	traceStopping = true;
+
+#ifndef WIN32
+	pthread_join(traceWriter, NULL);
+#else
+	TraceDrain();
+#endif
+
+	traceFile = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// note the command being carried out, it goes into every record until
+// the next one
+
+void TraceContext(unsigned char context)
+{
+	__atomic_store_n(&traceContext, context, __ATOMIC_RELAXED);
+}
+
+//-----------------------------------------------------------------------------
+// record bytes sent (TRACE_OUT) or received (TRACE_IN)
+
+void TraceBytes(int port, unsigned char type, const unsigned char *theBytes, unsigned int numBytes)
+{
+	unsigned int	run;
+
+	if (!traceFile)
+		return;
+
+	while (numBytes)
+	{
+		run = (numBytes > TRACE_RUN) ? TRACE_RUN : numBytes;
+		TraceAdd(type, port, theBytes, run);
+		theBytes += run;
+		numBytes -= run;
+	}
+
+#ifdef WIN32
+	if (traceHead - traceTail >= TRACE_RING_SIZE / 2)	// no writer thread, so keep up here
+		TraceDrain();
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// record a note, printf style
+
+void TracePrintf(const char *format, ...)
+{
+	va_list	args;
+	char		note[TRACE_NOTE_MAX];
+	int		length;
+
+	if (!traceFile)
+		return;
+
+	va_start(args, format);
+	length = vsnprintf(note, sizeof(note), format, args);
+	va_end(args);
+
+	if (length >= (int) sizeof(note))
+		length = sizeof(note) - 1;
+
+	if (length > 0)
+		TraceBytes(0, TRACE_NOTE, (unsigned char *) note, length);
+}
+
+//-----------------------------------------------------------------------------
+// turn a trace file back into text. Without showTimes it's the picpcomm.log
+// format: notes as written, bytes as O-0xnn (sent) and I-0xnn (received),
+// eight to a line. With showTimes, each run of bytes gets its own line
+// with the time (seconds since the session started), the port and the
+// command in progress.
+// Return false if in isn't a trace file
+
+bool TraceDecode(FILE *in, FILE *out, bool showTimes)
+{
+	unsigned char			record[TRACE_RECORD_HEADER + 255];
+	unsigned long long	when;
+	unsigned int			i, count;
+	bool						started, lineStart;
+
+	count = 0;
+	started = false;
+	lineStart = true;
+
+	while (fread(record, 1, TRACE_MAGIC_SIZE, in) == TRACE_MAGIC_SIZE)
+	{
+		if (!memcmp(record, TRACE_MAGIC, TRACE_MAGIC_SIZE))
+		{
+			if (fread(record, 1, 8, in) != 8)				// time the session was opened
+				break;
+
+			started = true;
+			continue;
+		}
+
+		if (!started || fread(&record[TRACE_MAGIC_SIZE], 1, TRACE_RECORD_HEADER - TRACE_MAGIC_SIZE, in) !=
+			TRACE_RECORD_HEADER - TRACE_MAGIC_SIZE || fread(&record[TRACE_RECORD_HEADER], 1, record[2], in) != record[2])
+			break;
+
+		when = GetLittle(&record[4], 8);
+
+		switch (record[0])
+		{
+			case TRACE_NOTE:
+				fwrite(&record[TRACE_RECORD_HEADER], 1, record[2], out);
+				lineStart = (record[2] && record[TRACE_RECORD_HEADER + record[2] - 1] == '\n');
+				count = 0;
+				break;
+
+			case TRACE_LOST:
+				fprintf(out, "\n[%u trace records lost]\n", (unsigned int) GetLittle(&record[TRACE_RECORD_HEADER], 4));
+				lineStart = true;
+				count = 0;
+				break;
+
+			case TRACE_OUT:
+			case TRACE_IN:
+				if (showTimes)
+				{
+					fprintf(out, "%s%llu.%06llu port %u cmd 0x%02x:", lineStart ? "" : "\n", when / 1000000, when % 1000000, record[3], record[1]);
+					count = 0;
+				}
+
+				for (i=0; i<record[2]; i++)
+				{
+					fprintf(out, " %c-0x%02x", (record[0] == TRACE_OUT) ? 'O' : 'I', record[TRACE_RECORD_HEADER + i]);
+
+					if (!showTimes && ++count >= 8)
+					{
+						fprintf(out, "\n");
+						count = 0;
+					}
+				}
+
+				lineStart = (!showTimes && !count);
+				break;
+		}
+	}
+
+	if (!lineStart)
+		fprintf(out, "\n");
+
+	return started;
+}
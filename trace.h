@@ -0,0 +1,57 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdio.h>
+
+#ifdef WIN32
+#define	bool	int
+#endif
+
+// The comm debug trace (-c). Bytes sent and received, and the notes picp
+// makes about what it is doing, go into a ring of fixed size records in
+// memory; a background thread writes them to the trace file. Adding a
+// record never blocks and never takes a lock, so the trace can be left on
+// without changing the timing of the link. picptrace (or TraceDecode)
+// turns the file back into the picpcomm.log text format.
+//
+// File format: each session starts with TRACE_MAGIC and the time it was
+// opened (8 bytes, seconds since 1970), followed by records of
+//		type, context, length, port (1 byte each)
+//		time (8 bytes, microseconds since the session started)
+//		length bytes of data
+// Multi-byte values are least significant byte first.
+
+#define TRACE_MAGIC			"PICPTRC1"
+#define TRACE_MAGIC_SIZE	8
+
+#define TRACE_OUT				0x01		// bytes sent to the programmer
+#define TRACE_IN				0x02		// bytes received from it
+#define TRACE_NOTE			0x03		// text (part of a note, the rest follows in the next records)
+#define TRACE_LOST			0x04		// records dropped because the ring was full (4 byte count)
+
+#define TRACE_RUN				20			// data bytes per record, longer runs use several
+
+bool	TraceStart(FILE *theFile);
+void	TraceStop();
+void	TraceContext(unsigned char context);
+void	TraceBytes(int port, unsigned char type, const unsigned char *theBytes, unsigned int numBytes);
+void	TracePrintf(const char *format, ...);
+bool	TraceDecode(FILE *in, FILE *out, bool showTimes);
+
+#endif // defined __TRACE_H_
@@ -0,0 +1,440 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+//
+//	This program is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU General Public License
+//	as published by the Free Software Foundation; either version 2
+//	of the License, or (at your option) any later version.
+//
+//	This program is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with this program; if not, write to the Free Software
+//	Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+//
+//-----------------------------------------------------------------------------
+
+// transport.c
+// Transports that are not serial ports: a TCP connection (to a serial
+// bridge or a picp agent) and playback of a session recorded with -c.
+// The tty and pty transports live in serial.c.
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+
+#ifdef WIN32
+#include	<windows.h>
+#define	false	FALSE
+#define	true	TRUE
+#define	bool	int
+#else
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<netinet/in.h>
+#include	<netinet/tcp.h>
+#include	<netdb.h>
+#include	<sys/uio.h>
+#include	<poll.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+
+#include	"transport.h"
+#include	"trace.h"
+
+#define MAX_HOST_NAME	256				// longest host name accepted in tcp:host:port
+#define WRITE_WAIT		1000				// longest wait for room to write (in milliseconds)
+
+//-----------------------------------------------------------------------------
+// the pieces shared by every transport built on an ordinary descriptor
+
+// read whatever is waiting, return 0 if nothing is, -1 on error
+int FdRead(LINK *link, struct iovec *iov, int count)
+{
+	int	numRead;
+
+	numRead = readv(link->theDevice, iov, count);
+
+	if (numRead < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+	return numRead;
+}
+
+// wait up to timeOut microseconds for something to read
+bool FdWait(LINK *link, unsigned int timeOut)
+{
+	struct pollfd	pollDevice;
+
+	pollDevice.fd = link->theDevice;			// poll() has no limit on descriptor numbers (select does)
+	pollDevice.events = POLLIN;
+	pollDevice.revents = 0;
+
+	return (poll(&pollDevice, 1, (timeOut + 999) / 1000) == 1 && (pollDevice.revents & (POLLIN | POLLHUP | POLLERR)));
+}
+
+// write all of theBytes, waiting for room whenever the descriptor (opened
+// non-blocking) is full, return numBytes or -1 on error or if no room
+// turns up within WRITE_WAIT
+int FdWrite(LINK *link, const unsigned char *theBytes, unsigned int numBytes)
+{
+	struct pollfd	pollDevice;
+	unsigned int	sent;
+	int				numSent;
+
+	for (sent = 0; sent < numBytes; )
+	{
+		if ((numSent = write(link->theDevice, theBytes + sent, numBytes - sent)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN)
+				return -1;
+
+			pollDevice.fd = link->theDevice;
+			pollDevice.events = POLLOUT;
+			pollDevice.revents = 0;
+
+			if (poll(&pollDevice, 1, WRITE_WAIT) != 1)
+			{
+				errno = ETIMEDOUT;
+				return -1;
+			}
+
+			continue;
+		}
+
+		sent += numSent;
+	}
+
+	return numBytes;
+}
+
+//-----------------------------------------------------------------------------
+// TCP: tcp:host:port
+// Modem lines don't exist here; CTS is always on and DTR is ignored.
+
+static bool TcpOpen(LINK *link, const char *name)
+{
+	struct addrinfo	hints, *addrs, *addr;
+	char					host[MAX_HOST_NAME];
+	const char			*port;
+	int					theSocket, on;
+
+	if (!(port = strrchr(name, ':')) || (size_t) (port - name) >= sizeof(host))
+	{
+		fprintf(stderr, "expected tcp:host:port, not tcp:%s\n", name);
+		return false;
+	}
+
+	memcpy(host, name, port - name);
+	host[port - name] = '\0';
+	port++;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host[0] ? host : "localhost", port, &hints, &addrs) != 0)
+	{
+		fprintf(stderr, "can't find host %s\n", host);
+		return false;
+	}
+
+	theSocket = -1;
+
+	for (addr = addrs; addr; addr = addr->ai_next)
+	{
+		if ((theSocket = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) == -1)
+			continue;
+
+		if (connect(theSocket, addr->ai_addr, addr->ai_addrlen) == 0)
+			break;
+
+		close(theSocket);
+		theSocket = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (theSocket == -1)
+		return false;
+
+	on = 1;
+	setsockopt(theSocket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));	// every byte counts, don't hold them back
+	fcntl(theSocket, F_SETFL, fcntl(theSocket, F_GETFL) | O_NONBLOCK);	// like a tty opened O_NDELAY
+	link->theDevice = theSocket;
+	return true;
+}
+
+// a closed connection reads as end of file, which is an error here
+static int TcpRead(LINK *link, struct iovec *iov, int count)
+{
+	int	numRead;
+
+	if ((numRead = readv(link->theDevice, iov, count)) == 0)
+	{
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	if (numRead < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+	return numRead;
+}
+
+static void TcpFlush(LINK *link)
+{
+	unsigned char	theBytes[256];
+
+	while (recv(link->theDevice, theBytes, sizeof(theBytes), MSG_DONTWAIT) > 0)
+		;
+}
+
+static void TcpClose(LINK *link)
+{
+	close(link->theDevice);
+}
+
+const TRANSPORT tcpTransport =
+{
+	"tcp:", false, TcpOpen, TcpRead, FdWait, FdWrite, TcpFlush, NULL, NULL, TcpClose
+};
+
+//-----------------------------------------------------------------------------
+// Replay: replay:picpcomm.trc
+// Plays back the last session in a comm debug trace (written with -c), or
+// in a picpcomm.log from an older picp. Each time picp writes, the bytes
+// must match the O-0xnn entries in the log; the I-0xnn entries that follow
+// are then handed back as the programmer's answer. Nothing waits in real
+// time, a timeout is reported at once.
+
+#define REPLAY_OUT	0
+#define REPLAY_IN		1
+
+typedef struct
+{
+	unsigned char	*dir;						// REPLAY_OUT or REPLAY_IN for each byte
+	unsigned char	*bytes;
+	unsigned int	count, size;			// bytes recorded, and room for them
+	unsigned int	pos;						// next byte to be sent or received
+	bool				diverged;				// picp sent something the recording didn't
+} REPLAY;
+
+static bool ReplayAdd(REPLAY *replay, unsigned char dir, unsigned char value)
+{
+	unsigned char	*newDir, *newBytes;
+
+	if (replay->count == replay->size)
+	{
+		replay->size = replay->size ? replay->size * 2 : 4096;
+		newDir = (unsigned char *) realloc(replay->dir, replay->size);
+		newBytes = (unsigned char *) realloc(replay->bytes, replay->size);
+
+		if (newDir)
+			replay->dir = newDir;
+
+		if (newBytes)
+			replay->bytes = newBytes;
+
+		if (!newDir || !newBytes)
+			return false;
+	}
+
+	replay->dir[replay->count] = dir;
+	replay->bytes[replay->count++] = value;
+	return true;
+}
+
+static void ReplayClose(LINK *link)
+{
+	REPLAY	*replay = (REPLAY *) link->state;
+
+	if (replay)
+	{
+		free(replay->dir);
+		free(replay->bytes);
+		free(replay);
+	}
+
+	close(link->theDevice);
+}
+
+static bool ReplayOpen(LINK *link, const char *name)
+{
+	FILE				*theFile, *text;
+	REPLAY			*replay;
+	char				line[512], *p;
+	unsigned int	value;
+	bool				ok;
+
+	if (!(theFile = fopen(name, "rb")))
+		return false;
+
+	if (fread(line, 1, TRACE_MAGIC_SIZE, theFile) == TRACE_MAGIC_SIZE && !memcmp(line, TRACE_MAGIC, TRACE_MAGIC_SIZE))
+	{
+		rewind(theFile);							// a picpcomm.trc, read it as text
+
+		if ((text = tmpfile()))
+		{
+			TraceDecode(theFile, text, false);
+			rewind(text);
+		}
+
+		fclose(theFile);
+
+		if (!(theFile = text))
+			return false;
+	}
+	else
+		rewind(theFile);
+
+	if (!(replay = (REPLAY *) calloc(1, sizeof(REPLAY))))
+	{
+		fclose(theFile);
+		return false;
+	}
+
+	ok = true;
+
+	while (ok && fgets(line, sizeof(line), theFile))
+	{
+		if (strstr(line, "comm debug file opened"))
+			replay->count = 0;					// only the last session in the file is used
+
+		for (p = line; ok && (p = strstr(p, "-0x")); p += 3)
+		{
+			if (p > line && (p[-1] == 'O' || p[-1] == 'I') && sscanf(p + 3, "%2x", &value) == 1)
+				ok = ReplayAdd(replay, (p[-1] == 'O') ? REPLAY_OUT : REPLAY_IN, value);
+		}
+	}
+
+	fclose(theFile);
+	link->state = replay;
+
+	// the descriptor only identifies the link, nothing is read from it
+	if (!ok || (link->theDevice = open(name, O_RDONLY)) == -1)
+	{
+		link->theDevice = -1;
+		ReplayClose(link);
+		return false;
+	}
+
+	return true;
+}
+
+static int ReplayRead(LINK *link, struct iovec *iov, int count)
+{
+	REPLAY			*replay = (REPLAY *) link->state;
+	int				i, numRead;
+	unsigned int	j;
+
+	numRead = 0;
+
+	for (i=0; i<count && !replay->diverged; i++)
+	{
+		for (j=0; j<iov[i].iov_len && replay->pos < replay->count && replay->dir[replay->pos] == REPLAY_IN; j++)
+			((unsigned char *) iov[i].iov_base)[j] = replay->bytes[replay->pos++];
+
+		numRead += j;
+
+		if (j < iov[i].iov_len)
+			break;
+	}
+
+	return numRead;
+}
+
+// there is no clock to wait on: input is there if the recording has it
+// next, and a wait the recording timed out on ends at once
+
+static bool ReplayWait(LINK *link, unsigned int timeOut)
+{
+	REPLAY	*replay = (REPLAY *) link->state;
+
+	return !replay->diverged && replay->pos < replay->count && replay->dir[replay->pos] == REPLAY_IN;
+}
+
+static int ReplayWrite(LINK *link, const unsigned char *theBytes, unsigned int numBytes)
+{
+	REPLAY			*replay = (REPLAY *) link->state;
+	unsigned int	i;
+
+	for (i=0; i<numBytes && !replay->diverged; i++)
+	{
+		if (replay->pos >= replay->count || replay->dir[replay->pos] != REPLAY_OUT ||
+			replay->bytes[replay->pos] != theBytes[i])
+		{
+			if (replay->pos >= replay->count)
+				fprintf(stderr, "replay: sent 0x%02x after the end of the recording (byte %u)\n",
+					theBytes[i], replay->pos);
+			else if (replay->dir[replay->pos] == REPLAY_IN)
+				fprintf(stderr, "replay: sent 0x%02x where the recording expected input (byte %u)\n",
+					theBytes[i], replay->pos);
+			else
+				fprintf(stderr, "replay: sent 0x%02x where the recording has 0x%02x (byte %u)\n",
+					theBytes[i], replay->bytes[replay->pos], replay->pos);
+
+			replay->diverged = true;
+		}
+		else
+			replay->pos++;
+	}
+
+	return numBytes;
+}
+
+static void ReplayFlush(LINK *link)
+{
+}
+
+const TRANSPORT replayTransport =
+{
+	"replay:", false, ReplayOpen, ReplayRead, ReplayWait, ReplayWrite, ReplayFlush, NULL, NULL, ReplayClose
+};
+
+//-----------------------------------------------------------------------------
+// choose the transport for a device name, and point *path past any prefix
+
+const TRANSPORT *FindTransport(const char *name, const char **path)
+{
+	static const TRANSPORT	*transports[] = {&ptyTransport, &tcpTransport, &replayTransport, &agentTransport, NULL};
+	int							i;
+
+	for (i=0; transports[i]; i++)
+	{
+		if (!strncmp(name, transports[i]->prefix, strlen(transports[i]->prefix)))
+		{
+			*path = name + strlen(transports[i]->prefix);
+			return transports[i];
+		}
+	}
+
+	*path = name;
+
+	if (!strncmp(name, "/dev/pts/", 9))
+		return &ptyTransport;
+
+	return &ttyTransport;
+}
+
+#endif // !WIN32
@@ -0,0 +1,71 @@
+//-----------------------------------------------------------------------------
+//
+//	PICSTART Plus programming interface
+//
+//-----------------------------------------------------------------------------
+//
+//	Cosmodog, Ltd.
+//	415 West Huron Street
+//	Chicago, IL   60610
+//	http://www.cosmodog.com
+//
+// Maintained at
+// http://home.pacbell.net/theposts/picmicro
+//
+//-----------------------------------------------------------------------------
+
+#ifndef __TRANSPORT_H_
+#define __TRANSPORT_H_
+
+#ifndef WIN32
+
+#include <sys/uio.h>
+
+// A transport carries bytes between picp and the programmer. The routines
+// in serial.c (ReadBytes, WriteBytes, SetDTR, ...) keep their interface and
+// call through the transport chosen when the device was opened:
+//
+//		/dev/ttyS0				a real serial port (tty)
+//		pty:/dev/pts/3			a pseudo-terminal, e.g. a programmer simulator
+//		tcp:host:port			a TCP connection to a serial bridge or agent
+//		replay:picpcomm.trc	play back a session recorded with -c
+//		agent:host:port		a picp agent next to the programmer (see agent.h)
+//
+// A pty under /dev/pts is recognized without the prefix.
+
+typedef struct link LINK;
+
+typedef struct
+{
+	const char	*prefix;			// device name prefix that selects this transport (NULL = none)
+	bool			termios;			// the descriptor is a terminal (speed, flow control apply)
+	bool			(*open)(LINK *link, const char *name);
+	int			(*read)(LINK *link, struct iovec *iov, int count);	// what is waiting now, 0 = none, -1 = error
+	bool			(*wait)(LINK *link, unsigned int timeOut);			// until something can be read (microseconds)
+	int			(*write)(LINK *link, const unsigned char *theBytes, unsigned int numBytes);
+	void			(*flush)(LINK *link);											// discard anything not yet read
+	void			(*getLines)(LINK *link, bool *CTS, bool *DCD);			// NULL = CTS and DCD always on
+	void			(*setDTR)(LINK *link, bool DTR);								// NULL = no DTR
+	void			(*close)(LINK *link);
+} TRANSPORT;
+
+struct link
+{
+	int					theDevice;		// descriptor handed back by OpenDevice
+	const TRANSPORT	*transport;
+	void					*state;			// the transport's own data
+};
+
+extern const TRANSPORT	ttyTransport, ptyTransport, tcpTransport, replayTransport, agentTransport;
+
+const TRANSPORT	*FindTransport(const char *name, const char **path);
+
+// for transports built on an ordinary descriptor
+
+int	FdRead(LINK *link, struct iovec *iov, int count);
+bool	FdWait(LINK *link, unsigned int timeOut);
+int	FdWrite(LINK *link, const unsigned char *theBytes, unsigned int numBytes);
+
+#endif // !WIN32
+
+#endif // defined __TRANSPORT_H_